@@ -2,13 +2,16 @@
 
 #include <SDL.h>
 #include <SDL_mixer.h>
+#include <algorithm>
 #include <filesystem>
 #include <iostream>
+#include <string.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #else
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #endif
 
@@ -88,6 +91,13 @@ static void handle_record_replay(ControllerInput &controller, PlatformState &pla
 void handle_events(ControllerInput &controller, PlatformState &platform_state) {
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
+        // Timestamped for measuring the latency to the frame that shows the input
+        const bool is_input = event.type == SDL_KEYDOWN || event.type == SDL_KEYUP || event.type == SDL_MOUSEMOTION ||
+                              event.type == SDL_MOUSEBUTTONDOWN || event.type == SDL_MOUSEBUTTONUP || event.type == SDL_MOUSEWHEEL;
+        if (is_input && controller.input_time == 0) {
+            controller.input_time = event.common.timestamp;
+        }
+
         if (event.type == SDL_QUIT) {
             closing = true;
         } else if (event.type == SDL_CONTROLLERDEVICEADDED) {
@@ -166,6 +176,24 @@ void handle_events(ControllerInput &controller, PlatformState &platform_state) {
                 case SDLK_F5:
                     controller.button_f5 = is_down;
                     break;
+                case SDLK_F6:
+                    controller.button_f6 = is_down;
+                    break;
+                case SDLK_F7:
+                    controller.button_f7 = is_down;
+                    break;
+                case SDLK_F8:
+                    controller.button_f8 = is_down;
+                    break;
+                case SDLK_F9:
+                    controller.button_f9 = is_down;
+                    break;
+                case SDLK_F10:
+                    controller.button_f10 = is_down;
+                    break;
+                case SDLK_F11:
+                    controller.button_f11 = is_down;
+                    break;
 #ifdef DEBUG
                 case SDLK_r:
                     if (is_down) {
@@ -324,8 +352,8 @@ bool is_game_lib_out_of_date(const std::filesystem::path& base_path) {
     return game_lib_time != std::filesystem::last_write_time(base_path / "GameCode.dll");
 }
 
-bool load_functions_from_game_lib(const char *lib_filename, InitializeFuncType *initialize_func, ReloadInitFuncType *reload_init_func,
-                                  UpdateFuncType *update_func, FinalizeFuncType *finalize_func) {
+bool load_functions_from_game_lib(const char *lib_filename, InitializeFuncType *initialize_func, PrepareReloadFuncType *prepare_reload_func,
+                                  ReloadInitFuncType *reload_init_func, UpdateFuncType *update_func, FinalizeFuncType *finalize_func) {
     game_lib_handle = SDL_LoadObject(lib_filename);
     if (!game_lib_handle) {
         LogError("Could not load the game lib!");
@@ -336,6 +364,11 @@ bool load_functions_from_game_lib(const char *lib_filename, InitializeFuncType *
         LogError("Could not load the initialize function from the game lib!");
         return false;
     }
+    (*prepare_reload_func) = (PrepareReloadFuncType)SDL_LoadFunction(game_lib_handle, "prepare_reload");
+    if (!(*prepare_reload_func)) {
+        LogError("Could not load the prepare_reload function from the game lib!");
+        return false;
+    }
     (*reload_init_func) = (ReloadInitFuncType)SDL_LoadFunction(game_lib_handle, "reload_init");
     if (!(*reload_init_func)) {
         LogError("Could not load the reload_init function from the game lib!");
@@ -365,9 +398,9 @@ bool try_copy_file(const std::filesystem::path& src_path, const std::filesystem:
     return false;
 }
 
-bool load_game_lib(const std::filesystem::path& base_path, InitializeFuncType *initialize_func, ReloadInitFuncType *reload_init_func, UpdateFuncType *update_func, FinalizeFuncType *finalize_func) {
+bool load_game_lib(const std::filesystem::path& base_path, InitializeFuncType *initialize_func, PrepareReloadFuncType *prepare_reload_func, ReloadInitFuncType *reload_init_func, UpdateFuncType *update_func, FinalizeFuncType *finalize_func) {
 #ifndef DEBUG
-    return load_functions_from_game_lib("GameCode.dll", initialize_func, reload_init_func, update_func, finalize_func);
+    return load_functions_from_game_lib("GameCode.dll", initialize_func, prepare_reload_func, reload_init_func, update_func, finalize_func);
 #else
 
     const std::filesystem::path org_filename = base_path / "GameCode.dll";
@@ -376,7 +409,8 @@ bool load_game_lib(const std::filesystem::path& base_path, InitializeFuncType *i
     int32 tries = 50;
     while (true) {
         if (try_copy_file(org_filename, new_filename)) {
-            const bool result = load_functions_from_game_lib("GameCode_temp.dll", initialize_func, reload_init_func, update_func, finalize_func);
+            const bool result = load_functions_from_game_lib("GameCode_temp.dll", initialize_func, prepare_reload_func, reload_init_func, update_func,
+                                                             finalize_func);
             if (!result) {
                 return false;
             }
@@ -408,12 +442,14 @@ static float32 sdl_get_seconds_elapsed(uint64 old_counter, uint64 current_counte
     return ((float32)(current_counter - old_counter) / (float32)(perf_frequency));
 }
 
-void handle_hot_reload(const std::filesystem::path &base_path, InitializeFuncType initialize_func, ReloadInitFuncType reload_init_func,
-                       FinalizeFuncType finalize_func,
-                       UpdateFuncType game_loop_func, PlatformState &platform_state) {
+// The function pointers are updated in place, so the main loop calls into the new lib
+void handle_hot_reload(const std::filesystem::path &base_path, InitializeFuncType &initialize_func, PrepareReloadFuncType &prepare_reload_func,
+                       ReloadInitFuncType &reload_init_func, FinalizeFuncType &finalize_func, UpdateFuncType &game_loop_func, PlatformState &platform_state) {
     if (is_game_lib_out_of_date(base_path)) {
+        // Game code running on other threads has to stop before its lib is unloaded
+        prepare_reload_func(&platform_state.game_memory);
         unload_game_lib();
-        const bool result = load_game_lib(base_path, &initialize_func, &reload_init_func, &game_loop_func, &finalize_func);
+        const bool result = load_game_lib(base_path, &initialize_func, &prepare_reload_func, &reload_init_func, &game_loop_func, &finalize_func);
         if (!result) {
             exit(1);
         }
@@ -452,6 +488,58 @@ bool init_memory(GameMemory &memory) {
     return true;
 }
 
+// Options: --aa none|fxaa|msaa2|msaa4|msaa8, --dynamic-res on|off, --fps vsync|uncapped|<frames per second>, --latency low|normal,
+// --hitch-budget on|off|<milliseconds>
+void parse_settings(const int32 argc, char **argv, GameSettings &settings) {
+    for (int32 i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--aa") == 0 && i + 1 < argc) {
+            const char *mode = argv[++i];
+            const int32 samples = strncmp(mode, "msaa", 4) == 0 ? atoi(mode + 4) : -1;
+            if (strcmp(mode, "none") == 0 || samples == 0) {
+                settings.anti_aliasing = AntiAliasing::NONE;
+            } else if (strcmp(mode, "fxaa") == 0) {
+                settings.anti_aliasing = AntiAliasing::FXAA;
+            } else if (samples == 2 || samples == 4 || samples == 8) {
+                settings.anti_aliasing = AntiAliasing::MSAA;
+                settings.msaa_samples = samples;
+            } else {
+                LogError("Unknown anti aliasing mode: %s", mode);
+            }
+        } else if (strcmp(argv[i], "--dynamic-res") == 0 && i + 1 < argc) {
+            settings.dynamic_resolution = strcmp(argv[++i], "off") != 0;
+        } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            const char *mode = argv[++i];
+            const float32 cap = (float32)atof(mode);
+            if (strcmp(mode, "vsync") == 0) {
+                settings.frame_rate_mode = FrameRateMode::VSYNC;
+            } else if (strcmp(mode, "uncapped") == 0) {
+                settings.frame_rate_mode = FrameRateMode::UNCAPPED;
+            } else if (cap > 0.0f) {
+                settings.frame_rate_mode = FrameRateMode::CAPPED;
+                settings.frame_rate_cap = cap;
+            } else {
+                LogError("Unknown frame rate mode: %s", mode);
+            }
+        } else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc) {
+            settings.low_latency = strcmp(argv[++i], "low") == 0;
+        } else if (strcmp(argv[i], "--hitch-budget") == 0 && i + 1 < argc) {
+            const char *budget = argv[++i];
+            const float32 budget_ms = (float32)atof(budget);
+            if (strcmp(budget, "on") == 0) {
+                settings.hitch_budget_ms = Config::System::HITCH_BUDGET_MS;
+            } else if (strcmp(budget, "off") == 0) {
+                settings.hitch_budget_ms = 0.0f;
+            } else if (budget_ms > 0.0f) {
+                settings.hitch_budget_ms = budget_ms;
+            } else {
+                LogError("Unknown hitch budget: %s", budget);
+            }
+        } else {
+            LogError("Unknown option: %s", argv[i]);
+        }
+    }
+}
+
 bool sdl_init_graphics(SDL_Window *&window, SDL_Surface *&screen_surface) {
     int32 screen_width = Config::Graphics::DEBUG_WINDOW_WIDTH;
     int32 screen_height = Config::Graphics::DEBUG_WINDOW_HEIGHT;
@@ -480,9 +568,9 @@ bool sdl_init_graphics(SDL_Window *&window, SDL_Surface *&screen_surface) {
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
 
-    // Multi-sampling for anti aliasing
-    SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
-    SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 8);
+    // Anti aliasing is done in the offscreen scene target, so the window does not need multi-sampling
+    SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 0);
+    SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 0);
 
     window = SDL_CreateWindow(GameName, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, screen_width, screen_height, window_properties);
     if (!window) {
@@ -497,7 +585,6 @@ bool sdl_init_graphics(SDL_Window *&window, SDL_Surface *&screen_surface) {
         LogError("Could not create OpenGL context: %s\n", SDL_GetError());
         return false;
     }
-    SDL_GL_SetSwapInterval(1);
 
     screen_surface = SDL_GetWindowSurface(window);
     SDL_ShowCursor(SDL_DISABLE);
@@ -508,17 +595,172 @@ bool sdl_init_graphics(SDL_Window *&window, SDL_Surface *&screen_surface) {
     return true;
 }
 
-void sleep(float32 seconds, uint64 last_counter, uint64 perf_frequency, float32 TARGET_SPF) {
-    const int32 time_to_sleep = (int32)((seconds) * 1000) - 1;
-    if (time_to_sleep > 0) {
-        SDL_Delay(time_to_sleep);
+#ifdef _WIN32
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+#endif
+
+// Waits until the frame deadline without burning a core. The OS sleep is trusted to wake up within the slack, which is measured at
+// startup and adapted to the observed overshoot, and only the remaining slack is spun. With vsync the swap does the waiting.
+struct FramePacer {
+    FrameRateMode mode;
+    uint64 perf_frequency;
+    uint64 frame_ticks;  // 0 when the pacer does not wait
+    uint64 next_deadline;
+    uint64 last_frame_counter;
+    float64 slack;
+    float32 intervals[Config::System::FRAME_PACING_STATS_FRAMES];  // Milliseconds between frames
+    uint32 interval_count;
+#ifdef _WIN32
+    HANDLE timer;
+#endif
+};
+
+static float64 sdl_get_seconds_elapsed_precise(uint64 old_counter, uint64 current_counter, uint64 perf_frequency) {
+    return (float64)(current_counter - old_counter) / (float64)perf_frequency;
+}
+
+static void os_sleep(const FramePacer &pacer, const float64 seconds) {
+#ifdef _WIN32
+    if (pacer.timer) {
+        LARGE_INTEGER due_time;
+        due_time.QuadPart = -(LONGLONG)(seconds * 1e7);  // Relative time in 100 ns units
+        SetWaitableTimer(pacer.timer, &due_time, 0, nullptr, nullptr, FALSE);
+        WaitForSingleObject(pacer.timer, INFINITE);
+    } else {
+        Sleep((DWORD)(seconds * 1000.0));
+    }
+#else
+    (void)pacer;
+    timespec duration;
+    duration.tv_sec = (time_t)seconds;
+    duration.tv_nsec = (long)((seconds - (float64)duration.tv_sec) * 1e9);
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &duration, nullptr);
+#endif
+}
+
+void init_frame_pacer(FramePacer &pacer, const GameSettings &settings, SDL_Window *window) {
+    pacer.mode = settings.frame_rate_mode;
+    pacer.perf_frequency = SDL_GetPerformanceFrequency();
+    pacer.frame_ticks = 0;
+    pacer.interval_count = 0;
+#ifdef _WIN32
+    // High resolution timers need Windows 10 1803, older versions get a regular one
+    pacer.timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (!pacer.timer) {
+        pacer.timer = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+    }
+#endif
+
+    float32 frame_rate = settings.frame_rate_cap;
+    if (pacer.mode == FrameRateMode::VSYNC) {
+        if (SDL_GL_SetSwapInterval(1) != 0) {
+            // Without vsync the pacer caps the frame rate to the refresh rate
+            SDL_DisplayMode display_mode;
+            if (SDL_GetWindowDisplayMode(window, &display_mode) == 0 && display_mode.refresh_rate > 0) {
+                frame_rate = (float32)display_mode.refresh_rate;
+            }
+            LogWarn("Could not enable vsync: %s, capping to %.0f fps", SDL_GetError(), frame_rate);
+            pacer.mode = FrameRateMode::CAPPED;
+        }
+    } else {
+        SDL_GL_SetSwapInterval(0);
+    }
+    if (pacer.mode == FrameRateMode::CAPPED) {
+        pacer.frame_ticks = (uint64)((float64)pacer.perf_frequency / frame_rate);
+    }
+
+    // The worst overshoot of short sleeps is the initial slack
+    constexpr float64 TEST_SLEEP = 0.001;
+    float64 worst_overshoot = 0.0;
+    for (int32 i = 0; i < 10; i++) {
+        const uint64 start_counter = SDL_GetPerformanceCounter();
+        os_sleep(pacer, TEST_SLEEP);
+        const float64 slept = sdl_get_seconds_elapsed_precise(start_counter, SDL_GetPerformanceCounter(), pacer.perf_frequency);
+        worst_overshoot = MAX(worst_overshoot, slept - TEST_SLEEP);
+    }
+    pacer.slack = MAX(worst_overshoot, Config::System::FRAME_PACING_MIN_SLACK);
+    LogInfo("Sleep granularity: 1 ms sleeps wake up to %.3f ms late", worst_overshoot * 1000.0);
+
+    pacer.last_frame_counter = SDL_GetPerformanceCounter();
+    pacer.next_deadline = pacer.last_frame_counter + pacer.frame_ticks;
+}
+
+void finalize_frame_pacer(FramePacer &pacer) {
+#ifdef _WIN32
+    if (pacer.timer) {
+        CloseHandle(pacer.timer);
+    }
+#else
+    (void)pacer;
+#endif
+}
+
+void wait_for_next_frame(FramePacer &pacer) {
+    if (pacer.frame_ticks == 0) {
+        return;
     }
-    while (sdl_get_seconds_elapsed(last_counter, SDL_GetPerformanceCounter(), perf_frequency) < TARGET_SPF) {
-        // Precise waiting for the last 1 ms...
+
+    const uint64 deadline = pacer.next_deadline;
+    const uint64 now = SDL_GetPerformanceCounter();
+    if (now >= deadline) {
+        // A frame later than a whole frame restarts the schedule instead of rushing the following frames
+        pacer.next_deadline = (now - deadline > pacer.frame_ticks ? now : deadline) + pacer.frame_ticks;
+        return;
     }
+
+    const float64 remaining = sdl_get_seconds_elapsed_precise(now, deadline, pacer.perf_frequency);
+    if (remaining > pacer.slack) {
+        const float64 sleep_seconds = remaining - pacer.slack;
+        os_sleep(pacer, sleep_seconds);
+        const float64 overshoot = sdl_get_seconds_elapsed_precise(now, SDL_GetPerformanceCounter(), pacer.perf_frequency) - sleep_seconds;
+
+        // The slack jumps up after a late wake up and decays slowly back down
+        const float64 frame_seconds = (float64)pacer.frame_ticks / (float64)pacer.perf_frequency;
+        const float64 target_slack = overshoot * Config::System::FRAME_PACING_SLACK_MARGIN;
+        if (overshoot > pacer.slack) {
+            pacer.slack = MIN(target_slack, frame_seconds);
+        } else {
+            pacer.slack += (target_slack - pacer.slack) * Config::System::FRAME_PACING_SLACK_DECAY;
+            pacer.slack = MAX(pacer.slack, Config::System::FRAME_PACING_MIN_SLACK);
+        }
+    }
+    while (SDL_GetPerformanceCounter() < deadline) {
+        // Precise waiting for the slack
+    }
+    pacer.next_deadline = deadline + pacer.frame_ticks;
 }
 
-int32 main(int32, char **) {
+void record_frame(FramePacer &pacer, const uint64 end_counter) {
+    const float64 interval = sdl_get_seconds_elapsed_precise(pacer.last_frame_counter, end_counter, pacer.perf_frequency);
+    pacer.intervals[pacer.interval_count++ % Config::System::FRAME_PACING_STATS_FRAMES] = (float32)(interval * 1000.0);
+    pacer.last_frame_counter = end_counter;
+}
+
+#ifdef DEBUG
+// Jitter is the difference of the frame intervals from the target interval, or from the median interval if the pacer has no target
+void log_frame_pacing(FramePacer &pacer) {
+    constexpr uint32 COUNT = Config::System::FRAME_PACING_STATS_FRAMES;
+    float32 jitter[COUNT];
+    std::copy(pacer.intervals, pacer.intervals + COUNT, jitter);
+    std::sort(jitter, jitter + COUNT);
+    const float32 median = jitter[COUNT / 2];
+    const float32 target = pacer.frame_ticks ? (float32)(1000.0 * (float64)pacer.frame_ticks / (float64)pacer.perf_frequency) : median;
+    for (uint32 i = 0; i < COUNT; i++) {
+        jitter[i] = fabsf(pacer.intervals[i] - target);
+    }
+    std::sort(jitter, jitter + COUNT);
+
+    const char *mode_names[] = {"uncapped", "capped", "vsync"};
+    LogDebug("Frame pacing (%s): %.2f ms median interval, jitter p50 %.3f, p95 %.3f, p99 %.3f, max %.3f ms, sleep slack %.3f ms",
+             mode_names[(int32)pacer.mode], median, jitter[COUNT / 2], jitter[COUNT * 95 / 100], jitter[COUNT * 99 / 100], jitter[COUNT - 1],
+             pacer.slack * 1000.0);
+    pacer.interval_count = 0;
+}
+#endif
+
+int32 main(int32 argc, char **argv) {
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER | SDL_INIT_AUDIO) != 0) {
         std::cerr << "SDL_Init Error: " << SDL_GetError() << std::endl;
         return 1;
@@ -535,10 +777,11 @@ int32 main(int32, char **) {
     std::filesystem::create_directory(save_path);
 
     InitializeFuncType game_initialize;
+    PrepareReloadFuncType game_prepare_reload;
     ReloadInitFuncType game_on_reload;
     FinalizeFuncType game_finalize;
     UpdateFuncType game_loop;
-    if (!load_game_lib(base_path, &game_initialize, &game_on_reload, &game_loop, &game_finalize)) {
+    if (!load_game_lib(base_path, &game_initialize, &game_prepare_reload, &game_on_reload, &game_loop, &game_finalize)) {
         return 1;
     }
 
@@ -549,12 +792,14 @@ int32 main(int32, char **) {
     }
 
     PlatformState platform_state = {};
+    parse_settings(argc, argv, platform_state.game_memory.settings);
     if (!init_memory(platform_state.game_memory)) {
         return 1;
     }
 
-    constexpr float32 TARGET_SPF = 1.0f / Config::Game::TARGET_FPS;
     const uint64 perf_frequency = SDL_GetPerformanceFrequency();
+    FramePacer frame_pacer;
+    init_frame_pacer(frame_pacer, platform_state.game_memory.settings, window);
 
     ControllerInput controller = {};
     uint64 last_counter = SDL_GetPerformanceCounter();
@@ -571,7 +816,7 @@ int32 main(int32, char **) {
         }
 
 #ifdef DEBUG
-        handle_hot_reload(base_path, game_initialize, game_on_reload, game_finalize, game_loop, platform_state);
+        handle_hot_reload(base_path, game_initialize, game_prepare_reload, game_on_reload, game_finalize, game_loop, platform_state);
         handle_record_replay(controller, platform_state);
 #endif
 
@@ -580,24 +825,28 @@ int32 main(int32, char **) {
         update_counter = new_update_counter;
 
         game_loop(&platform_state.game_memory, screen_surface, window, &controller, time_delta);
-        
-        const uint64 before_sleep_counter = SDL_GetPerformanceCounter();
-        const float32 seconds_elapsed = sdl_get_seconds_elapsed(last_counter, before_sleep_counter, perf_frequency);
-        if (seconds_elapsed < TARGET_SPF) {
-            sleep(TARGET_SPF - seconds_elapsed, last_counter, perf_frequency, TARGET_SPF);
-        }
+        controller.input_time = 0;
 
+#ifdef DEBUG
+        const uint64 before_sleep_counter = SDL_GetPerformanceCounter();
+#endif
+        wait_for_next_frame(frame_pacer);
         const uint64 end_counter = SDL_GetPerformanceCounter();
+        record_frame(frame_pacer, end_counter);
 
 #ifdef DEBUG
         if (frame_count % 120 == 0) {
             log_fps(last_counter, before_sleep_counter, end_counter, perf_frequency);
         }
+        if (frame_pacer.interval_count == Config::System::FRAME_PACING_STATS_FRAMES) {
+            log_frame_pacing(frame_pacer);
+        }
 #endif
 
         last_counter = end_counter;
         if (closing) {
             game_finalize(&platform_state.game_memory);
+            finalize_frame_pacer(frame_pacer);
             break;
         }
         frame_count++;
@@ -6,39 +6,30 @@
 #include "Chunk.h"
 #include "Config.h"
 #include "Definitions.h"
+#include "Entities.h"
 #include "Geometry.h"
+#include "Particles.h"
 #include "Utility.h"
 
 struct SDL_Surface;
 struct SDL_Window;
 
-struct Particle {
-    Vector3f pos = {};
-    Vector3f speed = {};
-    Vector3f color = {};
-    glm::quat rotation = {};
-    Vector2f rot_speed = {};
-    float32 scale = 1;
-    float32 age = 0;
-
-    void initialize(const Vector3f pos_init, const Vector3f color_init, const float32 scale_init) {
-        this->scale = scale_init;
-        this->age = (rand_float() - 0.5f) * 0.5f;
-        this->pos = pos_init;
-        this->pos.x += rand_float() - 0.5f;
-        this->pos.y += rand_float() - 0.5f;
-        this->pos.z += rand_float() - 0.5f;
-        this->speed.x = (rand_float() - 0.5f) * 5;
-        this->speed.y = rand_float() * 5;
-        this->speed.z = (rand_float() - 0.5f) * 5;
-        this->color = color_init;
-        this->rotation = {1, 0, 0, 0};
-        this->rot_speed.x = (rand_float() - 0.5f) * 10;
-        this->rot_speed.y = (rand_float() - 0.5f) * 10;
-    }
+enum class AntiAliasing { NONE, MSAA, FXAA };
+enum class FrameRateMode { UNCAPPED, CAPPED, VSYNC };
+
+// Startup options, read from the command line by the platform layer
+struct GameSettings {
+    AntiAliasing anti_aliasing = AntiAliasing::MSAA;
+    int32 msaa_samples = 8;
+    bool dynamic_resolution = true;
+    FrameRateMode frame_rate_mode = FrameRateMode::VSYNC;
+    float32 frame_rate_cap = Config::Game::TARGET_FPS;  // Frames per second in the capped mode
+    bool low_latency = false;  // Late mouse look and one frame in flight, for less input latency at some cost of throughput
+    float32 hitch_budget_ms = 0;  // Slower frames get a trace saved, 0 turns the hitch monitor off
 };
 
 struct GameMemory {
+    GameSettings settings;
     void *permanent_storage;
     uint64 permanent_storage_size;
     void *record_storage;
@@ -65,18 +56,6 @@ inline void *push_size(MemoryArena &arena, const size_t size) {
     return result;
 }
 
-struct BlockEntity {
-    Vector3f pos = {};
-    Vector3f speed = {};
-    glm::quat rotation = {1.0f, 0.0f, 0.0f, 0.0f};
-    Vector2f rot_speed = {};
-    float32 age = 0;
-
-    Vector3f color = {};
-    bool bound = false;
-    Vector3f bound_offset = {};
-};
-
 struct Player {
     Vector3f pos = {-5, 96, 5};
     Vector3f speed = {};
@@ -86,7 +65,7 @@ struct Player {
     int32 selected_block = 0;
     bool on_ground = false;
     float32 fov = 45.f;
-    BlockEntity *hand_entity = nullptr;
+    EntityHandle hand_entity;
     bool throw_mode = false;
 };
 
@@ -102,22 +81,46 @@ struct Sun {
     float32 speed_boost = 1;
 };
 
+// Counters of the last rendered frame
+struct RenderStats {
+    uint32 shadow_cascades_rendered = 0;
+    // GPU milliseconds of the passes of a recent frame, from timer queries
+    float32 gpu_shadows_ms = 0;
+    float32 gpu_depth_prepass_ms = 0;
+    float32 gpu_instances_ms = 0;
+    float32 gpu_chunks_ms = 0;
+    float32 gpu_present_ms = 0;
+    float32 gpu_passes_ms = 0;  // Sum of the passes above, without the gaps where the GPU waits for the CPU
+    float32 gpu_frame_ms = 0;
+    float32 resolution_scale = 1;  // Of the 3D scene, relative to the screen
+    float32 input_latency_ms = 0;  // From the oldest input event drawn in the frame to the return of its swap, 0 without input
+    float32 gpu_wait_ms = 0;       // Waited for the GPU to keep the frames in flight under the limit
+};
+
+// The simulation runs in fixed steps and rendering interpolates between the last two of them
+struct SimulationClock {
+    float32 accumulator = 0;    // Time not simulated yet
+    float32 alpha = 1;          // Where the rendered frame is between the previous step (0) and the latest step (1)
+    Vector3f player_prev_pos;   // Player position before the latest step
+};
+
 struct GameState {
     MemoryArena world_arena;
     MemoryArena scratch_arena;
     std::filesystem::path save_path;
     char world_name[32] = "world";
-    uint32 particle_count = 0;
-    uint32 entity_count = 0;
     uint64 frame_count = 0;
     bool debug_visuals_enabled = false;
 
     Player player;
     Sun sun;
+    RenderStats render_stats;
+    SimulationClock simulation;
 
     Vector3f stars[Config::Game::STAR_COUNT];
-    Particle particles[Config::Game::PARTICLE_LIMIT];
-    BlockEntity entities[Config::Game::ENTITY_LIMIT];
+    ParticleSystem particles;
+    EntityStore entities;
+    EntityGrid entity_grid;
     ChunkMap chunk_map;
 
     void get_save_file_name(std::filesystem::path &filename) const {
@@ -134,6 +137,7 @@ struct ControllerInput {
     int32 mouse_move_x;
     int32 mouse_move_y;
     int32 mouse_wheel;
+    uint32 input_time;  // SDL ticks of the oldest input event since the last frame, 0 if there was none
     bool button_mouse_l;
     bool button_mouse_r;
     bool button_mouse_m;
@@ -155,11 +159,18 @@ struct ControllerInput {
     bool button_f3;
     bool button_f4;
     bool button_f5;
+    bool button_f6;
+    bool button_f7;
+    bool button_f8;
+    bool button_f9;
+    bool button_f10;
+    bool button_f11;
 };
 
 enum class ShadowMode { NONE, SHADOW_MAP, SHADOW_VOLUME };
 
 typedef void (*FinalizeFuncType)(GameMemory *);
+typedef void (*PrepareReloadFuncType)(GameMemory *);
 typedef void (*ReloadInitFuncType)(GameMemory *);
 typedef void (*InitializeFuncType)(GameMemory *, const std::filesystem::path &);
 typedef void (*UpdateFuncType)(GameMemory *, SDL_Surface *, SDL_Window *, ControllerInput *, float32);
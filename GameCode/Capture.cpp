@@ -0,0 +1,300 @@
+#include "Capture.h"
+
+#include <glad/glad.h>
+#include <SDL_mutex.h>
+#include <SDL_stdinc.h>
+#include <SDL_thread.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb/stb_image_write.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Config.h"
+#include "Utility.h"
+
+namespace Capture {
+
+// A frame read into a pixel buffer, waiting for its fence
+struct Readback {
+    GLuint pbo;
+    GLsync fence;
+    uint32 size;
+    int32 width;
+    int32 height;
+    bool is_png;
+    std::filesystem::path path;
+};
+
+// A frame copied out of its pixel buffer, waiting for the worker thread. The main thread fills a job while is_ready is false and the worker
+// clears is_ready once the file is written, both under the mutex.
+struct Job {
+    uint8 *pixels;
+    uint32 capacity;
+    int32 width;
+    int32 height;
+    bool is_png;
+    bool is_ready;
+    std::filesystem::path path;
+};
+
+static bool is_initialized = false;
+static std::filesystem::path base_path;
+
+static Readback readbacks[Config::Graphics::CAPTURE_PBO_COUNT];
+static uint32 readback_first = 0;  // Oldest readback in flight
+static uint32 readback_count = 0;
+
+static Job jobs[Config::Graphics::CAPTURE_QUEUE_LENGTH];
+static uint32 job_next = 0;  // Next job filled by the main thread, the worker takes them in the same order
+static SDL_mutex *job_mutex;
+static SDL_cond *job_cond;
+static SDL_Thread *worker_thread;
+static bool is_quitting;
+
+static bool is_screenshot_requested = false;
+static bool is_sequence_running = false;
+static std::filesystem::path sequence_path;
+static uint32 sequence_frame;
+static uint32 sequence_written;
+static uint32 sequence_dropped;
+
+static void write_job(Job &job) {
+    // The frame is read as RGBA so the rows stay aligned, the files are RGB
+    const uint32 pixel_count = job.width * job.height;
+    for (uint32 i = 0; i < pixel_count; i++) {
+        job.pixels[i * 3 + 0] = job.pixels[i * 4 + 0];
+        job.pixels[i * 3 + 1] = job.pixels[i * 4 + 1];
+        job.pixels[i * 3 + 2] = job.pixels[i * 4 + 2];
+    }
+
+    // Sequences are written as BMP, encoding PNGs could not keep up with the frames
+    const std::string path = job.path.string();
+    const bool result = job.is_png ? stbi_write_png(path.c_str(), job.width, job.height, 3, job.pixels, job.width * 3)
+                                   : stbi_write_bmp(path.c_str(), job.width, job.height, 3, job.pixels);
+    if (!result) {
+        LogError("Could not write capture %s", path.c_str());
+    } else if (job.is_png) {
+        LogInfo("Screenshot saved to %s", path.c_str());
+    }
+}
+
+static int worker(void *) {
+    uint32 next = 0;
+    SDL_LockMutex(job_mutex);
+    while (true) {
+        while (!jobs[next].is_ready && !is_quitting) {
+            SDL_CondWait(job_cond, job_mutex);
+        }
+        // The queue is drained before quitting
+        if (!jobs[next].is_ready) {
+            break;
+        }
+
+        SDL_UnlockMutex(job_mutex);
+        write_job(jobs[next]);
+        SDL_LockMutex(job_mutex);
+
+        jobs[next].is_ready = false;
+        SDL_CondBroadcast(job_cond);
+        next = (next + 1) % Config::Graphics::CAPTURE_QUEUE_LENGTH;
+    }
+    SDL_UnlockMutex(job_mutex);
+    return 0;
+}
+
+// Hands the finished readbacks to the worker in order. Without wait, stops at the first one the GPU or the worker is not ready for.
+static void collect_readbacks(const bool wait) {
+    while (readback_count > 0) {
+        Readback &readback = readbacks[readback_first];
+        const GLenum status = wait ? glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) : glClientWaitSync(readback.fence, 0, 0);
+        if (status == GL_TIMEOUT_EXPIRED && !wait) {
+            return;
+        }
+
+        Job &job = jobs[job_next];
+        SDL_LockMutex(job_mutex);
+        while (job.is_ready && wait) {
+            SDL_CondWait(job_cond, job_mutex);
+        }
+        const bool is_queue_full = job.is_ready;
+        SDL_UnlockMutex(job_mutex);
+        if (is_queue_full) {
+            return;
+        }
+
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+            const uint32 size = readback.width * readback.height * 4;
+            if (job.capacity < size) {
+                SDL_free(job.pixels);
+                job.pixels = (uint8 *)SDL_malloc(size);
+                job.capacity = size;
+            }
+
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+            const void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+            if (pixels) {
+                memcpy(job.pixels, pixels, size);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+
+                job.width = readback.width;
+                job.height = readback.height;
+                job.is_png = readback.is_png;
+                job.path = readback.path;
+                SDL_LockMutex(job_mutex);
+                job.is_ready = true;
+                SDL_CondBroadcast(job_cond);
+                SDL_UnlockMutex(job_mutex);
+                job_next = (job_next + 1) % Config::Graphics::CAPTURE_QUEUE_LENGTH;
+            } else {
+                LogError("Could not map the capture buffer");
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        } else {
+            LogError("Capture readback failed");
+        }
+
+        glDeleteSync(readback.fence);
+        readback.fence = nullptr;
+        readback_first = (readback_first + 1) % Config::Graphics::CAPTURE_PBO_COUNT;
+        readback_count--;
+    }
+}
+
+void initialize(const std::filesystem::path &save_path) {
+    base_path = save_path;
+    is_screenshot_requested = false;
+    is_sequence_running = false;
+
+    for (Readback &readback : readbacks) {
+        glGenBuffers(1, &readback.pbo);
+        readback.fence = nullptr;
+        readback.size = 0;
+    }
+    readback_first = 0;
+    readback_count = 0;
+
+    for (Job &job : jobs) {
+        job.pixels = nullptr;
+        job.capacity = 0;
+        job.is_ready = false;
+    }
+    job_next = 0;
+    is_quitting = false;
+    job_mutex = SDL_CreateMutex();
+    job_cond = SDL_CreateCond();
+    worker_thread = SDL_CreateThread(worker, "Capture", nullptr);
+    if (!worker_thread) {
+        LogError("Could not create the capture thread: %s", SDL_GetError());
+        return;
+    }
+
+    stbi_flip_vertically_on_write(true);
+    is_initialized = true;
+}
+
+void finalize() {
+    if (!is_initialized) {
+        return;
+    }
+    if (is_sequence_running) {
+        switch_sequence();
+    }
+
+    // Pending frames are still written
+    collect_readbacks(true);
+    SDL_LockMutex(job_mutex);
+    is_quitting = true;
+    SDL_CondBroadcast(job_cond);
+    SDL_UnlockMutex(job_mutex);
+    SDL_WaitThread(worker_thread, nullptr);
+
+    SDL_DestroyCond(job_cond);
+    SDL_DestroyMutex(job_mutex);
+    for (Job &job : jobs) {
+        SDL_free(job.pixels);
+    }
+    for (Readback &readback : readbacks) {
+        glDeleteBuffers(1, &readback.pbo);
+    }
+    is_initialized = false;
+}
+
+void request_screenshot() { is_screenshot_requested = true; }
+
+void switch_sequence() {
+    if (is_sequence_running) {
+        is_sequence_running = false;
+        LogInfo("Captured %u frames to %s, %u dropped", sequence_written, sequence_path.string().c_str(), sequence_dropped);
+        return;
+    }
+
+    char timestamp[32];
+    format_timestamp(timestamp, sizeof(timestamp));
+    sequence_path = base_path / "captures" / timestamp;
+    std::error_code error;
+    std::filesystem::create_directories(sequence_path, error);
+    if (error) {
+        LogError("Could not create the capture directory %s", sequence_path.string().c_str());
+        return;
+    }
+    is_sequence_running = true;
+    sequence_frame = 0;
+    sequence_written = 0;
+    sequence_dropped = 0;
+    LogInfo("Capturing every %u frames to %s", Config::Graphics::CAPTURE_SEQUENCE_INTERVAL, sequence_path.string().c_str());
+}
+
+void capture_frame(const int32 width, const int32 height) {
+    if (!is_initialized) {
+        return;
+    }
+    collect_readbacks(false);
+
+    const bool is_sequence_frame = is_sequence_running && sequence_frame++ % Config::Graphics::CAPTURE_SEQUENCE_INTERVAL == 0;
+    if (!is_screenshot_requested && !is_sequence_frame) {
+        return;
+    }
+    // All buffers are in flight, a requested screenshot waits for the next frame
+    if (readback_count == Config::Graphics::CAPTURE_PBO_COUNT) {
+        if (is_sequence_frame) {
+            sequence_dropped++;
+        }
+        return;
+    }
+
+    Readback &readback = readbacks[(readback_first + readback_count) % Config::Graphics::CAPTURE_PBO_COUNT];
+    if (is_screenshot_requested) {
+        char timestamp[32];
+        format_timestamp(timestamp, sizeof(timestamp));
+        const std::filesystem::path screenshot_dir = base_path / "screenshots";
+        std::error_code error;
+        std::filesystem::create_directories(screenshot_dir, error);
+        readback.path = screenshot_dir / (std::string("screenshot_") + timestamp + ".png");
+        readback.is_png = true;
+        is_screenshot_requested = false;
+        // A sequence frame at the same time is skipped
+        if (is_sequence_frame) {
+            sequence_dropped++;
+        }
+    } else {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "frame_%06u.bmp", sequence_written++);
+        readback.path = sequence_path / filename;
+        readback.is_png = false;
+    }
+    readback.width = width;
+    readback.height = height;
+
+    const uint32 size = width * height * 4;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+    if (readback.size < size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+        readback.size = size;
+    }
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback_count++;
+}
+}  // namespace Capture
@@ -0,0 +1,14 @@
+#pragma once
+#include <filesystem>
+
+#include "Definitions.h"
+
+// Screenshots and image sequences. The frame is read back asynchronously and encoded and written on a worker thread.
+namespace Capture {
+void initialize(const std::filesystem::path &save_path);
+void finalize();
+void request_screenshot();
+void switch_sequence();
+// Called after the frame is drawn into the default framebuffer, before the swap
+void capture_frame(int32 width, int32 height);
+}  // namespace Capture
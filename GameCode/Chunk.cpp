@@ -5,6 +5,7 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include "AABB.h"
+#include "Profiler.h"
 #include "Shader.h"
 #include "glad/glad.h"
 #include "noise/SimplexNoise.h"
@@ -91,34 +92,160 @@ Vector3f *block_color_map = block_color_map_pastel;
 
 float32 block_noise_values[Config::World::CHUNK_SIZE * Config::World::CHUNK_SIZE * 4 * 4];
 
-void Chunk::initialize_open_gl_stuff(const bool do_update) {
-    glGenVertexArrays(1, &vao_chunk);
-    glBindVertexArray(vao_chunk);
-    glGenBuffers(1, &vbo_chunk);
-    if (do_update) {
-        update();
-    }
-    glBindBuffer(GL_ARRAY_BUFFER, vbo_chunk);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 10 * sizeof(float32), (void *)nullptr);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 10 * sizeof(float32), (void *)(3 * sizeof(float32)));
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 10 * sizeof(float32), (void *)(6 * sizeof(float32)));
-    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, 10 * sizeof(float32), (void *)(9 * sizeof(float32)));
+uint8 FaceFilter::get_face_mask(const AABB &box) const {
+    if (!has_eye) {
+        return direction_mask;
+    }
+    return (eye.z < box.max.z) | (eye.z > box.min.z) << 1 | (eye.x < box.max.x) << 2 | (eye.x > box.min.x) << 3 | (eye.y < box.max.y) << 4 |
+           (eye.y > box.min.y) << 5;
+}
+
+// The faces of each direction are built in their own part of the buffer. They are packed back to back into one buffer with
+// the positions of all vertices first and the other attributes after them, so depth passes can read positions alone.
+void Chunk::upload_section(const int32 section, float32 *const *face_vertices, const uint32 *face_attr_counts, float32 *staging) {
+    ChunkSection &mesh = sections[section];
+    uint32 vertex_count = 0;
+    for (int32 f = 0; f < 6; f++) {
+        vertex_count += face_attr_counts[f] / 10;
+    }
+    if (vertex_count > 0 || mesh.vertex_count > 0) {
+        chunk_map->add_changed_mesh(get_section_aabb(section));
+    }
+
+    vertex_count = 0;
+    for (int32 f = 0; f < 6; f++) {
+        mesh.face_first[f] = vertex_count;
+        mesh.face_count[f] = face_attr_counts[f] / 10;
+        vertex_count += mesh.face_count[f];
+    }
+    mesh.vertex_count = vertex_count;
+    if (vertex_count == 0) {
+        return;
+    }
+
+    float32 *positions = staging;
+    float32 *attributes = staging + vertex_count * 3;
+    for (int32 f = 0; f < 6; f++) {
+        const float32 *vertex = face_vertices[f];
+        for (int32 v = 0; v < mesh.face_count[f]; v++, vertex += 10) {
+            memcpy(positions, vertex, sizeof(float32) * 3);
+            memcpy(attributes, vertex + 3, sizeof(float32) * 7);
+            positions += 3;
+            attributes += 7;
+        }
+    }
+
+    if (mesh.vao == 0) {
+        glGenBuffers(1, &mesh.vbo);
+        glGenVertexArrays(1, &mesh.vao);
+        glGenVertexArrays(1, &mesh.depth_vao);
+        glBindVertexArray(mesh.depth_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float32), (void *)nullptr);
+        glEnableVertexAttribArray(0);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float32) * 10 * vertex_count, (void *)staging, GL_DYNAMIC_DRAW);
+
+    // The attributes start after the positions, so their offsets change with the vertex count
+    const uintptr_t attributes_offset = sizeof(float32) * 3 * vertex_count;
+    glBindVertexArray(mesh.vao);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float32), (void *)nullptr);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 7 * sizeof(float32), (void *)attributes_offset);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 7 * sizeof(float32), (void *)(attributes_offset + 3 * sizeof(float32)));
+    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, 7 * sizeof(float32), (void *)(attributes_offset + 6 * sizeof(float32)));
     glEnableVertexAttribArray(0);
     glEnableVertexAttribArray(1);
     glEnableVertexAttribArray(2);
     glEnableVertexAttribArray(3);
 }
 
-void Chunk::draw(const int32 model_loc) const {
-    if (vertex_count > 0) {
-        const glm::vec3 position = {chunk_x * Config::World::CHUNK_SIZE, chunk_y * Config::World::CHUNK_SIZE, chunk_z * Config::World::CHUNK_SIZE};
-        glUniformMatrix4fv(model_loc, 1, GL_FALSE, glm::value_ptr(glm::translate(glm::mat4(1.0f), position)));
-        glBindVertexArray(vao_chunk);
-        glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+// Draws the face directions of a section that the filter lets through. Directions next to each other in the buffer are merged
+// into one range.
+void Chunk::draw_section(const ChunkSection &mesh, const AABB &box, const FaceFilter &faces, const uint32 vao) const {
+    const uint8 face_mask = faces.get_face_mask(box);
+    int32 firsts[6];
+    int32 counts[6];
+    int32 range_count = 0;
+    bool extend_range = false;
+    for (int32 f = 0; f < 6; f++) {
+        if (!(face_mask & (1 << f)) || mesh.face_count[f] == 0) {
+            extend_range = false;
+            continue;
+        }
+        if (extend_range) {
+            counts[range_count - 1] += mesh.face_count[f];
+        } else {
+            firsts[range_count] = mesh.face_first[f];
+            counts[range_count] = mesh.face_count[f];
+            range_count++;
+            extend_range = true;
+        }
+    }
+    if (range_count > 0) {
+        glBindVertexArray(vao);
+        glMultiDrawArrays(GL_TRIANGLES, firsts, counts, range_count);
     }
 }
 
-int32 Chunk::get_vertex_ao(const int32 i, const int32 j, const int32 k, const Vector3f v, const Vector3f normal) const {
+void Chunk::set_model_uniform(const int32 model_loc) const {
+    const glm::vec3 position = {chunk_x * Config::World::CHUNK_SIZE, chunk_y * Config::World::CHUNK_SIZE, chunk_z * Config::World::CHUNK_SIZE};
+    glUniformMatrix4fv(model_loc, 1, GL_FALSE, glm::value_ptr(glm::translate(glm::mat4(1.0f), position)));
+}
+
+// Frustum is null if the whole chunk is known to be inside it, otherwise the sections are culled one by one
+void Chunk::draw(const int32 model_loc, const Frustum *frustum, const FaceFilter &faces, const bool depth_only) const {
+    bool model_set = false;
+    for (int32 section = 0; section < Config::World::SECTION_COUNT; section++) {
+        const ChunkSection &mesh = sections[section];
+        if (mesh.vertex_count == 0) {
+            continue;
+        }
+        const AABB box = get_section_aabb(section);
+        if (frustum && frustum->test_intersection(box) == Frustum::TEST_OUTSIDE) {
+            continue;
+        }
+        if (!model_set) {
+            set_model_uniform(model_loc);
+            model_set = true;
+        }
+        draw_section(mesh, box, faces, depth_only ? mesh.depth_vao : mesh.vao);
+    }
+}
+
+// Draws the positions of the sections into the layers of a layered target. Each section goes to the layers in layer_mask
+// whose frustum it intersects, which the geometry shader reads from layer_mask_loc.
+void Chunk::draw_layered(const int32 model_loc, const int32 layer_mask_loc, const Frustum *frustums, const uint8 layer_mask, const FaceFilter &faces) const {
+    bool model_set = false;
+    uint8 current_mask = 0;
+    for (int32 section = 0; section < Config::World::SECTION_COUNT; section++) {
+        const ChunkSection &mesh = sections[section];
+        if (mesh.vertex_count == 0) {
+            continue;
+        }
+        const AABB box = get_section_aabb(section);
+        uint8 section_mask = 0;
+        for (int32 layer = 0; layer < 8; layer++) {
+            if ((layer_mask & (1 << layer)) && frustums[layer].test_intersection(box) != Frustum::TEST_OUTSIDE) {
+                section_mask |= 1 << layer;
+            }
+        }
+        if (section_mask == 0) {
+            continue;
+        }
+        if (!model_set) {
+            set_model_uniform(model_loc);
+            model_set = true;
+        }
+        if (section_mask != current_mask) {
+            glUniform1i(layer_mask_loc, section_mask);
+            current_mask = section_mask;
+        }
+        draw_section(mesh, box, faces, mesh.depth_vao);
+    }
+}
+
+int32 Chunk::get_vertex_ao(const MeshGrid &grid, const int32 i, const int32 j, const int32 k, const Vector3f v, const Vector3f normal) const {
     int32 side1, side2, corner;
     int32 offset0;
     int32 offset1;
@@ -127,23 +254,23 @@ int32 Chunk::get_vertex_ao(const int32 i, const int32 j, const int32 k, const Ve
         offset0 = (int32)normal.x;
         offset1 = v.y > 0 ? 1 : -1;
         offset2 = v.z > 0 ? 1 : -1;
-        side1 = get_block(i + offset0, j + offset1, k) > 0 ? 1 : 0;
-        side2 = get_block(i + offset0, j, k + offset2) > 0 ? 1 : 0;
-        corner = get_block(i + offset0, j + offset1, k + offset2) > 0 ? 1 : 0;
+        side1 = grid.get(i + offset0, j + offset1, k) > 0 ? 1 : 0;
+        side2 = grid.get(i + offset0, j, k + offset2) > 0 ? 1 : 0;
+        corner = grid.get(i + offset0, j + offset1, k + offset2) > 0 ? 1 : 0;
     } else if (normal.y != 0) {
         offset0 = (int32)normal.y;
         offset1 = v.x > 0 ? 1 : -1;
         offset2 = v.z > 0 ? 1 : -1;
-        side1 = get_block(i + offset1, j + offset0, k) > 0 ? 1 : 0;
-        side2 = get_block(i, j + offset0, k + offset2) > 0 ? 1 : 0;
-        corner = get_block(i + offset1, j + offset0, k + offset2) > 0 ? 1 : 0;
+        side1 = grid.get(i + offset1, j + offset0, k) > 0 ? 1 : 0;
+        side2 = grid.get(i, j + offset0, k + offset2) > 0 ? 1 : 0;
+        corner = grid.get(i + offset1, j + offset0, k + offset2) > 0 ? 1 : 0;
     } else {
         offset0 = (int32)normal.z;
         offset1 = v.x > 0 ? 1 : -1;
         offset2 = v.y > 0 ? 1 : -1;
-        side1 = get_block(i + offset1, j, k + offset0) > 0 ? 1 : 0;
-        side2 = get_block(i, j + offset2, k + offset0) > 0 ? 1 : 0;
-        corner = get_block(i + offset1, j + offset2, k + offset0) > 0 ? 1 : 0;
+        side1 = grid.get(i + offset1, j, k + offset0) > 0 ? 1 : 0;
+        side2 = grid.get(i, j + offset2, k + offset0) > 0 ? 1 : 0;
+        corner = grid.get(i + offset1, j + offset2, k + offset0) > 0 ? 1 : 0;
     }
 
     if (side1 && side2) {
@@ -152,81 +279,312 @@ int32 Chunk::get_vertex_ao(const int32 i, const int32 j, const int32 k, const Ve
     return 3 - (side1 + side2 + corner);
 }
 
-void Chunk::fill_vertices(const int32 i, const int32 j, const int32 k, const int32 f, const Vector3f color, uint32 &attr_count, float32 *chunk_vertices) const {
+void Chunk::fill_vertices(const MeshGrid &grid, const int32 i, const int32 j, const int32 k, const int32 f, const Vector3f color, uint32 &attr_count,
+                          float32 *chunk_vertices) const {
+    // A cell covers scale^3 blocks, so its center is offset from its first block's center
+    const auto scale = (float32)grid.scale;
+    const float32 center_offset = (scale - 1.0f) * 0.5f;
     for (int32 v = 0; v < 6; v++) {
-        chunk_vertices[attr_count++] = (cube_vertices_with_normal[f * 36 + v * 6] + i);
-        chunk_vertices[attr_count++] = (cube_vertices_with_normal[f * 36 + v * 6 + 1] + j);
-        chunk_vertices[attr_count++] = (cube_vertices_with_normal[f * 36 + v * 6 + 2] + k);
+        chunk_vertices[attr_count++] = (cube_vertices_with_normal[f * 36 + v * 6] * scale + i * scale + center_offset);
+        chunk_vertices[attr_count++] = (cube_vertices_with_normal[f * 36 + v * 6 + 1] * scale + j * scale + center_offset);
+        chunk_vertices[attr_count++] = (cube_vertices_with_normal[f * 36 + v * 6 + 2] * scale + k * scale + center_offset);
         for (int32 a = 3; a < 6; a++) {
             chunk_vertices[attr_count++] = (cube_vertices_with_normal[f * 36 + v * 6 + a]);
         }
         const float32 dx = cube_vertices_with_normal[f * 36 + v * 6] * 2.f;
         const float32 dz = cube_vertices_with_normal[f * 36 + v * 6 + 2] * 2.f;
-        const float32 noise = get_noise_at(chunk_x, chunk_z, i, k, (int32)dx, (int32)dz);
+        const float32 noise = get_noise_at(chunk_x, chunk_z, i * grid.scale, k * grid.scale, (int32)dx, (int32)dz);
         chunk_vertices[attr_count++] = (color.x) + noise;
         chunk_vertices[attr_count++] = (color.y) + noise;
         chunk_vertices[attr_count++] = (color.z) + noise;
 
-        chunk_vertices[attr_count++] =
-            (float32)get_vertex_ao(i, j, k, ((Vector3f *)cube_vertices_with_normal)[f * 12 + v * 2], ((Vector3f *)cube_vertices_with_normal)[f * 12 + v * 2 + 1]);
+        chunk_vertices[attr_count++] = (float32)get_vertex_ao(grid, i, j, k, ((Vector3f *)cube_vertices_with_normal)[f * 12 + v * 2],
+                                                              ((Vector3f *)cube_vertices_with_normal)[f * 12 + v * 2 + 1]);
+    }
+}
+
+// A cell of scale^3 blocks is solid if at least half of its blocks are, and takes the color of its top-most block so that the
+// terrain surface keeps its colors from afar
+uint8 Chunk::get_lod_cell(const int32 scale, const int32 cx, const int32 cy, const int32 cz) const {
+    int32 solid_count = 0;
+    int32 top_y = -1;
+    uint8 top_block = 0;
+    for (int32 z = cz * scale; z < (cz + 1) * scale; z++) {
+        for (int32 y = cy * scale; y < (cy + 1) * scale; y++) {
+            for (int32 x = cx * scale; x < (cx + 1) * scale; x++) {
+                const uint8 block = blocks[BID(x, y, z)];
+                if (block != 0) {
+                    solid_count++;
+                    if (y > top_y) {
+                        top_y = y;
+                        top_block = block;
+                    }
+                }
+            }
+        }
+    }
+    return solid_count * 2 >= scale * scale * scale ? top_block : 0;
+}
+
+// Builds the (CHUNK_SIZE / scale)^3 grid of LOD cells
+void Chunk::downsample(const int32 scale, uint8 *cells) const {
+    const int32 size = Config::World::CHUNK_SIZE / scale;
+    for (int32 cz = 0; cz < size; cz++) {
+        for (int32 cy = 0; cy < size; cy++) {
+            for (int32 cx = 0; cx < size; cx++) {
+                cells[(cz * size + cy) * size + cx] = get_lod_cell(scale, cx, cy, cz);
+            }
+        }
     }
 }
 
-void Chunk::update() {
+int32 Chunk::get_desired_lod(const float32 distance) const {
+    // Thresholds are pushed away from the current level, so chunks on a boundary don't flicker between meshes
+    int32 desired = 0;
+    for (int32 level = 1; level < Config::World::LOD_LEVEL_COUNT; level++) {
+        const float32 hysteresis = level <= lod ? -Config::World::LOD_HYSTERESIS : Config::World::LOD_HYSTERESIS;
+        if (distance > Config::World::LOD_DISTANCES[level - 1] + hysteresis) {
+            desired = level;
+        }
+    }
+    return desired;
+}
+
+// Sections on the side of a chunk that a face points to
+inline uint8 get_border_sections(const int32 face) {
+    const int32 axis = face < 2 ? 2 : (face < 4 ? 0 : 1);
+    const int32 side = (face & 1) ? Config::World::SECTIONS_PER_AXIS - 1 : 0;
+    uint8 mask = 0;
+    for (int32 z = 0; z < Config::World::SECTIONS_PER_AXIS; z++) {
+        for (int32 y = 0; y < Config::World::SECTIONS_PER_AXIS; y++) {
+            for (int32 x = 0; x < Config::World::SECTIONS_PER_AXIS; x++) {
+                const int32 coords[3] = {x, y, z};
+                if (coords[axis] == side) {
+                    mask |= 1 << SID(x, y, z);
+                }
+            }
+        }
+    }
+    return mask;
+}
+
+void Chunk::set_lod(const int32 new_lod) {
+    lod = new_lod;
+    // Meshed with the dirty queue, so a chunk waiting in it is meshed once and after its neighbors are ready
+    chunk_map->mark_dirty(this, ALL_SECTIONS);
+
+    // Neighbors cull their border faces only against chunks of their own level, so their border sections change too
+    for (int32 face = 0; face < 6; face++) {
+        if (neighbors[face]) {
+            chunk_map->mark_dirty(neighbors[face], get_border_sections(face ^ 1));
+        }
+    }
+}
+
+// Cells of a neighbor are only compared with cells of the same size. Meshes of different levels don't line up, so both keep
+// their faces on the border between them as skirts that hide the cracks, and so do borders with chunks that are not filled yet.
+inline uint8 get_border_cell(const Chunk *neighbor, const int32 scale, const int32 x, const int32 y, const int32 z) {
+    if (!neighbor || !neighbor->blocks || (1 << neighbor->lod) != scale) {
+        return 0;
+    }
+    return scale == 1 ? neighbor->blocks[BID(x, y, z)] : neighbor->get_lod_cell(scale, x, y, z);
+}
+
+// Cell of the grid or, one cell past a side of it, of the neighbor on that side
+uint8 Chunk::get_mesh_cell(const MeshGrid &grid, const int32 i, const int32 j, const int32 k) const {
+    const int32 last = grid.size - 1;
+    if (i < 0) {
+        return get_border_cell(neighbors[2], grid.scale, last, j, k);
+    }
+    if (i > last) {
+        return get_border_cell(neighbors[3], grid.scale, 0, j, k);
+    }
+    if (j < 0) {
+        return get_border_cell(neighbors[4], grid.scale, i, last, k);
+    }
+    if (j > last) {
+        return get_border_cell(neighbors[5], grid.scale, i, 0, k);
+    }
+    if (k < 0) {
+        return get_border_cell(neighbors[0], grid.scale, i, j, last);
+    }
+    if (k > last) {
+        return get_border_cell(neighbors[1], grid.scale, i, j, 0);
+    }
+    return grid.get(i, j, k);
+}
+
+// Whether the blocks in [y_start, y_end] x [z_start, z_end] are all solid on the bits of x_mask, as seen by a full detail mesh
+inline bool is_region_solid(const Chunk *chunk, const uint32 x_mask, const int32 y_start, const int32 y_end, const int32 z_start, const int32 z_end) {
+    if (!chunk || !chunk->occupancy || chunk->lod > 0) {
+        return false;
+    }
+    for (int32 z = z_start; z <= z_end; z++) {
+        for (int32 y = y_start; y <= y_end; y++) {
+            if ((chunk->occupancy[OID(y, z)] & x_mask) != x_mask) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// A full detail section has no faces if it is all air, or if it is all solid and so are the blocks around it
+bool Chunk::is_section_hidden(const int32 section_x, const int32 section_y, const int32 section_z) const {
+    constexpr int32 S = Config::World::SECTION_SIZE;
+    constexpr int32 LAST = Config::World::CHUNK_SIZE - 1;
+    const int32 x0 = section_x * S, y0 = section_y * S, z0 = section_z * S;
+    const int32 x1 = x0 + S - 1, y1 = y0 + S - 1, z1 = z0 + S - 1;
+    const uint32 x_mask = (0xFFFFFFFFu >> (32 - S)) << x0;
+
+    bool empty = true;
+    for (int32 z = z0; z <= z1 && empty; z++) {
+        for (int32 y = y0; y <= y1 && empty; y++) {
+            empty = (occupancy[OID(y, z)] & x_mask) == 0;
+        }
+    }
+    if (empty) {
+        return true;
+    }
+    if (!is_region_solid(this, x_mask, y0, y1, z0, z1)) {
+        return false;
+    }
+
+    // Layers of blocks on the six sides, which may be in the neighboring chunks
+    return (x0 > 0 ? is_region_solid(this, 1u << (x0 - 1), y0, y1, z0, z1) : is_region_solid(neighbors[2], 1u << LAST, y0, y1, z0, z1)) &&
+           (x1 < LAST ? is_region_solid(this, 1u << (x1 + 1), y0, y1, z0, z1) : is_region_solid(neighbors[3], 1u, y0, y1, z0, z1)) &&
+           (y0 > 0 ? is_region_solid(this, x_mask, y0 - 1, y0 - 1, z0, z1) : is_region_solid(neighbors[4], x_mask, LAST, LAST, z0, z1)) &&
+           (y1 < LAST ? is_region_solid(this, x_mask, y1 + 1, y1 + 1, z0, z1) : is_region_solid(neighbors[5], x_mask, 0, 0, z0, z1)) &&
+           (z0 > 0 ? is_region_solid(this, x_mask, y0, y1, z0 - 1, z0 - 1) : is_region_solid(neighbors[0], x_mask, y0, y1, LAST, LAST)) &&
+           (z1 < LAST ? is_region_solid(this, x_mask, y0, y1, z1 + 1, z1 + 1) : is_region_solid(neighbors[1], x_mask, y0, y1, 0, 0));
+}
+
+// A LOD section has no faces if all its cells are air, or if they are all solid and so are the cells around it
+bool Chunk::is_lod_section_hidden(const MeshGrid &grid, const int32 i0, const int32 j0, const int32 k0, const int32 cells) const {
+    const bool solid = grid.get(i0, j0, k0) != 0;
+    for (int32 k = k0; k < k0 + cells; k++) {
+        for (int32 j = j0; j < j0 + cells; j++) {
+            for (int32 i = i0; i < i0 + cells; i++) {
+                if ((grid.get(i, j, k) != 0) != solid) {
+                    return false;
+                }
+            }
+        }
+    }
+    if (!solid) {
+        return true;
+    }
+
+    // Layers of cells on the six sides, which may be in the neighboring chunks
+    for (int32 a = 0; a < cells; a++) {
+        for (int32 b = 0; b < cells; b++) {
+            if (get_mesh_cell(grid, i0 - 1, j0 + a, k0 + b) == 0 || get_mesh_cell(grid, i0 + cells, j0 + a, k0 + b) == 0 ||
+                get_mesh_cell(grid, i0 + a, j0 - 1, k0 + b) == 0 || get_mesh_cell(grid, i0 + a, j0 + cells, k0 + b) == 0 ||
+                get_mesh_cell(grid, i0 + a, j0 + b, k0 - 1) == 0 || get_mesh_cell(grid, i0 + a, j0 + b, k0 + cells) == 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void Chunk::fill_block_faces(const MeshGrid &grid, const int32 i, const int32 j, const int32 k, uint32 *face_attr_counts, float32 *const *face_vertices) const {
+    const uint8 block = grid.get(i, j, k);
+    const Vector3f color = block_color_map[block];
+    if (get_mesh_cell(grid, i - 1, j, k) == 0) {
+        fill_vertices(grid, i, j, k, 2, color, face_attr_counts[2], face_vertices[2]);
+    }
+    if (get_mesh_cell(grid, i + 1, j, k) == 0) {
+        fill_vertices(grid, i, j, k, 3, color, face_attr_counts[3], face_vertices[3]);
+    }
+    if (get_mesh_cell(grid, i, j - 1, k) == 0) {
+        fill_vertices(grid, i, j, k, 4, color, face_attr_counts[4], face_vertices[4]);
+    }
+    if (get_mesh_cell(grid, i, j + 1, k) == 0) {
+        fill_vertices(grid, i, j, k, 5, color, face_attr_counts[5], face_vertices[5]);
+    }
+    if (get_mesh_cell(grid, i, j, k - 1) == 0) {
+        fill_vertices(grid, i, j, k, 0, color, face_attr_counts[0], face_vertices[0]);
+    }
+    if (get_mesh_cell(grid, i, j, k + 1) == 0) {
+        fill_vertices(grid, i, j, k, 1, color, face_attr_counts[1], face_vertices[1]);
+    }
+}
+
+void Chunk::update() { update_sections(ALL_SECTIONS); }
+
+void Chunk::update_sections(const uint8 section_mask) {
+    PROFILE_SCOPE("Chunk::update");
     if (!blocks) {
         return;
     }
+    chunk_map->streamed_mesh_count++;
 
-    float32 *chunk_vertices = chunk_map->temp_vertex_buffer;
-    uint32 attr_count = 0;
+    // Each direction gets room for every face of a full section, and the packed section goes after them
+    constexpr uint32 FACE_BUCKET_SIZE = Config::World::SECTION_SIZE * Config::World::SECTION_SIZE * Config::World::SECTION_SIZE * 6 * 10;
+    float32 *face_vertices[6];
+    for (int32 f = 0; f < 6; f++) {
+        face_vertices[f] = chunk_map->temp_vertex_buffer + f * FACE_BUCKET_SIZE;
+    }
+    float32 *staging = chunk_map->temp_vertex_buffer + 6 * FACE_BUCKET_SIZE;
 
-    for (int32 i = 0; i < Config::World::CHUNK_SIZE; i++) {
-        for (int32 j = 0; j < Config::World::CHUNK_SIZE; j++) {
-            for (int32 k = 0; k < Config::World::CHUNK_SIZE; k++) {
-                const uint8 block = blocks[BID(i, j, k)];
-                const Vector3f color = block_color_map[block];
-                if (block != 0) {
-                    BlockPos neighbor;
-                    neighbor = {chunk_x - 1, chunk_y, chunk_z, Config::World::CHUNK_SIZE - 1, j, k};
-                    if ((i == 0 && chunk_map->get_block_at_block_pos(neighbor) == 0) || (i > 0 && blocks[BID(i - 1, j, k)] == 0)) {
-                        fill_vertices(i, j, k, 2, color, attr_count, chunk_vertices);
-                    }
-                    neighbor = {chunk_x + 1, chunk_y, chunk_z, 0, j, k};
-                    if ((i == Config::World::CHUNK_SIZE - 1 && chunk_map->get_block_at_block_pos(neighbor) == 0) ||
-                        (i < Config::World::CHUNK_SIZE - 1 && blocks[BID(i + 1, j, k)] == 0)) {
-                        fill_vertices(i, j, k, 3, color, attr_count, chunk_vertices);
-                    }
-                    neighbor = {chunk_x, chunk_y - 1, chunk_z, i, Config::World::CHUNK_SIZE - 1, k};
-                    if ((j == 0 && chunk_map->get_block_at_block_pos(neighbor) == 0) || (j > 0 && blocks[BID(i, j - 1, k)] == 0)) {
-                        fill_vertices(i, j, k, 4, color, attr_count, chunk_vertices);
-                    }
-                    neighbor = {chunk_x, chunk_y + 1, chunk_z, i, 0, k};
-                    if ((j == Config::World::CHUNK_SIZE - 1 && chunk_map->get_block_at_block_pos(neighbor) == 0) ||
-                        (j < Config::World::CHUNK_SIZE - 1 && blocks[BID(i, j + 1, k)] == 0)) {
-                        fill_vertices(i, j, k, 5, color, attr_count, chunk_vertices);
-                    }
-                    neighbor = {chunk_x, chunk_y, chunk_z - 1, i, j, Config::World::CHUNK_SIZE - 1};
-                    if ((k == 0 && chunk_map->get_block_at_block_pos(neighbor) == 0) || (k > 0 && blocks[BID(i, j, k - 1)] == 0)) {
-                        fill_vertices(i, j, k, 0, color, attr_count, chunk_vertices);
+    uint8 lod_cells[(Config::World::CHUNK_SIZE / 2) * (Config::World::CHUNK_SIZE / 2) * (Config::World::CHUNK_SIZE / 2)];
+    MeshGrid grid;
+    if (lod == 0) {
+        grid.cells = blocks;
+    } else {
+        grid.scale = 1 << lod;
+        grid.size = Config::World::CHUNK_SIZE / grid.scale;
+        grid.cells = lod_cells;
+        downsample(grid.scale, lod_cells);
+    }
+
+    // Sections cover the same part of the chunk at every LOD, so a section is grid.size / SECTIONS_PER_AXIS cells wide
+    const int32 section_cells = grid.size / Config::World::SECTIONS_PER_AXIS;
+    for (int32 section_z = 0; section_z < Config::World::SECTIONS_PER_AXIS; section_z++) {
+        for (int32 section_y = 0; section_y < Config::World::SECTIONS_PER_AXIS; section_y++) {
+            for (int32 section_x = 0; section_x < Config::World::SECTIONS_PER_AXIS; section_x++) {
+                const int32 section = SID(section_x, section_y, section_z);
+                if (!(section_mask & (1 << section))) {
+                    continue;
+                }
+
+                uint32 face_attr_counts[6] = {};
+                const int32 i0 = section_x * section_cells, j0 = section_y * section_cells, k0 = section_z * section_cells;
+                if (lod == 0) {
+                    // Only solid blocks are visited, through the occupancy rows
+                    if (!is_section_hidden(section_x, section_y, section_z)) {
+                        const uint32 x_mask = (0xFFFFFFFFu >> (32 - Config::World::SECTION_SIZE)) << i0;
+                        for (int32 k = k0; k < k0 + section_cells; k++) {
+                            for (int32 j = j0; j < j0 + section_cells; j++) {
+                                uint32 row = occupancy[OID(j, k)] & x_mask;
+                                while (row) {
+                                    const int32 i = count_trailing_zeros(row);
+                                    row &= row - 1;
+                                    fill_block_faces(grid, i, j, k, face_attr_counts, face_vertices);
+                                }
+                            }
+                        }
                     }
-                    neighbor = {chunk_x, chunk_y, chunk_z + 1, i, j, 0};
-                    if ((k == Config::World::CHUNK_SIZE - 1 && chunk_map->get_block_at_block_pos(neighbor) == 0) ||
-                        (k < Config::World::CHUNK_SIZE - 1 && blocks[BID(i, j, k + 1)] == 0)) {
-                        fill_vertices(i, j, k, 1, color, attr_count, chunk_vertices);
+                } else if (!is_lod_section_hidden(grid, i0, j0, k0, section_cells)) {
+                    for (int32 i = i0; i < i0 + section_cells; i++) {
+                        for (int32 j = j0; j < j0 + section_cells; j++) {
+                            for (int32 k = k0; k < k0 + section_cells; k++) {
+                                if (grid.get(i, j, k) != 0) {
+                                    fill_block_faces(grid, i, j, k, face_attr_counts, face_vertices);
+                                }
+                            }
+                        }
                     }
                 }
+                upload_section(section, face_vertices, face_attr_counts, staging);
             }
         }
     }
-
-    if (attr_count > 0) {
-        glBindBuffer(GL_ARRAY_BUFFER, vbo_chunk);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(float32) * attr_count, (void *)chunk_vertices, GL_DYNAMIC_DRAW);
-    }
-    vertex_count = attr_count / 10;
 }
 
 void Chunk::fill() {
+    PROFILE_SCOPE("Chunk::fill");
     const int32 pos_x = chunk_x * Config::World::CHUNK_SIZE;
     const int32 pos_y = chunk_y * Config::World::CHUNK_SIZE;
     const int32 pos_z = chunk_z * Config::World::CHUNK_SIZE;
@@ -249,16 +607,44 @@ void Chunk::generate() {
     if (chunk_y > 2 || chunk_y < 0) {
         return;
     }
+    allocate_blocks();
+    fill_pending = true;
+    chunk_map->push_to_be_filled(this);
+}
+
+void Chunk::allocate_blocks() {
     if (!blocks) {
         blocks = pushArray(*chunk_map->world_arena, Config::World::CHUNK_SIZE * Config::World::CHUNK_SIZE * Config::World::CHUNK_SIZE, uint8);
+        occupancy = pushArray(*chunk_map->world_arena, Config::World::CHUNK_SIZE * Config::World::CHUNK_SIZE, uint32);
     }
-
     memset(blocks, 0, Config::World::CHUNK_SIZE * Config::World::CHUNK_SIZE * Config::World::CHUNK_SIZE);
+    memset(occupancy, 0, Config::World::CHUNK_SIZE * Config::World::CHUNK_SIZE * sizeof(uint32));
+}
 
-    chunk_map->push_to_be_filled(this);
+void Chunk::rebuild_occupancy() {
+    for (int32 z = 0; z < Config::World::CHUNK_SIZE; z++) {
+        for (int32 y = 0; y < Config::World::CHUNK_SIZE; y++) {
+            uint32 row = 0;
+            for (int32 x = 0; x < Config::World::CHUNK_SIZE; x++) {
+                row |= (uint32)(blocks[BID(x, y, z)] != 0) << x;
+            }
+            occupancy[OID(y, z)] = row;
+        }
+    }
+}
+
+AABB Chunk::get_section_aabb(const int32 section) const {
+    constexpr int32 S = Config::World::SECTION_SIZE;
+    constexpr int32 N = Config::World::SECTIONS_PER_AXIS;
+    AABB res;
+    res.min = {(float32)(chunk_x * Config::World::CHUNK_SIZE + (section % N) * S) - 0.5f,
+               (float32)(chunk_y * Config::World::CHUNK_SIZE + (section / N % N) * S) - 0.5f,
+               (float32)(chunk_z * Config::World::CHUNK_SIZE + (section / (N * N)) * S) - 0.5f};
+    res.max = res.min + Vector3f(S, S, S);
+    return res;
 }
 
-AABB Chunk::get_aabb() {
+AABB Chunk::get_aabb() const {
     AABB res;
     const Vector3f size = {Config::World::CHUNK_SIZE, Config::World::CHUNK_SIZE, Config::World::CHUNK_SIZE};
 
@@ -276,8 +662,6 @@ void Chunk::initialize(const int32 chunk_x, const int32 chunk_y, const int32 chu
 
     if (this->chunk_y <= 2 && this->chunk_y >= 0) {
         generate();
-    } else {
-        initialize_open_gl_stuff(false);
     }
 }
 
@@ -298,21 +682,38 @@ void Chunk::save_to_file() const {
     }
 }
 
-inline void update_neighbor(ChunkMap *chunk_map, int32 x, int32 y, int32 z) {
-    if (Chunk *neighbor = chunk_map->get_chunk(x, y, z, false)) {
-        neighbor->update();
+void Chunk::link_neighbors() {
+    for (int32 face = 0; face < 6; face++) {
+        Chunk *neighbor = chunk_map->get_chunk(chunk_x + FACE_OFFSETS[face][0], chunk_y + FACE_OFFSETS[face][1], chunk_z + FACE_OFFSETS[face][2], false);
+        neighbors[face] = neighbor;
+        if (neighbor) {
+            // Faces come in opposite pairs, so the neighbor sees this chunk through face ^ 1
+            neighbor->neighbors[face ^ 1] = this;
+        }
+    }
+}
+
+bool Chunk::is_neighborhood_ready() const {
+    for (const Chunk *neighbor : neighbors) {
+        if (neighbor && neighbor->fill_pending) {
+            return false;
+        }
     }
+    return true;
 }
 
+// Meshing waits for the dirty queue, so the chunk and its neighbors are meshed once the whole neighborhood is filled
+// instead of once per neighbor that arrives
 void Chunk::after_fill() {
     filled = true;
-    initialize_open_gl_stuff(true);
-    update_neighbor(chunk_map, chunk_x - 1, chunk_y, chunk_z);
-    update_neighbor(chunk_map, chunk_x + 1, chunk_y, chunk_z);
-    update_neighbor(chunk_map, chunk_x, chunk_y - 1, chunk_z);
-    update_neighbor(chunk_map, chunk_x, chunk_y + 1, chunk_z);
-    update_neighbor(chunk_map, chunk_x, chunk_y, chunk_z - 1);
-    update_neighbor(chunk_map, chunk_x, chunk_y, chunk_z + 1);
+    fill_pending = false;
+    rebuild_occupancy();
+    chunk_map->mark_dirty(this);
+    for (Chunk *neighbor : neighbors) {
+        if (neighbor) {
+            chunk_map->mark_dirty(neighbor);
+        }
+    }
 }
 
 bool Chunk::load_from_file() {
@@ -378,6 +779,7 @@ Chunk *ChunkMap::get_chunk(const int32 chunk_x, const int32 chunk_y, const int32
         chunk_hash[hash_slot] = pushStruct(*world_arena, Chunk);
         chunk = chunk_hash[hash_slot];
         chunk->initialize(chunk_x, chunk_y, chunk_z, this);
+        chunk->link_neighbors();
         return chunk;
     }
 
@@ -392,6 +794,7 @@ Chunk *ChunkMap::get_chunk(const int32 chunk_x, const int32 chunk_y, const int32
             chunk->next_in_hash = pushStruct(*world_arena, Chunk);
             chunk = chunk->next_in_hash;
             chunk->initialize(chunk_x, chunk_y, chunk_z, this);
+            chunk->link_neighbors();
             return chunk;
         }
 
@@ -401,6 +804,7 @@ Chunk *ChunkMap::get_chunk(const int32 chunk_x, const int32 chunk_y, const int32
 }
 
 void ChunkMap::fill_next_chunk(const Vector3f &player_pos) {
+    PROFILE_SCOPE("fill_next_chunk");
     // todo: if chunk is too far now, don't fill it
     // todo: fill chunks that the player is currently looking at
     if (to_be_filled_len > 0) {
@@ -423,42 +827,155 @@ void ChunkMap::fill_next_chunk(const Vector3f &player_pos) {
         to_be_filled[to_be_filled_len] = to_be_filled[min_index];
         to_be_filled[min_index] = temp;
 
-        if (!to_be_filled[to_be_filled_len]->load_from_file()) {
-            to_be_filled[to_be_filled_len]->fill();
+        // Picking the LOD up front avoids meshing the chunk twice
+        Chunk *chunk = to_be_filled[to_be_filled_len];
+        chunk->lod = chunk->get_desired_lod(get_chunk_distance(chunk->chunk_x, chunk->chunk_y, chunk->chunk_z, player_pos));
+        if (!chunk->load_from_file()) {
+            chunk->fill();
+        }
+        streamed_fill_count++;
+        if (to_be_filled_len == 0) {
+            LogDebug("Filled %u chunks with %u meshes\n", streamed_fill_count, streamed_mesh_count);
+            streamed_fill_count = 0;
+            streamed_mesh_count = 0;
+        }
+    }
+}
+
+void ChunkMap::mark_dirty(Chunk *chunk, const uint8 section_mask) {
+    // Chunks still in the fill queue are meshed after they are filled
+    if (!chunk->blocks || chunk->fill_pending) {
+        return;
+    }
+    chunk->dirty_sections |= section_mask;
+    if (chunk->mesh_dirty) {
+        return;
+    }
+    chunk->mesh_dirty = true;
+    chunk->dirty_frame = game_state->frame_count;
+    chunk->next_dirty = dirty_chunks;
+    dirty_chunks = chunk;
+}
+
+void ChunkMap::update_dirty_chunks() {
+    Chunk **link = &dirty_chunks;
+    while (Chunk *chunk = *link) {
+        if (chunk->is_neighborhood_ready() || game_state->frame_count - chunk->dirty_frame >= Config::World::MESH_WAIT_FRAMES) {
+            *link = chunk->next_dirty;
+            chunk->next_dirty = nullptr;
+            chunk->mesh_dirty = false;
+            const uint8 section_mask = chunk->dirty_sections;
+            chunk->dirty_sections = 0;
+            chunk->update_sections(section_mask);
+        } else {
+            link = &chunk->next_dirty;
         }
     }
 }
 
-void ChunkMap::draw_chunks(const int32 model_loc, const Frustum &frustum, const Vector3f &player_pos) {
-    // Fill a chunk if needed
-    fill_next_chunk(player_pos);
-    if (game_state->frame_count < 2) {
+void ChunkMap::add_changed_mesh(const AABB &box) {
+    if (changed_mesh_count < CHANGED_MESH_LIMIT) {
+        changed_mesh_mins[changed_mesh_count] = box.min;
+        changed_mesh_maxs[changed_mesh_count] = box.max;
+        changed_mesh_count++;
+        return;
+    }
+    Vector3f &last_min = changed_mesh_mins[CHANGED_MESH_LIMIT - 1];
+    Vector3f &last_max = changed_mesh_maxs[CHANGED_MESH_LIMIT - 1];
+    last_min = {MIN(last_min.x, box.min.x), MIN(last_min.y, box.min.y), MIN(last_min.z, box.min.z)};
+    last_max = {MAX(last_max.x, box.max.x), MAX(last_max.y, box.max.y), MAX(last_max.z, box.max.z)};
+}
+
+// Fills and meshes chunks once per frame, before any pass is drawn
+void ChunkMap::update_chunks(const Vector3f &player_pos) {
+    const uint32 fill_count = game_state->frame_count < 2 ? 2 * Config::World::CHUNK_FILLS_PER_FRAME : Config::World::CHUNK_FILLS_PER_FRAME;
+    for (uint32 i = 0; i < fill_count; i++) {
         fill_next_chunk(player_pos);
     }
+    update_dirty_chunks();
+}
+
+// Finds the chunks in the frustum for draw_visible_chunks and the ones around the player for draw_chunks_layered, and switches their LODs
+void ChunkMap::cull_chunks(const Frustum &frustum, const Vector3f &player_pos) {
+    // LOD switches are spread over frames
+    if (lod_budget_frame != game_state->frame_count) {
+        lod_budget_frame = game_state->frame_count;
+        lod_budget_left = Config::World::LOD_REMESH_BUDGET;
+    }
 
-    const int32 player_chunk_x = player_pos.x / Config::World::CHUNK_SIZE;
-    const int32 player_chunk_y = player_pos.y / Config::World::CHUNK_SIZE;
-    const int32 player_chunk_z = player_pos.z / Config::World::CHUNK_SIZE;
+    visible_count = 0;
+    nearby_count = 0;
+    const int32 player_chunk_x = world_to_chunk_coord(player_pos.x);
+    const int32 player_chunk_y = world_to_chunk_coord(player_pos.y);
+    const int32 player_chunk_z = world_to_chunk_coord(player_pos.z);
 
-    constexpr int32 DRAW_RADIUS_SQR = Config::World::DRAW_RADIUS * Config::World::DRAW_RADIUS;
     for (int32 chunk_x = player_chunk_x - Config::World::DRAW_RADIUS; chunk_x < player_chunk_x + Config::World::DRAW_RADIUS; chunk_x++) {
         for (int32 chunk_y = player_chunk_y - Config::World::DRAW_RADIUS; chunk_y < player_chunk_y + Config::World::DRAW_RADIUS; chunk_y++) {
             for (int32 chunk_z = player_chunk_z - Config::World::DRAW_RADIUS; chunk_z < player_chunk_z + Config::World::DRAW_RADIUS; chunk_z++) {
-                const int32 xd = chunk_x - player_chunk_x;
-                const int32 yd = chunk_y - player_chunk_y;
-                const int32 zd = chunk_z - player_chunk_z;
-                if (xd * xd + yd * yd + zd * zd > DRAW_RADIUS_SQR) {
+                const float32 distance = get_chunk_distance(chunk_x, chunk_y, chunk_z, player_pos);
+                if (distance > Config::World::DRAW_RADIUS) {
                     continue;
                 }
                 Chunk *chunk = get_chunk(chunk_x, chunk_y, chunk_z, world_arena);
-                if (frustum.test_intersection(chunk->get_aabb()) != Frustum::TEST_OUTSIDE) {
-                    chunk->draw(model_loc);
+                nearby_chunks[nearby_count++] = chunk;
+                if (chunk->filled && lod_budget_left > 0) {
+                    const int32 desired_lod = chunk->get_desired_lod(distance);
+                    if (desired_lod != chunk->lod) {
+                        chunk->set_lod(desired_lod);
+                        lod_budget_left--;
+                    }
+                }
+                const Frustum::TestResult result = frustum.test_intersection(chunk->get_aabb());
+                if (result != Frustum::TEST_OUTSIDE) {
+                    visible_chunks[visible_count] = chunk;
+                    visible_partly[visible_count] = result != Frustum::TEST_INSIDE;
+                    visible_count++;
                 }
             }
         }
     }
 }
 
+// Redoes the frustum test of the last cull_chunks for a turned camera. It does not create chunks or switch LODs, so it can run while
+// the simulation does.
+void ChunkMap::recull_nearby_chunks(const Frustum &frustum) {
+    visible_count = 0;
+    for (uint32 i = 0; i < nearby_count; i++) {
+        const Frustum::TestResult result = frustum.test_intersection(nearby_chunks[i]->get_aabb());
+        if (result != Frustum::TEST_OUTSIDE) {
+            visible_chunks[visible_count] = nearby_chunks[i];
+            visible_partly[visible_count] = result != Frustum::TEST_INSIDE;
+            visible_count++;
+        }
+    }
+}
+
+// Draws the chunks found by the last cull_chunks. With depth_only, only their positions are drawn.
+void ChunkMap::draw_visible_chunks(const int32 model_loc, const Frustum &frustum, const FaceFilter &faces, const bool depth_only) const {
+    for (uint32 i = 0; i < visible_count; i++) {
+        visible_chunks[i]->draw(model_loc, visible_partly[i] ? &frustum : nullptr, faces, depth_only);
+    }
+}
+
+// Draws the chunks found around the player by the last cull_chunks into several layers with one traversal, see Chunk::draw_layered.
+// frustums holds one frustum per layer.
+void ChunkMap::draw_chunks_layered(const int32 model_loc, const int32 layer_mask_loc, const Frustum *frustums, const uint8 layer_mask,
+                                   const FaceFilter &faces) const {
+    for (uint32 i = 0; i < nearby_count; i++) {
+        const Chunk *chunk = nearby_chunks[i];
+        const AABB box = chunk->get_aabb();
+        uint8 chunk_mask = 0;
+        for (int32 layer = 0; layer < 8; layer++) {
+            if ((layer_mask & (1 << layer)) && frustums[layer].test_intersection(box) != Frustum::TEST_OUTSIDE) {
+                chunk_mask |= 1 << layer;
+            }
+        }
+        if (chunk_mask != 0) {
+            chunk->draw_layered(model_loc, layer_mask_loc, frustums, chunk_mask, faces);
+        }
+    }
+}
+
 void ChunkMap::push_to_be_filled(Chunk *chunk) {
     to_be_filled[to_be_filled_len] = chunk;
     to_be_filled_len++;
@@ -499,58 +1016,45 @@ void ChunkMap::change_block_at_block_pos(const BlockPos &b_pos, const uint8 new_
     chunk->dirty = true;
     if (!chunk->blocks) {
         // If chunk is empty, create the blocks array
-        chunk->blocks = pushArray(*world_arena, Config::World::CHUNK_SIZE * Config::World::CHUNK_SIZE * Config::World::CHUNK_SIZE, uint8);
+        chunk->allocate_blocks();
     }
     if (chunk->blocks[BID(b_pos.block_x, b_pos.block_y, b_pos.block_z)] != new_block) {
-        chunk->blocks[BID(b_pos.block_x, b_pos.block_y, b_pos.block_z)] = new_block;
-        chunk->update();
-
-        // May need to update neighboring chunks
-        if (b_pos.block_x == 0) {
-            const BlockPos neighbor = {b_pos.chunk_x - 1, b_pos.chunk_y, b_pos.chunk_z, Config::World::CHUNK_SIZE - 1, b_pos.block_y, b_pos.block_z};
-            if (get_block_at_block_pos(neighbor) != 0) {
-                // No need to check chunk pointer because get_block_at_block_pos
-                // returned non-zero
-                get_chunk(b_pos.chunk_x - 1, b_pos.chunk_y, b_pos.chunk_z)->update();
-            }
-        }
-        if (b_pos.block_x == Config::World::CHUNK_SIZE - 1) {
-            const BlockPos neighbor = {b_pos.chunk_x + 1, b_pos.chunk_y, b_pos.chunk_z, 0, b_pos.block_y, b_pos.block_z};
-            if (get_block_at_block_pos(neighbor) != 0) {
-                get_chunk(b_pos.chunk_x + 1, b_pos.chunk_y, b_pos.chunk_z)->update();
-            }
-        }
-        if (b_pos.block_y == 0) {
-            const BlockPos neighbor = {b_pos.chunk_x, b_pos.chunk_y - 1, b_pos.chunk_z, b_pos.block_x, Config::World::CHUNK_SIZE - 1, b_pos.block_z};
-            if (get_block_at_block_pos(neighbor) != 0) {
-                get_chunk(b_pos.chunk_x, b_pos.chunk_y - 1, b_pos.chunk_z)->update();
-            }
-        }
-        if (b_pos.block_y == Config::World::CHUNK_SIZE - 1) {
-            const BlockPos neighbor = {b_pos.chunk_x, b_pos.chunk_y + 1, b_pos.chunk_z, b_pos.block_x, 0, b_pos.block_z};
-            if (get_block_at_block_pos(neighbor) != 0) {
-                get_chunk(b_pos.chunk_x, b_pos.chunk_y + 1, b_pos.chunk_z)->update();
+        chunk->set_block(b_pos.block_x, b_pos.block_y, b_pos.block_z, new_block);
+
+        // Faces and ambient occlusion of the blocks around the edited one can change, so every section within one block of it is remeshed
+        constexpr int32 MASK = Config::World::CHUNK_SIZE - 1;
+        constexpr int32 S = Config::World::SECTION_SIZE;
+        uint8 section_mask = 0;
+        for (int32 section_z = MAX(b_pos.block_z - 1, 0) / S; section_z <= MIN(b_pos.block_z + 1, MASK) / S; section_z++) {
+            for (int32 section_y = MAX(b_pos.block_y - 1, 0) / S; section_y <= MIN(b_pos.block_y + 1, MASK) / S; section_y++) {
+                for (int32 section_x = MAX(b_pos.block_x - 1, 0) / S; section_x <= MIN(b_pos.block_x + 1, MASK) / S; section_x++) {
+                    section_mask |= 1 << SID(section_x, section_y, section_z);
+                }
             }
         }
-        if (b_pos.block_z == 0) {
-            const BlockPos neighbor = {b_pos.chunk_x, b_pos.chunk_y, b_pos.chunk_z - 1, b_pos.block_x, b_pos.block_y, Config::World::CHUNK_SIZE - 1};
-            if (get_block_at_block_pos(neighbor) != 0) {
-                get_chunk(b_pos.chunk_x, b_pos.chunk_y, b_pos.chunk_z - 1)->update();
+        mark_dirty(chunk, section_mask);
+
+        // May need to update neighboring chunks
+        for (int32 face = 0; face < 6; face++) {
+            const int32 neighbor_x = b_pos.block_x + FACE_OFFSETS[face][0];
+            const int32 neighbor_y = b_pos.block_y + FACE_OFFSETS[face][1];
+            const int32 neighbor_z = b_pos.block_z + FACE_OFFSETS[face][2];
+            if (((neighbor_x | neighbor_y | neighbor_z) & ~MASK) == 0) {
+                // Inside this chunk
+                continue;
             }
-        }
-        if (b_pos.block_z == Config::World::CHUNK_SIZE - 1) {
-            const BlockPos neighbor = {b_pos.chunk_x, b_pos.chunk_y, b_pos.chunk_z + 1, b_pos.block_x, b_pos.block_y, 0};
-            if (get_block_at_block_pos(neighbor) != 0) {
-                get_chunk(b_pos.chunk_x, b_pos.chunk_y, b_pos.chunk_z + 1)->update();
+            Chunk *neighbor = chunk->neighbors[face];
+            if (neighbor && neighbor->get_block(neighbor_x & MASK, neighbor_y & MASK, neighbor_z & MASK) != 0) {
+                mark_dirty(neighbor, 1 << SID((neighbor_x & MASK) / S, (neighbor_y & MASK) / S, (neighbor_z & MASK) / S));
             }
         }
     }
 }
 
 void ChunkMap::update_all_chunks(const Vector3f &player_pos) {
-    const int32 player_chunk_x = player_pos.x / Config::World::CHUNK_SIZE;
-    const int32 player_chunk_y = player_pos.y / Config::World::CHUNK_SIZE;
-    const int32 player_chunk_z = player_pos.z / Config::World::CHUNK_SIZE;
+    const int32 player_chunk_x = world_to_chunk_coord(player_pos.x);
+    const int32 player_chunk_y = world_to_chunk_coord(player_pos.y);
+    const int32 player_chunk_z = world_to_chunk_coord(player_pos.z);
     for (int32 chunk_x = player_chunk_x - Config::World::DRAW_RADIUS; chunk_x < player_chunk_x + Config::World::DRAW_RADIUS; chunk_x++) {
         for (int32 chunk_y = player_chunk_y - Config::World::DRAW_RADIUS; chunk_y < player_chunk_y + Config::World::DRAW_RADIUS; chunk_y++) {
             for (int32 chunk_z = player_chunk_z - Config::World::DRAW_RADIUS; chunk_z < player_chunk_z + Config::World::DRAW_RADIUS; chunk_z++) {
@@ -6,6 +6,12 @@
 #include "Utility.h"
 
 #define BID(x, y, z) (((z) * Config::World::CHUNK_SIZE * Config::World::CHUNK_SIZE) + ((y) * Config::World::CHUNK_SIZE) + ((x)))
+#define OID(y, z) (((z) * Config::World::CHUNK_SIZE) + (y))
+#define SID(x, y, z) (((z) * Config::World::SECTIONS_PER_AXIS * Config::World::SECTIONS_PER_AXIS) + ((y) * Config::World::SECTIONS_PER_AXIS) + ((x)))
+
+static_assert(Config::World::CHUNK_SIZE == 32, "Occupancy rows are 32 bit masks");
+static_assert(1 << Config::World::CHUNK_SIZE_SHIFT == Config::World::CHUNK_SIZE, "CHUNK_SIZE_SHIFT must match CHUNK_SIZE");
+static_assert(Config::World::SECTION_COUNT <= 8, "Section dirty bits are kept in a byte");
 
 namespace std {
 namespace filesystem {
@@ -18,18 +24,86 @@ struct GameState;
 struct ChunkMap;
 struct MemoryArena;
 
+// A cubic grid of blocks to be meshed, either the chunk itself or a downsampled copy of it for LOD meshes
+struct MeshGrid {
+    const uint8 *cells = nullptr;
+    int32 size = Config::World::CHUNK_SIZE;  // Cell count along an axis
+    int32 scale = 1;                         // Block count along an axis that one cell covers
+
+    uint8 get(const int32 x, const int32 y, const int32 z) const {
+        if (!cells || x >= size || x < 0 || y >= size || y < 0 || z >= size || z < 0) {
+            return 0;
+        }
+        return cells[(z * size + y) * size + x];
+    }
+};
+
+// Mesh of one section of a chunk. The buffers are created when the section first has faces.
+// Faces are grouped by direction, in the face order of FACE_OFFSETS, so directions facing away from the viewer can be skipped.
+// The buffer holds all positions before the other attributes, and depth_vao reads only the positions.
+struct ChunkSection {
+    uint32 vbo = 0;
+    uint32 vao = 0;
+    uint32 depth_vao = 0;
+    uint32 vertex_count = 0;
+    int32 face_first[6] = {};
+    int32 face_count[6] = {};
+};
+
+// Decides which face directions of a chunk mesh can be seen. All faces of a direction are parallel, so a viewer at a point
+// sees a direction only from the front of one of its planes in the box, and a directional viewer (the sun) sees the same
+// directions everywhere.
+struct FaceFilter {
+    Vector3f eye;
+    uint8 direction_mask = 0x3F;  // Used if there is no eye
+    bool has_eye = false;
+
+    static FaceFilter from_eye(const Vector3f &eye) {
+        FaceFilter filter;
+        filter.eye = eye;
+        filter.has_eye = true;
+        return filter;
+    }
+    static FaceFilter from_direction(const Vector3f &to_viewer) {
+        FaceFilter filter;
+        filter.direction_mask = (to_viewer.z < 0) | (to_viewer.z > 0) << 1 | (to_viewer.x < 0) << 2 | (to_viewer.x > 0) << 3 | (to_viewer.y < 0) << 4 |
+                                (to_viewer.y > 0) << 5;
+        return filter;
+    }
+    uint8 get_face_mask(const AABB &box) const;
+};
+
 struct Chunk {
+    static constexpr uint8 ALL_SECTIONS = (1 << Config::World::SECTION_COUNT) - 1;
+
     Chunk() = default;
     void fill();
     void initialize(int32 chunk_x, int32 chunk_y, int32 chunk_z, ChunkMap *chunk_map);
-    void initialize_open_gl_stuff(bool do_update);
     void after_fill();
-    void draw(int32 model_loc) const;
+    void draw(int32 model_loc, const Frustum *frustum, const FaceFilter &faces, bool depth_only) const;
+    void draw_layered(int32 model_loc, int32 layer_mask_loc, const Frustum *frustums, uint8 layer_mask, const FaceFilter &faces) const;
+    void draw_section(const ChunkSection &mesh, const AABB &box, const FaceFilter &faces, uint32 vao) const;
+    void set_model_uniform(int32 model_loc) const;
     void update();
+    void update_sections(uint8 section_mask);
+    void upload_section(int32 section, float32 *const *face_vertices, const uint32 *face_attr_counts, float32 *staging);
+    bool is_section_hidden(int32 section_x, int32 section_y, int32 section_z) const;
+    bool is_lod_section_hidden(const MeshGrid &grid, int32 i0, int32 j0, int32 k0, int32 cells) const;
+    uint8 get_mesh_cell(const MeshGrid &grid, int32 i, int32 j, int32 k) const;
+    void fill_block_faces(const MeshGrid &grid, int32 i, int32 j, int32 k, uint32 *face_attr_counts, float32 *const *face_vertices) const;
     void generate();
-    void fill_vertices(int32 i, int32 j, int32 k, int32 f, Vector3f color, uint32 &attr_count, float32 *chunk_vertices) const;
-    int32 get_vertex_ao(int32 i, int32 j, int32 k, Vector3f v, Vector3f normal) const;
-    AABB get_aabb();
+    void allocate_blocks();
+    void rebuild_occupancy();
+    void link_neighbors();
+    bool is_neighborhood_ready() const;
+    uint8 get_lod_cell(int32 scale, int32 cx, int32 cy, int32 cz) const;
+    void downsample(int32 scale, uint8 *cells) const;
+    int32 get_desired_lod(float32 distance) const;
+    void set_lod(int32 new_lod);
+    void fill_vertices(const MeshGrid &grid, int32 i, int32 j, int32 k, int32 f, Vector3f color, uint32 &attr_count, float32 *chunk_vertices) const;
+    int32 get_vertex_ao(const MeshGrid &grid, int32 i, int32 j, int32 k, Vector3f v, Vector3f normal) const;
+    AABB get_aabb() const;
+    AABB get_section_aabb(int32 section) const;
     void save_to_file() const;
     bool load_from_file();
     void get_save_file_name(std::filesystem::path &filename) const;
@@ -39,18 +113,32 @@ struct Chunk {
         }
         return blocks[BID(x, y, z)];
     }
+    void set_block(const int32 x, const int32 y, const int32 z, const uint8 block) {
+        blocks[BID(x, y, z)] = block;
+        if (block) {
+            occupancy[OID(y, z)] |= 1u << x;
+        } else {
+            occupancy[OID(y, z)] &= ~(1u << x);
+        }
+    }
 
-    uint32 vbo_chunk = 0;
-    uint32 vao_chunk = 0;
-    uint32 vertex_count = 0;
+    ChunkSection sections[Config::World::SECTION_COUNT];
     int32 chunk_x = 0;
     int32 chunk_y = 0;
     int32 chunk_z = 0;
+    int32 lod = 0;
     uint8 *blocks = nullptr;
+    uint32 *occupancy = nullptr;  // One bit per block along x for each (y, z) row, set if the block is solid
     bool filled = false;
-    bool dirty = false;
+    bool dirty = false;         // Has unsaved edits
+    bool fill_pending = false;  // Waiting in the fill queue
+    bool mesh_dirty = false;    // Waiting in the dirty queue to be meshed
+    uint8 dirty_sections = 0;   // Sections the dirty queue will remesh, one bit each
+    uint64 dirty_frame = 0;     // Frame it was queued for meshing on
     ChunkMap *chunk_map = nullptr;
     Chunk *next_in_hash = nullptr;
+    Chunk *neighbors[6] = {};  // Adjacent chunks in face order (see FACE_OFFSETS), null until they are created
+    Chunk *next_dirty = nullptr;
 };
 
 struct BlockPos {
@@ -68,13 +156,20 @@ struct BlockPos {
 
 struct ChunkMap {
     void initialize(GameState *state);
-    void draw_chunks(int32 model_loc, const Frustum &frustum, const Vector3f &player_pos);
+    void update_chunks(const Vector3f &player_pos);
+    void cull_chunks(const Frustum &frustum, const Vector3f &player_pos);
+    void recull_nearby_chunks(const Frustum &frustum);
+    void draw_visible_chunks(int32 model_loc, const Frustum &frustum, const FaceFilter &faces, bool depth_only) const;
+    void draw_chunks_layered(int32 model_loc, int32 layer_mask_loc, const Frustum *frustums, uint8 layer_mask, const FaceFilter &faces) const;
     uint8 get_block_at_block_pos(const BlockPos &b_pos, bool create_chunk = false);
     uint8 get_block_at_pos(Vector3f pos);
     void change_block_at_block_pos(const BlockPos &b_pos, uint8 new_block);
     Chunk *get_chunk(int32 chunk_x, int32 chunk_y, int32 chunk_z, bool create = true);
     void push_to_be_filled(Chunk *chunk);
     void fill_next_chunk(const Vector3f &player_pos);
+    void mark_dirty(Chunk *chunk, uint8 section_mask = Chunk::ALL_SECTIONS);
+    void update_dirty_chunks();
+    void add_changed_mesh(const AABB &box);
     void save() const;
     void update_all_chunks(const Vector3f &player_pos);
 
@@ -83,7 +178,27 @@ struct ChunkMap {
     Chunk *chunk_hash[4096] = {};  // todo: pick a better size
     Chunk *to_be_filled[Config::World::DRAW_RADIUS * Config::World::DRAW_RADIUS * Config::World::DRAW_RADIUS * 8] = {};
     uint32 to_be_filled_len = 0;
+    Chunk *dirty_chunks = nullptr;  // Chunks waiting to be meshed, linked through Chunk::next_dirty
+    uint32 streamed_fill_count = 0;  // Fills and meshes since the fill queue was last empty
+    uint32 streamed_mesh_count = 0;
+    uint64 lod_budget_frame = 0;
+    uint32 lod_budget_left = 0;
+    // Chunks that passed the frustum test in the last cull_chunks, so every pass of a frame draws the same list.
+    // Chunks that are only partly inside test their sections too.
+    Chunk *visible_chunks[Config::World::DRAW_RADIUS * Config::World::DRAW_RADIUS * Config::World::DRAW_RADIUS * 8] = {};
+    bool visible_partly[Config::World::DRAW_RADIUS * Config::World::DRAW_RADIUS * Config::World::DRAW_RADIUS * 8] = {};
+    uint32 visible_count = 0;
+    // All chunks in the draw radius at the last cull_chunks, for the passes that are not seen through the player frustum
+    Chunk *nearby_chunks[Config::World::DRAW_RADIUS * Config::World::DRAW_RADIUS * Config::World::DRAW_RADIUS * 8] = {};
+    uint32 nearby_count = 0;
     GameState *game_state = nullptr;
+
+    // Bounds of the meshes uploaded since the renderer last looked, for invalidating cached shadow maps.
+    // When the list is full, the last box grows to hold the rest.
+    static constexpr uint32 CHANGED_MESH_LIMIT = 64;
+    Vector3f changed_mesh_mins[CHANGED_MESH_LIMIT];
+    Vector3f changed_mesh_maxs[CHANGED_MESH_LIMIT];
+    uint32 changed_mesh_count = 0;
 };
 
 extern float32 block_noise_values[];
@@ -107,6 +222,25 @@ inline Vector3f block_pos_to_pos(const BlockPos &block_pos) {
     };
 }
 
+// Chunk coordinate of a world coordinate
+inline int32 world_to_chunk_coord(const float32 value) {
+    return fast_floor(value) >> Config::World::CHUNK_SIZE_SHIFT;
+}
+
+// Distance in chunks from the chunk the player is in, which the draw radius and the LOD levels are measured in
+inline float32 get_chunk_distance(const int32 chunk_x, const int32 chunk_y, const int32 chunk_z, const Vector3f &player_pos) {
+    const int32 xd = chunk_x - world_to_chunk_coord(player_pos.x);
+    const int32 yd = chunk_y - world_to_chunk_coord(player_pos.y);
+    const int32 zd = chunk_z - world_to_chunk_coord(player_pos.z);
+    return sqrtf((float32)(xd * xd + yd * yd + zd * zd));
+}
+
+// Block position of the block at integer world coordinates
+inline BlockPos block_coords_to_block_pos(const int32 x, const int32 y, const int32 z) {
+    constexpr int32 MASK = Config::World::CHUNK_SIZE - 1;
+    return {x >> Config::World::CHUNK_SIZE_SHIFT, y >> Config::World::CHUNK_SIZE_SHIFT, z >> Config::World::CHUNK_SIZE_SHIFT, x & MASK, y & MASK, z & MASK};
+}
+
 inline void canonicalize_block_pos(BlockPos &block_pos) {
     if (block_pos.block_x >= Config::World::CHUNK_SIZE || block_pos.block_x < 0) {
         block_pos.chunk_x += (int32)floor((float32)block_pos.block_x / (float32)Config::World::CHUNK_SIZE);
@@ -122,6 +256,69 @@ inline void canonicalize_block_pos(BlockPos &block_pos) {
     }
 }
 
+// Offsets of the neighbors through each cube face, in the face order of the chunk meshes (-z, +z, -x, +x, -y, +y)
+constexpr int32 FACE_OFFSETS[6][3] = {{0, 0, -1}, {0, 0, 1}, {-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}};
+
+// Reads blocks by world block coordinates, keeping the last few chunks it used. Spatially coherent reads (particles of a burst,
+// blocks around an entity, the neighbors of a block) mostly hit these chunks and skip the hash lookup.
+// Chunks created after a lookup missed them are not seen, so accessors should not outlive the update that made them.
+struct BlockAccessor {
+    static constexpr int32 CACHE_SIZE = 4;
+
+    ChunkMap *chunk_map;
+    Chunk *chunks[CACHE_SIZE] = {};
+    int32 chunk_xs[CACHE_SIZE] = {INT32_MIN, INT32_MIN, INT32_MIN, INT32_MIN};
+    int32 chunk_ys[CACHE_SIZE] = {INT32_MIN, INT32_MIN, INT32_MIN, INT32_MIN};
+    int32 chunk_zs[CACHE_SIZE] = {INT32_MIN, INT32_MIN, INT32_MIN, INT32_MIN};
+    int32 last = 0;  // Entry of the most recent lookup, checked first
+
+    explicit BlockAccessor(ChunkMap *chunk_map) : chunk_map(chunk_map) {}
+
+    // Returns null for chunks that do not exist, without creating them
+    Chunk *get_chunk(const int32 chunk_x, const int32 chunk_y, const int32 chunk_z) {
+        if (chunk_xs[last] == chunk_x && chunk_ys[last] == chunk_y && chunk_zs[last] == chunk_z) {
+            return chunks[last];
+        }
+        for (int32 i = 0; i < CACHE_SIZE; i++) {
+            if (chunk_xs[i] == chunk_x && chunk_ys[i] == chunk_y && chunk_zs[i] == chunk_z) {
+                last = i;
+                return chunks[i];
+            }
+        }
+        // Steps to the next chunk through the links of the last one if they are adjacent, otherwise goes through the hash map
+        Chunk *chunk;
+        const int32 dx = chunk_x - chunk_xs[last];
+        const int32 dy = chunk_y - chunk_ys[last];
+        const int32 dz = chunk_z - chunk_zs[last];
+        if (chunks[last] && abs(dx) + abs(dy) + abs(dz) == 1) {
+            chunk = chunks[last]->neighbors[dz != 0 ? (dz > 0) : dx != 0 ? 2 + (dx > 0) : 4 + (dy > 0)];
+        } else {
+            chunk = chunk_map->get_chunk(chunk_x, chunk_y, chunk_z, false);
+        }
+
+        // Evicts the entry after the most recent one, so entries are replaced in order
+        last = (last + 1) % CACHE_SIZE;
+        chunks[last] = chunk;
+        chunk_xs[last] = chunk_x;
+        chunk_ys[last] = chunk_y;
+        chunk_zs[last] = chunk_z;
+        return chunks[last];
+    }
+
+    uint8 get(const int32 x, const int32 y, const int32 z) {
+        constexpr int32 MASK = Config::World::CHUNK_SIZE - 1;
+        const Chunk *chunk = get_chunk(x >> Config::World::CHUNK_SIZE_SHIFT, y >> Config::World::CHUNK_SIZE_SHIFT, z >> Config::World::CHUNK_SIZE_SHIFT);
+        return chunk && chunk->blocks ? chunk->blocks[BID(x & MASK, y & MASK, z & MASK)] : 0;
+    }
+    uint8 get(const BlockPos &b_pos) { return get(b_pos.get_x(), b_pos.get_y(), b_pos.get_z()); }
+    uint8 get_at_pos(const Vector3f &pos) { return get(fast_floor(pos.x + 0.5f), fast_floor(pos.y + 0.5f), fast_floor(pos.z + 0.5f)); }
+
+    // Block next to (x, y, z) through the given face
+    uint8 get_neighbor(const int32 x, const int32 y, const int32 z, const int32 face) {
+        return get(x + FACE_OFFSETS[face][0], y + FACE_OFFSETS[face][1], z + FACE_OFFSETS[face][2]);
+    }
+};
+
 inline float32 get_noise_at(const int32 chunk_x, const int32 chunk_z, const int32 x, const int32 z, const int32 dx=0, const int32 dz=0) {
     const int32 bx = chunk_x * Config::World::CHUNK_SIZE + x;
     const int32 bz = chunk_z * Config::World::CHUNK_SIZE + z;
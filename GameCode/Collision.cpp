@@ -1,38 +1,128 @@
 #include "Collision.h"
 
 #include "AABB.h"
+#include "Profiler.h"
 
+// Sweep of a box along one axis against the unit blocks of the grid. Entry and exit times of a block only depend on its
+// coordinate along the axis, so they are computed once per row or column instead of once per block pair.
+struct AxisSweep {
+    float32 box_min;
+    float32 box_max;
+    float32 speed;
+
+    // Same formulas as swept_aabb_check, so the results match it exactly
+    void get_times(const int32 b, float32 &entry, float32 &exit, float32 &inv_entry) const {
+        const float32 block_min = (float32)b - 0.5f;
+        const float32 block_max = (float32)b + 0.5f;
+        float32 inv_exit;
+        if (speed > 0.0f) {
+            inv_entry = block_min - box_max;
+            inv_exit = block_max - box_min;
+        } else {
+            inv_entry = block_max - box_min;
+            inv_exit = block_min - box_max;
+        }
+        if (speed == 0.0f) {
+            entry = -INFINITY;
+            exit = INFINITY;
+        } else {
+            entry = inv_entry / speed;
+            exit = inv_exit / speed;
+        }
+    }
+};
+
+// Range of blocks that touch or overlap [min, max], the same blocks that pass aabb_check against the broadphase box
+inline void get_block_range(const float32 min, const float32 max, int32 &start, int32 &end) {
+    start = (int32)floor(min);
+    if ((float32)start + 0.5f < min) {
+        start++;
+    }
+    end = (int32)ceil(max);
+    if ((float32)end - 0.5f > max) {
+        end--;
+    }
+}
+
+// Walks the blocks in the swept box chunk by chunk, stepping between chunks through their neighbor links. Rows of air are skipped with the
+// occupancy bitsets, so only solid blocks get the swept test. Ties are broken towards the smallest (x, y, z) to
+// return the same block as a plain x, y, z loop.
 float32 detect_collision(ChunkMap &chunk_map, const AABB &box, Vector3f movement, Vector3f &cc_normal, BlockPos &cc_bpos) {
+    PROFILE_SCOPE("detect_collision");
+    constexpr int32 MASK = Config::World::CHUNK_SIZE - 1;
     const AABB broad_phase_box = get_swept_broadphase_aabb(box, movement);
+    const AxisSweep sweep_x = {box.min.x, box.max.x, movement.x};
+    const AxisSweep sweep_y = {box.min.y, box.max.y, movement.y};
+    const AxisSweep sweep_z = {box.min.z, box.max.z, movement.z};
 
-    // Define the box to check for collisions in
-    const auto start_x = (int32)floor(broad_phase_box.min.x);
-    const auto start_y = (int32)floor(broad_phase_box.min.y);
-    const auto start_z = (int32)floor(broad_phase_box.min.z);
-    const auto end_x = (int32)ceil(broad_phase_box.max.x);
-    const auto end_y = (int32)ceil(broad_phase_box.max.y);
-    const auto end_z = (int32)ceil(broad_phase_box.max.z);
+    int32 start_x, start_y, start_z, end_x, end_y, end_z;
+    get_block_range(broad_phase_box.min.x, broad_phase_box.max.x, start_x, end_x);
+    get_block_range(broad_phase_box.min.y, broad_phase_box.max.y, start_y, end_y);
+    get_block_range(broad_phase_box.min.z, broad_phase_box.max.z, start_z, end_z);
 
+    BlockAccessor accessor(&chunk_map);
     float32 cc_t = 1.0f;
-    for (int32 x = start_x; x <= end_x; x++) {
-        for (int32 y = start_y; y <= end_y; y++) {
-            for (int32 z = start_z; z <= end_z; z++) {
-                BlockPos b_pos;
-                pos_to_block_pos(Vector3f(x, y, z), b_pos);
-                const uint8 block = chunk_map.get_block_at_block_pos(b_pos);
-                if (block != 0) {
-                    AABB block_box = get_block_box(b_pos);
-
-                    // Basic AABB intersection check with the broad phase box
-                    if (aabb_check(broad_phase_box, block_box)) {
-                        Vector3f normal;
-                        const float32 t = swept_aabb_check(box, block_box, movement, normal);
-                        if (t < 1.0f) {
-                            // collision
-                            if (cc_t > t) {
-                                cc_t = t;
-                                cc_normal = normal;
-                                cc_bpos = b_pos;
+    int32 cc_x = 0, cc_y = 0, cc_z = 0;
+    for (int32 chunk_z = start_z >> Config::World::CHUNK_SIZE_SHIFT; chunk_z <= end_z >> Config::World::CHUNK_SIZE_SHIFT; chunk_z++) {
+        for (int32 chunk_y = start_y >> Config::World::CHUNK_SIZE_SHIFT; chunk_y <= end_y >> Config::World::CHUNK_SIZE_SHIFT; chunk_y++) {
+            for (int32 chunk_x = start_x >> Config::World::CHUNK_SIZE_SHIFT; chunk_x <= end_x >> Config::World::CHUNK_SIZE_SHIFT; chunk_x++) {
+                const Chunk *chunk = accessor.get_chunk(chunk_x, chunk_y, chunk_z);
+                if (!chunk || !chunk->occupancy) {
+                    continue;
+                }
+
+                // Part of the block range inside this chunk, in world coordinates
+                const int32 base_x = chunk_x << Config::World::CHUNK_SIZE_SHIFT;
+                const int32 base_y = chunk_y << Config::World::CHUNK_SIZE_SHIFT;
+                const int32 base_z = chunk_z << Config::World::CHUNK_SIZE_SHIFT;
+                const int32 from_x = MAX(start_x, base_x), to_x = MIN(end_x, base_x + MASK);
+                const int32 from_y = MAX(start_y, base_y), to_y = MIN(end_y, base_y + MASK);
+                const int32 from_z = MAX(start_z, base_z), to_z = MIN(end_z, base_z + MASK);
+                const uint32 x_mask = (0xFFFFFFFFu >> (MASK - (to_x - base_x))) & (0xFFFFFFFFu << (from_x - base_x));
+
+                for (int32 z = from_z; z <= to_z; z++) {
+                    float32 z_entry, z_exit, z_inv_entry;
+                    sweep_z.get_times(z, z_entry, z_exit, z_inv_entry);
+                    if (z_entry > 1.0f) {
+                        continue;
+                    }
+                    for (int32 y = from_y; y <= to_y; y++) {
+                        uint32 row = chunk->occupancy[OID(y & MASK, z & MASK)] & x_mask;
+                        if (!row) {
+                            continue;
+                        }
+                        float32 y_entry, y_exit, y_inv_entry;
+                        sweep_y.get_times(y, y_entry, y_exit, y_inv_entry);
+                        if (y_entry > 1.0f) {
+                            continue;
+                        }
+
+                        while (row) {
+                            const int32 x = base_x + count_trailing_zeros(row);
+                            row &= row - 1;
+
+                            float32 x_entry, x_exit, x_inv_entry;
+                            sweep_x.get_times(x, x_entry, x_exit, x_inv_entry);
+                            const float32 entry_time = MAX(x_entry, MAX(y_entry, z_entry));
+                            const float32 exit_time = MIN(x_exit, MIN(y_exit, z_exit));
+                            if (entry_time > exit_time || (x_entry < 0.0f && y_entry < 0.0f && z_entry < 0.0f) || x_entry > 1.0f) {
+                                continue;
+                            }
+                            if (entry_time > cc_t ||
+                                (entry_time == cc_t && (cc_t == 1.0f || x > cc_x || (x == cc_x && (y > cc_y || (y == cc_y && z > cc_z)))))) {
+                                continue;
+                            }
+
+                            cc_t = entry_time;
+                            cc_x = x;
+                            cc_y = y;
+                            cc_z = z;
+                            if (x_entry > y_entry && x_entry > z_entry) {
+                                cc_normal = {x_inv_entry < 0.0f ? 1.0f : -1.0f, 0.0f, 0.0f};
+                            } else if (y_entry > x_entry && y_entry > z_entry) {
+                                cc_normal = {0.0f, y_inv_entry < 0.0f ? 1.0f : -1.0f, 0.0f};
+                            } else {
+                                cc_normal = {0.0f, 0.0f, z_inv_entry < 0.0f ? 1.0f : -1.0f};
                             }
                         }
                     }
@@ -40,6 +130,10 @@ float32 detect_collision(ChunkMap &chunk_map, const AABB &box, Vector3f movement
             }
         }
     }
+
+    if (cc_t < 1.0f) {
+        cc_bpos = block_coords_to_block_pos(cc_x, cc_y, cc_z);
+    }
     return cc_t;
 }
 
@@ -59,18 +153,14 @@ bool handle_collision(Player &player, ChunkMap &chunk_map, Vector3f &new_pos) {
         player.pos += (player_movement * cc_t) + (cc_normal * EPSILON);
 
         BlockPos player_bpos;
-
-        BlockPos cc_top_bpos = cc_bpos;
-        cc_top_bpos.block_y += 1;
-        canonicalize_block_pos(cc_top_bpos);
-
-        BlockPos cc_top2_bpos = cc_top_bpos;
-        cc_top2_bpos.block_y += 1;
-        canonicalize_block_pos(cc_top2_bpos);
-
         pos_to_block_pos(player.pos, player_bpos);
-        if (cc_normal.y == 0 && (cc_bpos.get_y() < player_bpos.get_y()) && chunk_map.get_block_at_block_pos(cc_top_bpos) == 0 &&
-            chunk_map.get_block_at_block_pos(cc_top2_bpos) == 0) {
+
+        BlockAccessor accessor(&chunk_map);
+        const int32 cc_x = cc_bpos.get_x();
+        const int32 cc_y = cc_bpos.get_y();
+        const int32 cc_z = cc_bpos.get_z();
+        if (cc_normal.y == 0 && (cc_y < player_bpos.get_y()) && accessor.get(cc_x, cc_y + 1, cc_z) == 0 &&
+            accessor.get(cc_x, cc_y + 2, cc_z) == 0) {
             // Running into a 1-high block moves you on top of it
             player_movement = player_movement * remaining_time;
             player.pos.y += 1;
@@ -89,7 +179,95 @@ bool handle_collision(Player &player, ChunkMap &chunk_map, Vector3f &new_pos) {
     return false;
 }
 
-uint8 find_block_in_front(ChunkMap &chunk_map, Vector3f org, const Vector3f dir, BlockPos &b_pos_result, BlockPos &front_b_pos_result) {
+// Amanatides-Woo traversal of the block grid, each block along the ray is read once
+static uint8 cast_ray(BlockAccessor &accessor, const Vector3f &org, const Vector3f &dir, const float32 max_dist, RayHit &hit) {
+    // Blocks are centered on integer coordinates, so the origin is shifted by half a block to make cells start at integers
+    const float32 start[3] = {org.x + 0.5f, org.y + 0.5f, org.z + 0.5f};
+    const float32 direction[3] = {dir.x, dir.y, dir.z};
+    int32 cell[3] = {fast_floor(start[0]), fast_floor(start[1]), fast_floor(start[2])};
+    int32 step[3];
+    float32 t_max[3];
+    float32 t_delta[3];
+    for (int32 i = 0; i < 3; i++) {
+        if (direction[i] > 0.0f) {
+            step[i] = 1;
+            t_delta[i] = 1.0f / direction[i];
+            t_max[i] = ((float32)(cell[i] + 1) - start[i]) * t_delta[i];
+        } else if (direction[i] < 0.0f) {
+            step[i] = -1;
+            t_delta[i] = -1.0f / direction[i];
+            t_max[i] = (start[i] - (float32)cell[i]) * t_delta[i];
+        } else {
+            step[i] = 0;
+            t_delta[i] = INFINITY;
+            t_max[i] = INFINITY;
+        }
+    }
+
+    // Visits the cells along the ray in order, stepping on the axis whose next cell boundary is closest
+    int32 axis = -1;
+    float32 t = 0.0f;
+    while (true) {
+        const uint8 block = accessor.get(cell[0], cell[1], cell[2]);
+        if (block > 0) {
+            hit.block = block;
+            hit.b_pos = block_coords_to_block_pos(cell[0], cell[1], cell[2]);
+            hit.normal = {};
+            hit.front_b_pos = hit.b_pos;
+            if (axis >= 0) {
+                hit.normal[axis] = (float32)-step[axis];
+                cell[axis] -= step[axis];
+                hit.front_b_pos = block_coords_to_block_pos(cell[0], cell[1], cell[2]);
+            }
+            hit.distance = t;
+            return block;
+        }
+
+        axis = t_max[0] < t_max[1] ? (t_max[0] < t_max[2] ? 0 : 2) : (t_max[1] < t_max[2] ? 1 : 2);
+        t = t_max[axis];
+        if (t > max_dist) {
+            break;
+        }
+        cell[axis] += step[axis];
+        t_max[axis] += t_delta[axis];
+    }
+
+    hit = {};
+    hit.distance = max_dist;
+    return 0;
+}
+
+uint8 raycast_blocks(ChunkMap &chunk_map, const Vector3f &org, const Vector3f &dir, const float32 max_dist, RayHit &hit) {
+    BlockAccessor accessor(&chunk_map);
+    return cast_ray(accessor, org, dir, max_dist, hit);
+}
+
+uint32 raycast_blocks(ChunkMap &chunk_map, const Vector3f *orgs, const Vector3f *dirs, const uint32 count, const float32 max_dist, RayHit *hits) {
+    // Nearby rays mostly walk through the same chunks, so the chunk cache is shared across the batch
+    BlockAccessor accessor(&chunk_map);
+    uint32 hit_count = 0;
+    for (uint32 i = 0; i < count; i++) {
+        hit_count += cast_ray(accessor, orgs[i], dirs[i], max_dist, hits[i]) > 0;
+    }
+    return hit_count;
+}
+
+uint8 find_block_in_front(ChunkMap &chunk_map, const Vector3f org, const Vector3f dir, BlockPos &b_pos_result, BlockPos &front_b_pos_result) {
+    constexpr float32 MAX_DIST = 5.0f * Config::Player::HEIGHT;
+
+    RayHit hit;
+    if (raycast_blocks(chunk_map, org, dir, MAX_DIST, hit) == 0 || (hit.normal.x == 0.0f && hit.normal.y == 0.0f && hit.normal.z == 0.0f)) {
+        // Nothing in reach, or the ray starts inside a block and has no face to select
+        return 0;
+    }
+    b_pos_result = hit.b_pos;
+    front_b_pos_result = hit.front_b_pos;
+    return hit.block;
+}
+
+#ifdef DEBUG
+// The previous fixed step ray march, kept to check the grid traversal against
+uint8 find_block_in_front_marching(ChunkMap &chunk_map, Vector3f org, const Vector3f dir, BlockPos &b_pos_result, BlockPos &front_b_pos_result) {
     constexpr float32 MAX_DIST = 5.0f * Config::Player::HEIGHT;
 
     float32 dist = 0;
@@ -142,4 +320,5 @@ uint8 find_block_in_front(ChunkMap &chunk_map, Vector3f org, const Vector3f dir,
         dist += INTERVAL;
     }
     return 0;
-}
\ No newline at end of file
+}
+#endif
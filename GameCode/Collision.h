@@ -7,6 +7,19 @@ struct AABB;
 struct Vector3f;
 struct BlockPos;
 
+struct RayHit {
+    uint8 block = 0;
+    BlockPos b_pos;
+    BlockPos front_b_pos;  // Block on the hit face side, where a new block would go
+    Vector3f normal = {};  // Normal of the hit face, zero if the ray starts inside the block
+    float32 distance = 0;  // Along the ray in units of dir, max_dist if nothing was hit
+};
+
 float32 detect_collision(ChunkMap &chunk_map, const AABB &box, Vector3f movement, Vector3f &cc_normal, BlockPos &cc_bpos);
 bool handle_collision(Player &player, ChunkMap &chunk_map, Vector3f &new_pos);
-uint8 find_block_in_front(ChunkMap &chunk_map, Vector3f org, Vector3f dir, BlockPos &b_pos_result, BlockPos &front_b_pos_result);
\ No newline at end of file
+uint8 find_block_in_front(ChunkMap &chunk_map, Vector3f org, Vector3f dir, BlockPos &b_pos_result, BlockPos &front_b_pos_result);
+uint8 raycast_blocks(ChunkMap &chunk_map, const Vector3f &org, const Vector3f &dir, float32 max_dist, RayHit &hit);
+uint32 raycast_blocks(ChunkMap &chunk_map, const Vector3f *orgs, const Vector3f *dirs, uint32 count, float32 max_dist, RayHit *hits);
+#ifdef DEBUG
+uint8 find_block_in_front_marching(ChunkMap &chunk_map, Vector3f org, Vector3f dir, BlockPos &b_pos_result, BlockPos &front_b_pos_result);
+#endif
@@ -5,11 +5,24 @@ namespace Config {
 
 struct World {
     static constexpr int32 CHUNK_SIZE = 32;
-    static constexpr int32 DRAW_RADIUS = 10;
+    static constexpr int32 CHUNK_SIZE_SHIFT = 5;  // log2(CHUNK_SIZE), for converting block coordinates to chunk coordinates
+    static constexpr int32 DRAW_RADIUS = 14;  // Chunks past LOD_DISTANCES are drawn at the coarsest level, which is what makes this affordable
     static constexpr float32 BLOCK_BREAK_COOLDOWN = 0.3f;
     static constexpr float32 BLOCK_PLACE_COOLDOWN = 0.3f;
     static constexpr float32 SUN_DISTANCE = 64.f;
     static constexpr float32 SUN_SPEED = 0.01f;
+
+    // LOD levels are 1x, 2x, 4x and 8x downsampled meshes, switched at these distances (in chunks)
+    static constexpr int32 LOD_LEVEL_COUNT = 4;
+    static constexpr float32 LOD_DISTANCES[LOD_LEVEL_COUNT - 1] = {4.0f, 6.0f, 8.0f};
+    static constexpr float32 LOD_HYSTERESIS = 0.5f;
+    static constexpr uint32 LOD_REMESH_BUDGET = 8;  // LOD switches per frame
+    // Chunks are meshed in sections of SECTION_SIZE^3 blocks, so edits only remesh the sections they touch
+    static constexpr int32 SECTION_SIZE = 16;
+    static constexpr int32 SECTIONS_PER_AXIS = CHUNK_SIZE / SECTION_SIZE;
+    static constexpr int32 SECTION_COUNT = SECTIONS_PER_AXIS * SECTIONS_PER_AXIS * SECTIONS_PER_AXIS;
+    static constexpr uint64 MESH_WAIT_FRAMES = 30;  // Dirty chunks wait this long for their neighbors to be filled before meshing anyway
+    static constexpr uint32 CHUNK_FILLS_PER_FRAME = 4;
 };
 
 struct Graphics {
@@ -19,11 +32,36 @@ struct Graphics {
     static constexpr float32 CULLING_DISTANCE = (World::DRAW_RADIUS + 1) * World::CHUNK_SIZE;
 
     // CSM
-    static constexpr int32 SHADOW_MAP_WIDTH = 4096;
-    static constexpr int32 SHADOW_MAP_HEIGHT = 4096;
     static constexpr int32 SHADOW_MAP_CASCADE_COUNT = 3;
+    // Shadow quality presets, cycled at runtime: the resolution of each cascade and the bits of the depth format (16, 24 or 32)
+    static constexpr int32 SHADOW_QUALITY_COUNT = 3;
+    static constexpr int32 SHADOW_QUALITY_RESOLUTIONS[SHADOW_QUALITY_COUNT][SHADOW_MAP_CASCADE_COUNT] = {
+        {4096, 4096, 4096}, {2048, 2048, 2048}, {2048, 1024, 1024}};
+    static constexpr int32 SHADOW_QUALITY_DEPTH_BITS[SHADOW_QUALITY_COUNT] = {32, 24, 16};
     static constexpr float32 SHADOW_NEAR_PLANE = 1.0f;
-    static constexpr float32 SHADOW_FAR_PLANE = CULLING_DISTANCE;
+    static constexpr float32 SHADOW_FAR_PLANE = 11 * World::CHUNK_SIZE;  // Covers the finer LOD levels, the coarsest ones cast no shadows worth the texels
+    // Cached cascades cover a sphere this much larger than their slice, and are re-rendered when the player drifts half of it
+    static constexpr float32 SHADOW_CACHE_MARGIN = 0.2f;
+    // The sun may turn until the shadow of a caster this high above its receiver moves by a texel before a cascade is re-rendered
+    static constexpr float32 SHADOW_CACHE_CASTER_HEIGHT = 64.0f;
+
+    // Dynamic resolution: the scene is rendered at a scale of the screen that keeps the smoothed GPU frame time under the target
+    static constexpr float32 DYNAMIC_RES_GPU_SHARE = 0.85f;  // Part of the frame time of the frame rate mode that the GPU passes may take
+    static constexpr float32 DYNAMIC_RES_MIN_SCALE = 0.5f;
+    static constexpr float32 DYNAMIC_RES_MAX_SCALE = 1.0f;
+    static constexpr float32 DYNAMIC_RES_SMOOTHING = 0.1f;  // Weight of the newest frame time in the moving average
+    static constexpr float32 DYNAMIC_RES_HEADROOM = 0.8f;   // The scale grows only while the frame time is under this part of the target
+    static constexpr float32 DYNAMIC_RES_STEP_UP = 0.05f;
+    static constexpr uint32 DYNAMIC_RES_HOLD_FRAMES = 30;  // Frames the scale is kept after a change, so it does not oscillate
+
+    // Screenshots and image sequences are read back through a ring of pixel buffers and written to disk on a worker thread
+    static constexpr uint32 CAPTURE_PBO_COUNT = 3;           // Readbacks in flight, the oldest is mapped when the GPU has finished it
+    static constexpr uint32 CAPTURE_QUEUE_LENGTH = 4;        // Frames waiting for the worker thread
+    static constexpr uint32 CAPTURE_SEQUENCE_INTERVAL = 10;  // Every Nth frame is recorded while an image sequence is captured
+
+    // Frames submitted before the CPU waits for the GPU to finish the oldest of them, the low latency mode allows one
+    static constexpr uint32 MAX_FRAMES_IN_FLIGHT = 2;
+    static constexpr int32 LATE_LOOK_EVENT_LIMIT = 64;  // Mouse motion events looked at before the main pass in the low latency mode
 };
 
 struct Physics {
@@ -32,6 +70,9 @@ struct Physics {
     static constexpr float32 FRICTION_MULTIPLIER = 5.0f;
     static constexpr float32 FRICTION_CONSTANT = 30.0f;
     static constexpr float32 ACCELERATION_CONSTANT = 100.0f;
+    static constexpr float32 ENTITY_SHATTER_SPEED = 20.0f;  // Thrown blocks break when they hit something faster than this
+    static constexpr float32 ENTITY_RESTITUTION = 0.3f;
+    static constexpr float32 ENTITY_LIFETIME = 12.0f;
 };
 
 struct Player {
@@ -44,12 +85,37 @@ struct Player {
 
 struct Game {
     static constexpr uint32 STAR_COUNT = 64 * 1024;
-    static constexpr uint32 PARTICLE_LIMIT = 128;
-    static constexpr uint32 ENTITY_LIMIT = 128;
+    static constexpr uint32 PARTICLE_LIMIT = 64 * 1024;
+    static constexpr uint32 ENTITY_LIMIT = 4096;
+    static constexpr uint32 INSTANCE_LIMIT = PARTICLE_LIMIT + ENTITY_LIMIT + 1;  // Particles, entities and the held block
     static constexpr float32 TARGET_FPS = 60.f;
+    static constexpr float32 SIMULATION_STEP = 1.0f / 60.0f;  // Seconds of simulated time per update
+    static constexpr uint32 MAX_SIMULATION_STEPS = 4;         // Per frame, the time behind that is dropped
 };
 
 struct System {
     static constexpr uint32 MAX_CONTROLLERS = 4;
+
+    // Frame pacing: the OS sleep wakes up this early (the slack) before the frame deadline and the rest is spun
+    static constexpr float64 FRAME_PACING_MIN_SLACK = 0.0002;
+    static constexpr float64 FRAME_PACING_SLACK_MARGIN = 2.0;   // The slack decays towards this multiple of the latest sleep overshoot
+    static constexpr float64 FRAME_PACING_SLACK_DECAY = 0.02;   // Weight of the newest overshoot in the decay
+    static constexpr uint32 FRAME_PACING_STATS_FRAMES = 600;    // Frame intervals in the logged jitter percentiles
+
+    // Profiler: one ring of timing events per thread (and one for the GPU passes), emptied every frame
+    static constexpr uint32 PROFILER_MAX_TRACKS = 4;
+    static constexpr uint32 PROFILER_RING_EVENTS = 64 * 1024;  // Power of two, events beyond it in a frame are dropped
+
+    // Hitch monitor: a frame over the budget gets the frames around it saved as a trace
+    // Budget of --hitch-budget on. The monitor is off by default: it keeps every scope recording, and its history takes 36 MB.
+    static constexpr float32 HITCH_BUDGET_MS = 50.0f;
+    static constexpr uint32 HITCH_HISTORY_FRAMES = 64;            // Power of two
+    static constexpr uint32 HITCH_FRAME_EVENTS = Game::ENTITY_LIMIT * Game::MAX_SIMULATION_STEPS + 1024;  // A collision test per entity and step
+    static constexpr uint32 HITCH_HISTORY_EVENTS = 1024 * 1024;   // Power of two, allocated while the monitor is on, the oldest are overwritten
+    static constexpr uint32 HITCH_FRAMES_BEFORE = 30;
+    static constexpr uint32 HITCH_FRAMES_AFTER = 10;
+    static constexpr uint32 HITCH_TRACE_LIMIT = 16;               // Traces saved per run
+    static constexpr uint32 FRAME_HISTOGRAM_BUCKETS = 400;
+    static constexpr float32 FRAME_HISTOGRAM_BUCKET_MS = 0.25f;  // Slower frames than the last bucket only count towards the max
 };
 }  // namespace Config
\ No newline at end of file
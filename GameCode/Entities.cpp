@@ -0,0 +1,197 @@
+#include "Entities.h"
+
+#include <string.h>
+
+#include "AABB.h"
+#include "Utility.h"
+
+EntityHandle EntityStore::create() {
+    if (count >= CAPACITY) {
+        return {};
+    }
+
+    uint32 new_slot;
+    if (free_slot_count > 0) {
+        new_slot = free_slots[--free_slot_count];
+    } else {
+        new_slot = used_slot_count++;
+    }
+    slot_generation[new_slot]++;
+    slot_index[new_slot] = count;
+
+    const uint32 i = count++;
+    pos[i] = {};
+    speed[i] = {};
+    rotation[i] = {1.0f, 0.0f, 0.0f, 0.0f};
+    prev_pos[i] = {};
+    prev_rotation[i] = rotation[i];
+    rot_speed[i] = {};
+    age[i] = 0;
+    color[i] = {};
+    bound_offset[i] = {};
+    flags[i] = 0;
+    slot[i] = new_slot;
+    return {new_slot, slot_generation[new_slot]};
+}
+
+void EntityStore::remove_dead() {
+    for (uint32 i = 0; i < count;) {
+        if (!(flags[i] & ENTITY_DEAD)) {
+            i++;
+            continue;
+        }
+
+        // Bumping the generation invalidates the handles to this entity
+        slot_generation[slot[i]]++;
+        free_slots[free_slot_count++] = slot[i];
+
+        const uint32 last = count - 1;
+        pos[i] = pos[last];
+        speed[i] = speed[last];
+        rotation[i] = rotation[last];
+        prev_pos[i] = prev_pos[last];
+        prev_rotation[i] = prev_rotation[last];
+        rot_speed[i] = rot_speed[last];
+        age[i] = age[last];
+        color[i] = color[last];
+        bound_offset[i] = bound_offset[last];
+        flags[i] = flags[last];
+        slot[i] = slot[last];
+        slot_index[slot[i]] = i;
+        count--;
+    }
+}
+
+int32 EntityStore::get_index(const EntityHandle handle) const {
+    if (handle.generation == 0 || handle.slot >= used_slot_count || slot_generation[handle.slot] != handle.generation) {
+        return -1;
+    }
+    return (int32)slot_index[handle.slot];
+}
+
+AABB EntityStore::get_box(const uint32 index) const { return get_cube_box(pos[index], 1.0f); }
+
+inline uint32 get_cell_bucket(const int32 x, const int32 y, const int32 z) {
+    return (((uint32)x * 73856093u) ^ ((uint32)y * 19349663u) ^ ((uint32)z * 83492791u)) & (EntityGrid::BUCKET_COUNT - 1);
+}
+
+// Cells that the center of an entity passes through in the step, if it moves no further than a step at its current speed
+struct CellRange {
+    int32 start_x, start_y, start_z;
+    int32 end_x, end_y, end_z;
+};
+
+inline CellRange get_swept_cells(const EntityStore &store, const uint32 i, const float32 time_delta) {
+    constexpr float32 INV_CELL_SIZE = 1.0f / EntityGrid::CELL_SIZE;
+    const Vector3f start = store.pos[i];
+    const Vector3f end = store.flags[i] & ENTITY_SLEEPING ? start : start + store.speed[i] * time_delta;
+    return {fast_floor(MIN(start.x, end.x) * INV_CELL_SIZE), fast_floor(MIN(start.y, end.y) * INV_CELL_SIZE),
+            fast_floor(MIN(start.z, end.z) * INV_CELL_SIZE), fast_floor(MAX(start.x, end.x) * INV_CELL_SIZE),
+            fast_floor(MAX(start.y, end.y) * INV_CELL_SIZE), fast_floor(MAX(start.z, end.z) * INV_CELL_SIZE)};
+}
+
+inline bool is_fast(const CellRange &cells) {
+    return cells.end_x - cells.start_x >= EntityGrid::MAX_CELL_SPAN || cells.end_y - cells.start_y >= EntityGrid::MAX_CELL_SPAN ||
+           cells.end_z - cells.start_z >= EntityGrid::MAX_CELL_SPAN;
+}
+
+void EntityGrid::build(const EntityStore &store, const float32 time_delta) {
+    // Counting sort of the entities into buckets. After the prefix sum, bucket_start holds the end of each bucket,
+    // and filling backwards leaves it at the start. A bucket gets an entity once per cell, which queries tolerate.
+    memset(bucket_start, 0, sizeof(bucket_start));
+    memset(is_loose, 0, sizeof(is_loose));
+    loose_count = 0;
+    for (uint32 i = 0; i < store.count; i++) {
+        if (store.flags[i] & (ENTITY_BOUND | ENTITY_DEAD)) {
+            continue;
+        }
+        const CellRange cells = get_swept_cells(store, i, time_delta);
+        if (is_fast(cells)) {
+            loosen(i);
+            continue;
+        }
+        for (int32 x = cells.start_x; x <= cells.end_x; x++) {
+            for (int32 y = cells.start_y; y <= cells.end_y; y++) {
+                for (int32 z = cells.start_z; z <= cells.end_z; z++) {
+                    bucket_start[get_cell_bucket(x, y, z)]++;
+                }
+            }
+        }
+    }
+    uint32 total = 0;
+    for (uint32 b = 0; b < BUCKET_COUNT; b++) {
+        total += bucket_start[b];
+        bucket_start[b] = total;
+    }
+    bucket_start[BUCKET_COUNT] = total;
+    for (uint32 i = 0; i < store.count; i++) {
+        if (store.flags[i] & (ENTITY_BOUND | ENTITY_DEAD) || is_loose[i]) {
+            continue;
+        }
+        const CellRange cells = get_swept_cells(store, i, time_delta);
+        for (int32 x = cells.start_x; x <= cells.end_x; x++) {
+            for (int32 y = cells.start_y; y <= cells.end_y; y++) {
+                for (int32 z = cells.start_z; z <= cells.end_z; z++) {
+                    entries[--bucket_start[get_cell_bucket(x, y, z)]] = i;
+                }
+            }
+        }
+    }
+}
+
+void EntityGrid::loosen(const uint32 index) {
+    if (!is_loose[index]) {
+        is_loose[index] = true;
+        loose_entities[loose_count++] = index;
+    }
+}
+
+// Returns the candidate count, which is more than max_results when only the first max_results fit in the result
+uint32 EntityGrid::query(const AABB &box, uint32 *result, const uint32 max_results) const {
+    // Entities are bucketed by their center, so the box is grown by half an entity
+    constexpr float32 INV_CELL_SIZE = 1.0f / CELL_SIZE;
+    const int32 start_x = fast_floor((box.min.x - 0.5f) * INV_CELL_SIZE);
+    const int32 start_y = fast_floor((box.min.y - 0.5f) * INV_CELL_SIZE);
+    const int32 start_z = fast_floor((box.min.z - 0.5f) * INV_CELL_SIZE);
+    const int32 end_x = fast_floor((box.max.x + 0.5f) * INV_CELL_SIZE);
+    const int32 end_y = fast_floor((box.max.y + 0.5f) * INV_CELL_SIZE);
+    const int32 end_z = fast_floor((box.max.z + 0.5f) * INV_CELL_SIZE);
+
+    // Different cells can hash to the same bucket, so visited buckets are skipped (as long as they fit in the list)
+    constexpr uint32 VISITED_LIMIT = 64;
+    uint32 visited[VISITED_LIMIT];
+    uint32 visited_count = 0;
+
+    uint32 result_count = 0;
+    for (int32 x = start_x; x <= end_x; x++) {
+        for (int32 y = start_y; y <= end_y; y++) {
+            for (int32 z = start_z; z <= end_z; z++) {
+                const uint32 bucket = get_cell_bucket(x, y, z);
+                bool is_visited = false;
+                for (uint32 v = 0; v < visited_count && !is_visited; v++) {
+                    is_visited = visited[v] == bucket;
+                }
+                if (is_visited) {
+                    continue;
+                }
+                if (visited_count < VISITED_LIMIT) {
+                    visited[visited_count++] = bucket;
+                }
+
+                for (uint32 e = bucket_start[bucket]; e < bucket_start[bucket + 1]; e++) {
+                    if (result_count < max_results) {
+                        result[result_count] = entries[e];
+                    }
+                    result_count++;
+                }
+            }
+        }
+    }
+    for (uint32 l = 0; l < loose_count; l++) {
+        if (result_count < max_results) {
+            result[result_count] = loose_entities[l];
+        }
+        result_count++;
+    }
+    return result_count;
+}
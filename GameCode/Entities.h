@@ -0,0 +1,74 @@
+#pragma once
+#include <glm/gtc/quaternion.hpp>
+
+#include "Config.h"
+#include "Definitions.h"
+#include "Geometry.h"
+
+struct AABB;
+
+// Refers to an entity across frames. Entities move around in the dense arrays when others are removed,
+// so the handle goes through a slot, and the slot generation detects handles to removed entities.
+struct EntityHandle {
+    uint32 slot = 0;
+    uint32 generation = 0;  // Live slots have a generation of at least 1, so a default handle is null
+};
+
+enum EntityFlags : uint8 {
+    ENTITY_BOUND = 1 << 0,     // Held by the player
+    ENTITY_SLEEPING = 1 << 1,  // At rest, skips integration and collision until its support is gone or it is hit
+    ENTITY_DEAD = 1 << 2,      // Removed at the end of the update
+};
+
+// Block entities stored as dense component arrays, with generational handles on top
+struct EntityStore {
+    static constexpr uint32 CAPACITY = Config::Game::ENTITY_LIMIT;
+
+    EntityHandle create();
+    void remove_dead();
+    int32 get_index(EntityHandle handle) const;
+    EntityHandle get_handle(uint32 index) const { return {slot[index], slot_generation[slot[index]]}; }
+    AABB get_box(uint32 index) const;
+
+    uint32 count = 0;
+    Vector3f pos[CAPACITY];
+    Vector3f speed[CAPACITY];
+    glm::quat rotation[CAPACITY];
+    Vector3f prev_pos[CAPACITY];  // Transform before the latest simulation step, for interpolation
+    glm::quat prev_rotation[CAPACITY];
+    Vector2f rot_speed[CAPACITY];
+    float32 age[CAPACITY];
+    Vector3f color[CAPACITY];
+    Vector3f bound_offset[CAPACITY];
+    uint8 flags[CAPACITY];
+    uint32 slot[CAPACITY];  // Slot of each entity
+
+    uint32 slot_index[CAPACITY];  // Dense index of the entity in each slot
+    uint32 slot_generation[CAPACITY];
+    uint32 free_slots[CAPACITY];
+    uint32 free_slot_count = 0;
+    uint32 used_slot_count = 0;  // Slots below this have been handed out at least once
+};
+
+// Uniform grid broadphase for entity-entity queries. Entities move during the update after the grid is built, so each one is bucketed
+// in every cell its center passes through in the step, with a counting sort. Cells are hashed into a fixed bucket count, so queries
+// return a superset that the caller narrows down with exact tests.
+struct EntityGrid {
+    static constexpr float32 CELL_SIZE = 2.0f;
+    static constexpr uint32 BUCKET_COUNT = 2 * EntityStore::CAPACITY;
+    static_assert((BUCKET_COUNT & (BUCKET_COUNT - 1)) == 0, "Bucket count must be a power of 2");
+    static constexpr int32 MAX_CELL_SPAN = 3;  // Cells along an axis that an entity is bucketed in, faster entities are loose
+    static constexpr uint32 ENTRY_CAPACITY = EntityStore::CAPACITY * MAX_CELL_SPAN * MAX_CELL_SPAN * MAX_CELL_SPAN;
+    static constexpr uint32 QUERY_LIMIT = 64;  // Result count that callers make room for
+
+    void build(const EntityStore &store, float32 time_delta);
+    void loosen(uint32 index);
+    uint32 query(const AABB &box, uint32 *result, uint32 max_results) const;
+
+    uint32 bucket_start[BUCKET_COUNT + 1];
+    uint32 entries[ENTRY_CAPACITY];
+    // Entities that every query returns: the ones too fast to bucket, and the ones whose speed changed after the build
+    uint32 loose_entities[EntityStore::CAPACITY];
+    uint32 loose_count = 0;
+    bool is_loose[EntityStore::CAPACITY];
+};
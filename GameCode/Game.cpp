@@ -3,11 +3,14 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "AABB.h"
+#include "Capture.h"
 #include "Chunk.h"
 #include "GameBase.h"
 #include "Play.h"
 #include "Graphics.h"
+#include "Profiler.h"
 #include "Save.h"
+#include "Simulation.h"
 #include "Sound.h"
 
 extern "C" dll_export void initialize(const GameMemory *memory, const std::filesystem::path &save_path) {
@@ -22,18 +25,36 @@ extern "C" dll_export void initialize(const GameMemory *memory, const std::files
         const std::filesystem::path save_dir = state->save_path / state->world_name;
         std::filesystem::create_directory(save_dir);
     }
+    state->simulation.player_prev_pos = state->player.pos;
 
-    Graphics::initialize(state);
+    Graphics::initialize(state, memory->settings);
+    Capture::initialize(state->save_path);
+    Profiler::initialize(state->save_path, memory->settings.hitch_budget_ms);
+    Simulation::initialize(state);
     Sound::initialize();
     //Sound::play(Sound::bgm);
 }
 
+// Stops the threads running game code before the DLL is unloaded
+extern "C" dll_export void prepare_reload(const GameMemory *) {
+    Simulation::finalize();
+    Profiler::finalize();
+    Capture::finalize();
+}
+
 extern "C" dll_export void reload_init(const GameMemory *memory) {
     // Reinitialize graphics on DLL hot reload
-    Graphics::initialize((GameState *)memory->permanent_storage);
+    auto *state = (GameState *)memory->permanent_storage;
+    Graphics::initialize(state, memory->settings);
+    Capture::initialize(state->save_path);
+    Profiler::initialize(state->save_path, memory->settings.hitch_budget_ms);
+    Simulation::initialize(state);
 }
 
 extern "C" dll_export void finalize(const GameMemory *memory) {
+    Simulation::finalize();
+    Profiler::finalize();
+    Capture::finalize();
     const auto *state = (GameState *)memory->permanent_storage;
     state->chunk_map.save();
     save_state(state);
@@ -43,14 +64,25 @@ extern "C" dll_export void game_loop(const GameMemory *memory, const SDL_Surface
                                      float32 time_delta) {
     static ControllerInput last_controller;
     auto *state = (GameState *)memory->permanent_storage;
+    Profiler::collect_events();
+    PROFILE_SCOPE("Frame");
 
     const int32 screen_width = screen_surface->w;
     const int32 screen_height = screen_surface->h;
-    BlockPos b_pos_pointing;
-    uint8 block_pointing;
 
-    Play::update(state, time_delta, controller, &last_controller, b_pos_pointing, block_pointing, screen_width, screen_height);
-    Graphics::draw(state, screen_width, screen_height, window, block_pointing, b_pos_pointing, time_delta);
+    Play::handle_input(state, time_delta, controller, &last_controller);
+
+    // The simulation of this frame runs while the snapshot of the previous one is drawn. The look was handled on this thread just now,
+    // so the camera turns with this frame's input.
+    RenderSnapshot snapshot = Simulation::get_render_snapshot();
+    snapshot.camera_direction = state->player.direction;
+    snapshot.yaw = state->player.yaw;
+    snapshot.fov = state->player.fov;
+    snapshot.selected_block = state->player.selected_block;
+    Graphics::prepare_frame(state, snapshot, screen_width, screen_height);
+    Simulation::start_frame(*controller, time_delta);
+    Graphics::draw(state, snapshot, screen_width, screen_height, window, time_delta, controller->input_time);
+    Simulation::finish_frame();
 
     last_controller = *controller;
     state->frame_count++;
@@ -280,6 +280,16 @@ inline float32 sqr_dist(const Vector3f a, const Vector3f b) { return (a - b).get
 
 inline float32 dist(const Vector3f a, const Vector3f b) { return (a - b).get_magnitude(); }
 
+// Direction the camera looks at, from its angles in degrees
+inline Vector3f get_look_direction(const float32 pitch, const float32 yaw) {
+    Vector3f direction;
+    direction.x = cos(glm::radians(pitch)) * cos(glm::radians(yaw));
+    direction.y = sin(glm::radians(pitch));
+    direction.z = cos(glm::radians(pitch)) * sin(glm::radians(yaw));
+    direction.normalize();
+    return direction;
+}
+
 inline bool test_ray_aabb_intersect(Vector3f ray_dir, const Vector3f ray_org, const Vector3f bottom_left, const Vector3f top_right, float32 &t) {
     // Protection against division by 0
     if (ray_dir.x == 0.f) {
@@ -1,31 +1,114 @@
 #include "Graphics.h"
 
 #include <glad/glad.h>
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <stb/stb_image_write.h>
+#include <SDL_events.h>
+#include <SDL_timer.h>
 
 #include <glm/gtc/type_ptr.hpp>
 
+#include "AABB.h"
+#include "Capture.h"
 #include "Chunk.h"
 #include "Geometry.h"
+#include "Profiler.h"
 #include "Shader.h"
 #include "ShadowDebugVisuals.h"
+#include "Simulation.h"
 
 namespace Graphics {
 static MainShader main_shader;
+static MainShader instanced_shader;
 static StarShader star_shader;
 static Shader gui_shader;
 static ShadowMapShader shadow_depth_shader;
+static ShadowMapShader instanced_depth_shader;
+static DepthShader depth_prepass_shader;
+static PostProcessShader fxaa_shader;
+
+// Per-instance attributes of the cubes drawn with a single instanced draw call
+struct InstanceData {
+    glm::mat4 model;
+    Vector3f color;
+};
 
 static uint32 vao_cube;
+static uint32 vao_instanced;
+static uint32 vbo_instances;
 static uint32 vao_sun;
 static uint32 vao_stars;
 static uint32 vao_crosshair;
+static uint32 vao_fullscreen;
 static uint32 depth_map_fbo;
-static uint32 depth_maps[Config::Graphics::SHADOW_MAP_CASCADE_COUNT];
+static uint32 depth_map_array;  // One layer per cascade
 
 static ShadowMode shadow_mode = ShadowMode::SHADOW_MAP;
+static bool depth_prepass_enabled = false;
+static AntiAliasing anti_aliasing;
+static int32 msaa_samples;
+static ShadowSettings shadow_settings;
+static int32 shadow_quality = 0;  // Preset in Config::Graphics::SHADOW_QUALITY_*
+static int32 shadow_map_size;     // Side of the depth map layers
+static float32 shadow_bias;
+
+// Cascade depth maps are kept across frames and only re-rendered when they are out of date, see select_shadow_cascades
+struct ShadowCascade {
+    bool valid = false;
+    bool casters_changed = false;  // Meshes or entities in range changed since it was rendered
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec3 sun_dir;
+    Vector3f center;     // Player position it was rendered around
+    float32 radius = 0;  // Radius of the covered sphere, with the margin
+    uint64 entity_hash = 0;
+};
+static ShadowCascade shadow_cascades[Config::Graphics::SHADOW_MAP_CASCADE_COUNT];
+static uint32 next_far_cascade = 1;
+
+// The scene is drawn into an offscreen target and presented through the post-process of the anti aliasing mode.
+// Multi-sampled targets are resolved with a blit, and FXAA runs a full-screen pass over a color texture.
+// With dynamic resolution, only the lower left render_width x render_height part of the target is drawn and it is
+// stretched over the screen.
+struct SceneTarget {
+    uint32 fbo = 0;
+    uint32 color = 0;  // Texture, or renderbuffer when multi-sampled
+    uint32 depth = 0;  // Renderbuffer
+    uint32 resolve_fbo = 0;  // Single-sampled copy of a multi-sampled target, to be stretched from
+    uint32 resolve_color = 0;
+    int32 width = 0;
+    int32 height = 0;
+    int32 render_width = 0;
+    int32 render_height = 0;
+};
+static SceneTarget scene_target;
+static bool dynamic_resolution;
+static float32 resolution_scale;
+static float32 resolution_target_ms;
+static float32 smoothed_frame_ms;
+static uint32 resolution_hold_frames;
+
+// GPU time of the passes is measured with timestamp queries. The queries of a frame are read GPU_TIMER_FRAMES frames later,
+// so the CPU does not wait for the GPU to finish them.
+enum GpuTimestamp {
+    TIMESTAMP_FRAME_START,
+    TIMESTAMP_SHADOWS_START,
+    TIMESTAMP_SHADOWS_END,
+    TIMESTAMP_SCENE_START,
+    TIMESTAMP_DEPTH_PREPASS_END,
+    TIMESTAMP_INSTANCES_END,
+    TIMESTAMP_CHUNKS_END,
+    TIMESTAMP_PRESENT_START,
+    TIMESTAMP_FRAME_END,
+    TIMESTAMP_COUNT
+};
+static constexpr uint32 GPU_TIMER_FRAMES = 4;
+static uint32 timestamp_queries[GPU_TIMER_FRAMES][TIMESTAMP_COUNT];
+static uint32 timer_frame;
+
+// Fences of the last submitted frames, limiting how far the CPU gets ahead of the GPU
+static bool low_latency;
+static uint32 frames_in_flight;
+static GLsync frame_fences[Config::Graphics::MAX_FRAMES_IN_FLIGHT];
+static uint32 frame_fence_index;
 
 void initialize_cube_graphics() {
     constexpr uint32 CUBE_VERTEX_COUNT = 216;
@@ -46,6 +129,28 @@ void initialize_cube_graphics() {
     glBindBuffer(GL_ARRAY_BUFFER, vbo_cube);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float32), (void *)nullptr);
     glEnableVertexAttribArray(0);
+
+    // vao instanced uses the same vbo as cube for vertices and a streaming buffer for instance transforms and colors
+    glGenVertexArrays(1, &vao_instanced);
+    glBindVertexArray(vao_instanced);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_cube);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float32), (void *)nullptr);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float32), (void *)(3 * sizeof(float32)));
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+
+    glGenBuffers(1, &vbo_instances);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_instances);
+    glBufferData(GL_ARRAY_BUFFER, Config::Game::INSTANCE_LIMIT * sizeof(InstanceData), nullptr, GL_STREAM_DRAW);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void *)offsetof(InstanceData, color));
+    glEnableVertexAttribArray(2);
+    glVertexAttribDivisor(2, 1);
+    for (uint32 column = 0; column < 4; column++) {
+        const uint32 location = 4 + column;
+        glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void *)(offsetof(InstanceData, model) + column * sizeof(glm::vec4)));
+        glEnableVertexAttribArray(location);
+        glVertexAttribDivisor(location, 1);
+    }
 }
 
 void initialize_star_graphics(const Vector3f *stars) {
@@ -94,25 +199,51 @@ void initialize_hud() {
     }
 }
 
-void initialize_shadow_maps() {
+// Reallocates the depth map array for the current shadow settings. Its layers are as large as the largest cascade,
+// and smaller cascades render into the lower left corner of theirs.
+void allocate_shadow_maps() {
     constexpr float32 BORDER_COLOR[] = {1.0f, 1.0f, 1.0f, 1.0f};
-    glGenFramebuffers(1, &depth_map_fbo);
+    for (ShadowCascade &cascade : shadow_cascades) {
+        cascade.valid = false;
+    }
+    shadow_map_size = 0;
+    for (const int32 resolution : shadow_settings.resolutions) {
+        shadow_map_size = MAX(shadow_map_size, resolution);
+    }
 
-    glGenTextures(Config::Graphics::SHADOW_MAP_CASCADE_COUNT, depth_maps);
-    for (const uint32 depth_map : depth_maps) {
-        glBindTexture(GL_TEXTURE_2D, depth_map);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32, Config::Graphics::SHADOW_MAP_WIDTH, Config::Graphics::SHADOW_MAP_HEIGHT, 0, GL_DEPTH_COMPONENT,
-                     GL_FLOAT, nullptr);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-        glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, BORDER_COLOR);
+    GLenum internal_format;
+    switch (shadow_settings.depth_bits) {
+        case 16:
+            internal_format = GL_DEPTH_COMPONENT16;
+            break;
+        case 24:
+            internal_format = GL_DEPTH_COMPONENT24;
+            break;
+        default:
+            internal_format = GL_DEPTH_COMPONENT32;
     }
+    // Less precise formats need a bias of at least a couple of depth steps to keep surfaces from shadowing themselves
+    shadow_bias = MAX(0.00001f, ldexpf(1.0f, 1 - shadow_settings.depth_bits));
+
+    if (depth_map_array) {
+        glDeleteTextures(1, &depth_map_array);
+    }
+    glGenTextures(1, &depth_map_array);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, depth_map_array);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, internal_format, shadow_map_size, shadow_map_size, Config::Graphics::SHADOW_MAP_CASCADE_COUNT, 0, GL_DEPTH_COMPONENT,
+                 GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, BORDER_COLOR);
+    // Depth comparison is done by the sampler, and with linear filtering it blends the results of the four nearest texels
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
 
     // Checking status
     glBindFramebuffer(GL_FRAMEBUFFER, depth_map_fbo);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_maps[0], 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth_map_array, 0);
     glDrawBuffer(GL_NONE);
     glReadBuffer(GL_NONE);
     const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
@@ -124,7 +255,275 @@ void initialize_shadow_maps() {
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-void initialize(const GameState *state) {
+ShadowSettings get_shadow_quality_settings(const int32 quality) {
+    ShadowSettings settings;
+    for (int32 i = 0; i < Config::Graphics::SHADOW_MAP_CASCADE_COUNT; i++) {
+        settings.resolutions[i] = Config::Graphics::SHADOW_QUALITY_RESOLUTIONS[quality][i];
+    }
+    settings.depth_bits = Config::Graphics::SHADOW_QUALITY_DEPTH_BITS[quality];
+    return settings;
+}
+
+void initialize_shadow_maps() {
+    glGenFramebuffers(1, &depth_map_fbo);
+    set_shadow_settings(get_shadow_quality_settings(shadow_quality));
+}
+
+void allocate_scene_target(const int32 width, const int32 height) {
+    SceneTarget &target = scene_target;
+    if (target.fbo) {
+        glDeleteFramebuffers(1, &target.fbo);
+        glDeleteRenderbuffers(1, &target.depth);
+        if (anti_aliasing == AntiAliasing::MSAA) {
+            glDeleteRenderbuffers(1, &target.color);
+            glDeleteFramebuffers(1, &target.resolve_fbo);
+            glDeleteRenderbuffers(1, &target.resolve_color);
+        } else {
+            glDeleteTextures(1, &target.color);
+        }
+    }
+    target.width = width;
+    target.height = height;
+
+    glGenFramebuffers(1, &target.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glGenRenderbuffers(1, &target.depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.depth);
+    if (anti_aliasing == AntiAliasing::MSAA) {
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, msaa_samples, GL_DEPTH_COMPONENT24, width, height);
+        glGenRenderbuffers(1, &target.color);
+        glBindRenderbuffer(GL_RENDERBUFFER, target.color);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, msaa_samples, GL_RGBA8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.color);
+
+        glGenFramebuffers(1, &target.resolve_fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, target.resolve_fbo);
+        glGenRenderbuffers(1, &target.resolve_color);
+        glBindRenderbuffer(GL_RENDERBUFFER, target.resolve_color);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.resolve_color);
+        glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    } else {
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glGenTextures(1, &target.color);
+        glBindTexture(GL_TEXTURE_2D, target.color);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.color, 0);
+    }
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depth);
+
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        LogError("Scene FrameBuffer error, status: 0x%x", status);
+    }
+}
+
+// Frame time of the frame rate mode. Uncapped frames have none, so they aim for TARGET_FPS.
+float32 get_frame_budget_ms(const GameSettings &settings) {
+    float32 frame_rate = Config::Game::TARGET_FPS;
+    if (settings.frame_rate_mode == FrameRateMode::CAPPED) {
+        frame_rate = settings.frame_rate_cap;
+    } else if (settings.frame_rate_mode == FrameRateMode::VSYNC) {
+        SDL_DisplayMode display_mode;
+        if (SDL_GetCurrentDisplayMode(0, &display_mode) == 0 && display_mode.refresh_rate > 0) {
+            frame_rate = (float32)display_mode.refresh_rate;
+        }
+    }
+    return 1000.0f / frame_rate;
+}
+
+void initialize_post_process(const GameSettings &settings) {
+    anti_aliasing = settings.anti_aliasing;
+    int32 max_samples;
+    glGetIntegerv(GL_MAX_SAMPLES, &max_samples);
+    msaa_samples = MIN(settings.msaa_samples, max_samples);
+    scene_target = {};
+    dynamic_resolution = settings.dynamic_resolution;
+    resolution_scale = Config::Graphics::DYNAMIC_RES_MAX_SCALE;
+    resolution_target_ms = get_frame_budget_ms(settings) * Config::Graphics::DYNAMIC_RES_GPU_SHARE;
+    smoothed_frame_ms = resolution_target_ms;
+    if (dynamic_resolution) {
+        LogInfo("Dynamic resolution: GPU passes aim for %.1f ms", resolution_target_ms);
+    }
+    resolution_hold_frames = 0;
+
+    // The full-screen triangle is made in the vertex shader, but core profile needs a vertex array bound to draw
+    glGenVertexArrays(1, &vao_fullscreen);
+}
+
+// Draws the scene target to the screen, stretching the rendered part over it
+void present_scene(const int32 screen_width, const int32 screen_height) {
+    const SceneTarget &target = scene_target;
+    glViewport(0, 0, screen_width, screen_height);
+    glDisable(GL_DEPTH_TEST);
+    if (anti_aliasing == AntiAliasing::FXAA) {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        fxaa_shader.use();
+        glUniform1i(fxaa_shader.scene_color_loc, 0);
+        glUniform2f(fxaa_shader.texel_size_loc, 1.0f / (float32)target.width, 1.0f / (float32)target.height);
+        glUniform2f(fxaa_shader.uv_scale_loc, (float32)target.render_width / (float32)target.width, (float32)target.render_height / (float32)target.height);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, target.color);
+        glBindVertexArray(vao_fullscreen);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        return;
+    }
+
+    uint32 source_fbo = target.fbo;
+    const bool is_scaled = target.render_width != screen_width || target.render_height != screen_height;
+    if (anti_aliasing == AntiAliasing::MSAA && is_scaled) {
+        // Multi-sampled buffers can only be resolved without scaling
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target.resolve_fbo);
+        glBlitFramebuffer(0, 0, target.render_width, target.render_height, 0, 0, target.render_width, target.render_height, GL_COLOR_BUFFER_BIT,
+                          GL_NEAREST);
+        source_fbo = target.resolve_fbo;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, source_fbo);
+    glBlitFramebuffer(0, 0, target.render_width, target.render_height, 0, 0, screen_width, screen_height, GL_COLOR_BUFFER_BIT,
+                      is_scaled ? GL_LINEAR : GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Picks the scale of the next frames from the smoothed GPU time of the passes. Pixel cost goes with the area, so an over budget
+// time cuts the scale by the square root of the overshoot, and it grows back in small steps once there is headroom.
+void update_resolution_scale(const float32 gpu_passes_ms) {
+    smoothed_frame_ms += (gpu_passes_ms - smoothed_frame_ms) * Config::Graphics::DYNAMIC_RES_SMOOTHING;
+    if (resolution_hold_frames > 0) {
+        resolution_hold_frames--;
+        return;
+    }
+
+    float32 new_scale = resolution_scale;
+    if (smoothed_frame_ms > resolution_target_ms) {
+        new_scale = resolution_scale * sqrtf(resolution_target_ms / smoothed_frame_ms);
+    } else if (smoothed_frame_ms < resolution_target_ms * Config::Graphics::DYNAMIC_RES_HEADROOM) {
+        new_scale = resolution_scale + Config::Graphics::DYNAMIC_RES_STEP_UP;
+    }
+    new_scale = MAX(Config::Graphics::DYNAMIC_RES_MIN_SCALE, MIN(new_scale, Config::Graphics::DYNAMIC_RES_MAX_SCALE));
+    if (new_scale != resolution_scale) {
+        // The moving average restarts from the expected time at the new scale
+        smoothed_frame_ms *= (new_scale * new_scale) / (resolution_scale * resolution_scale);
+        resolution_scale = new_scale;
+        resolution_hold_frames = Config::Graphics::DYNAMIC_RES_HOLD_FRAMES;
+    }
+}
+
+void initialize_gpu_timers() {
+    glGenQueries(GPU_TIMER_FRAMES * TIMESTAMP_COUNT, &timestamp_queries[0][0]);
+    timer_frame = 0;
+}
+
+inline void write_timestamp(const GpuTimestamp timestamp) { glQueryCounter(timestamp_queries[timer_frame % GPU_TIMER_FRAMES][timestamp], GL_TIMESTAMP); }
+
+// The passes go into the trace on the CPU clock, offset by the difference of the two clocks now
+void record_gpu_passes(const uint64 *times) {
+    int64 gpu_now;
+    glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+    const uint64 cpu_now = SDL_GetPerformanceCounter();
+    const float64 ns_to_ticks = (float64)SDL_GetPerformanceFrequency() / 1000000000.0;
+    uint64 ticks[TIMESTAMP_COUNT];
+    for (uint32 i = 0; i < TIMESTAMP_COUNT; i++) {
+        ticks[i] = cpu_now - (uint64)((float64)(gpu_now - (int64)times[i]) * ns_to_ticks);
+    }
+    Profiler::record_gpu("GPU frame", ticks[TIMESTAMP_FRAME_START], ticks[TIMESTAMP_FRAME_END]);
+    Profiler::record_gpu("GPU shadows", ticks[TIMESTAMP_SHADOWS_START], ticks[TIMESTAMP_SHADOWS_END]);
+    Profiler::record_gpu("GPU depth pre-pass", ticks[TIMESTAMP_SCENE_START], ticks[TIMESTAMP_DEPTH_PREPASS_END]);
+    Profiler::record_gpu("GPU instances", ticks[TIMESTAMP_DEPTH_PREPASS_END], ticks[TIMESTAMP_INSTANCES_END]);
+    Profiler::record_gpu("GPU chunks", ticks[TIMESTAMP_INSTANCES_END], ticks[TIMESTAMP_CHUNKS_END]);
+    Profiler::record_gpu("GPU present", ticks[TIMESTAMP_PRESENT_START], ticks[TIMESTAMP_FRAME_END]);
+}
+
+// Moves on to the next set of queries, and reads it into the stats if the GPU is done with it
+bool read_gpu_timers(RenderStats &stats) {
+    timer_frame++;
+    if (timer_frame < GPU_TIMER_FRAMES) {
+        return false;
+    }
+    const uint32 *queries = timestamp_queries[timer_frame % GPU_TIMER_FRAMES];
+    int32 available = 0;
+    glGetQueryObjectiv(queries[TIMESTAMP_FRAME_END], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+        return false;
+    }
+    uint64 times[TIMESTAMP_COUNT];
+    for (uint32 i = 0; i < TIMESTAMP_COUNT; i++) {
+        glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &times[i]);
+    }
+    constexpr float32 NS_TO_MS = 1.0f / 1000000.0f;
+    stats.gpu_shadows_ms = (float32)(times[TIMESTAMP_SHADOWS_END] - times[TIMESTAMP_SHADOWS_START]) * NS_TO_MS;
+    stats.gpu_depth_prepass_ms = (float32)(times[TIMESTAMP_DEPTH_PREPASS_END] - times[TIMESTAMP_SCENE_START]) * NS_TO_MS;
+    stats.gpu_instances_ms = (float32)(times[TIMESTAMP_INSTANCES_END] - times[TIMESTAMP_DEPTH_PREPASS_END]) * NS_TO_MS;
+    stats.gpu_chunks_ms = (float32)(times[TIMESTAMP_CHUNKS_END] - times[TIMESTAMP_INSTANCES_END]) * NS_TO_MS;
+    stats.gpu_present_ms = (float32)(times[TIMESTAMP_FRAME_END] - times[TIMESTAMP_PRESENT_START]) * NS_TO_MS;
+    stats.gpu_passes_ms = stats.gpu_shadows_ms + stats.gpu_depth_prepass_ms + stats.gpu_instances_ms + stats.gpu_chunks_ms + stats.gpu_present_ms;
+    // Also counts the time the GPU waits for the CPU to submit, like the chunk updates in prepare_frame
+    stats.gpu_frame_ms = (float32)(times[TIMESTAMP_FRAME_END] - times[TIMESTAMP_FRAME_START]) * NS_TO_MS;
+    if (Profiler::is_enabled.load(std::memory_order_relaxed)) {
+        record_gpu_passes(times);
+    }
+    return true;
+}
+
+void initialize_frame_limit(const GameSettings &settings) {
+    low_latency = settings.low_latency;
+    frames_in_flight = low_latency ? 1 : Config::Graphics::MAX_FRAMES_IN_FLIGHT;
+    for (GLsync &fence : frame_fences) {
+        fence = nullptr;
+    }
+    frame_fence_index = 0;
+    if (low_latency) {
+        LogInfo("Low latency mode: late mouse look, one frame in flight");
+    }
+}
+
+// Called after the swap. Waits until the GPU has finished the frame submitted frames_in_flight - 1 frames ago, this frame in the low
+// latency mode, so frames do not queue up in the driver between the input and the screen.
+void limit_frames_in_flight(RenderStats &stats) {
+    frame_fences[frame_fence_index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frame_fence_index = (frame_fence_index + 1) % frames_in_flight;
+    stats.gpu_wait_ms = 0;
+    GLsync &oldest = frame_fences[frame_fence_index];
+    if (!oldest) {
+        return;
+    }
+    const uint64 wait_start = SDL_GetPerformanceCounter();
+    if (glClientWaitSync(oldest, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000) == GL_TIMEOUT_EXPIRED) {
+        LogWarn("GPU did not finish a frame in 100 ms");
+    }
+    stats.gpu_wait_ms = (float32)((float64)(SDL_GetPerformanceCounter() - wait_start) * 1000.0 / (float64)SDL_GetPerformanceFrequency());
+    glDeleteSync(oldest);
+    oldest = nullptr;
+}
+
+// Turns the camera by the mouse motion that arrived after the input of the frame was handled, and returns the SDL ticks of the oldest
+// motion, or 0 if there was none. The events are only peeked, so the player turns by them with the input of the next frame and the
+// simulation gets the same input as without the late look.
+uint32 sample_late_look(const GameState *state, RenderSnapshot &snapshot) {
+    SDL_PumpEvents();
+    SDL_Event events[Config::Graphics::LATE_LOOK_EVENT_LIMIT];
+    const int32 count = SDL_PeepEvents(events, Config::Graphics::LATE_LOOK_EVENT_LIMIT, SDL_PEEKEVENT, SDL_MOUSEMOTION, SDL_MOUSEMOTION);
+    if (count <= 0) {
+        return 0;
+    }
+    int32 move_x = 0;
+    int32 move_y = 0;
+    for (int32 i = 0; i < count; i++) {
+        move_x += events[i].motion.xrel;
+        move_y += events[i].motion.yrel;
+    }
+    const float32 pitch = MAX(-89.0f, MIN(89.0f, state->player.pitch - (float32)move_y * Config::Player::MOUSE_SENSITIVITY));
+    snapshot.yaw = state->player.yaw + (float32)move_x * Config::Player::MOUSE_SENSITIVITY;
+    snapshot.camera_direction = get_look_direction(pitch, snapshot.yaw);
+    return events[0].motion.timestamp;
+}
+
+void initialize(const GameState *state, const GameSettings &settings) {
     if (!gladLoadGLLoader((GLADloadproc)SDL_GL_GetProcAddress)) {
         LogError("Failed to initialize OpenGL context");
         return;
@@ -135,30 +534,45 @@ void initialize(const GameState *state) {
 
     // Including shader sources
 #include "shaders/frag_empty_glsl.h"
+#include "shaders/frag_fxaa_glsl.h"
 #include "shaders/frag_glsl.h"
 #include "shaders/frag_gui_glsl.h"
 #include "shaders/frag_star_glsl.h"
+#include "shaders/vertex_depth_prepass_glsl.h"
+#include "shaders/vertex_fullscreen_glsl.h"
 #include "shaders/vertex_glsl.h"
 #include "shaders/vertex_gui_glsl.h"
+#include "shaders/geometry_shadow_layers_glsl.h"
+#include "shaders/vertex_instanced_depth_glsl.h"
+#include "shaders/vertex_instanced_glsl.h"
 #include "shaders/vertex_simple_depth_glsl.h"
 #include "shaders/vertex_star_glsl.h"
 
     main_shader.initialize(vertex_source, frag_source);
+    instanced_shader.initialize(vertex_instanced_source, frag_source);
     star_shader.initialize(vertex_star_source, frag_star_source);
     gui_shader.initialize(vertex_gui_source, frag_gui_source);
-    shadow_depth_shader.initialize(vertex_simple_depth_source, frag_empty_source);
+    shadow_depth_shader.initialize(vertex_simple_depth_source, geometry_shadow_layers_source, frag_empty_source);
+    instanced_depth_shader.initialize(vertex_instanced_depth_source, geometry_shadow_layers_source, frag_empty_source);
+    depth_prepass_shader.initialize(vertex_depth_prepass_source, frag_empty_source);
+    fxaa_shader.initialize(vertex_fullscreen_source, frag_fxaa_source);
     DebugVisuals::initialize();
     initialize_cube_graphics();
     initialize_star_graphics(state->stars);
     initialize_hud();
     initialize_shadow_maps();
-
-    stbi_flip_vertically_on_write(true);
+    initialize_gpu_timers();
+    initialize_post_process(settings);
+    initialize_frame_limit(settings);
 }
 
 void switch_shadow_mode() {
     switch (shadow_mode) {
         case ShadowMode::NONE:
+            // The cached maps were not kept up to date while shadows were off
+            for (ShadowCascade &cascade : shadow_cascades) {
+                cascade.valid = false;
+            }
             shadow_mode = ShadowMode::SHADOW_MAP;
             break;
         default:
@@ -166,112 +580,219 @@ void switch_shadow_mode() {
     }
 }
 
+void switch_depth_prepass() {
+    depth_prepass_enabled = !depth_prepass_enabled;
+    LogInfo("Depth pre-pass %s", depth_prepass_enabled ? "on" : "off");
+}
+
+void set_shadow_settings(const ShadowSettings &settings) {
+    int32 max_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    for (int32 i = 0; i < Config::Graphics::SHADOW_MAP_CASCADE_COUNT; i++) {
+        shadow_settings.resolutions[i] = MAX(16, MIN(settings.resolutions[i], max_size));
+    }
+    shadow_settings.depth_bits = settings.depth_bits == 16 || settings.depth_bits == 24 ? settings.depth_bits : 32;
+    allocate_shadow_maps();
+
+    const int32 bytes_per_texel = shadow_settings.depth_bits == 16 ? 2 : 4;
+    const float32 megabytes = (float32)shadow_map_size * shadow_map_size * Config::Graphics::SHADOW_MAP_CASCADE_COUNT * bytes_per_texel / (1024 * 1024);
+    LogInfo("Shadow maps: %d, %d, %d texels, %d bit depth, %.0f MB", shadow_settings.resolutions[0], shadow_settings.resolutions[1],
+            shadow_settings.resolutions[2], shadow_settings.depth_bits, megabytes);
+}
+
+void cycle_shadow_quality() {
+    shadow_quality = (shadow_quality + 1) % Config::Graphics::SHADOW_QUALITY_COUNT;
+    set_shadow_settings(get_shadow_quality_settings(shadow_quality));
+}
+
+// Each cascade covers a sphere around the player that holds its slice of the view frustum, grown by SHADOW_CACHE_MARGIN, so the
+// bounds do not change when the camera turns. The sun view has no translation and the sphere center is snapped to texels,
+// so the shadow edges stay in place while the player moves.
 void calc_ortho_projs(const glm::mat4 &view_inverse, glm::mat4 *sun_views, const float32 aspect_ratio, const float32 fov, const float32 *cascade_ends,
-                      glm::mat4 *sun_projs, GameState *state) {
+                      glm::mat4 *sun_projs, float32 *radii, const RenderSnapshot &snapshot) {
     const float32 tan_half_vfov = tanf(glm::radians(fov / 2.0f));
     const float32 tan_half_hfov = tan_half_vfov * aspect_ratio;
+    // Distance of the far corners of a slice from the camera, relative to the slice end
+    const float32 corner_scale = sqrtf(1.0f + tan_half_vfov * tan_half_vfov + tan_half_hfov * tan_half_hfov);
+
+    const glm::mat4 sun_view = glm::lookAt(-snapshot.sun.pos.as_vec3(), glm::vec3(0.0f), glm::vec3(0, 1, 0));
+    const glm::vec3 player_sv = glm::vec3(sun_view * glm::vec4(snapshot.camera_pos.as_vec3(), 1.0f));
 
     for (uint32 i = 0; i < Config::Graphics::SHADOW_MAP_CASCADE_COUNT; i++) {
-        constexpr uint8 NUM_FRUSTUM_CORNERS = 8;
-        const float32 xn = cascade_ends[i] * tan_half_hfov;
-        const float32 xf = cascade_ends[i + 1] * tan_half_hfov;
-        const float32 yn = cascade_ends[i] * tan_half_vfov;
-        const float32 yf = cascade_ends[i + 1] * tan_half_vfov;
-
-        glm::vec4 frustum_corners_w[NUM_FRUSTUM_CORNERS];
-        const glm::vec4 frustum_corners_v[NUM_FRUSTUM_CORNERS] = {// near face
-                                                                  glm::vec4(xn, yn, -cascade_ends[i], 1.0), glm::vec4(-xn, yn, -cascade_ends[i], 1.0),
-                                                                  glm::vec4(xn, -yn, -cascade_ends[i], 1.0), glm::vec4(-xn, -yn, -cascade_ends[i], 1.0),
-
-                                                                  // far face
-                                                                  glm::vec4(xf, yf, -cascade_ends[i + 1], 1.0), glm::vec4(-xf, yf, -cascade_ends[i + 1], 1.0),
-                                                                  glm::vec4(xf, -yf, -cascade_ends[i + 1], 1.0),
-                                                                  glm::vec4(-xf, -yf, -cascade_ends[i + 1], 1.0)};
-
-        float32 min_x = FLT_MAX;
-        float32 max_x = -FLT_MAX;
-        float32 min_y = FLT_MAX;
-        float32 max_y = -FLT_MAX;
-        float32 min_z = FLT_MAX;
-        float32 max_z = -FLT_MAX;
-
-        glm::vec3 frustum_center = {};
-        for (uint32 j = 0; j < NUM_FRUSTUM_CORNERS; j++) {
-            glm::vec4 corner_w = view_inverse * frustum_corners_v[j];  // Transform to world space
-            frustum_corners_w[j] = corner_w;
-            if (!DebugVisuals::frustums_initialized) DebugVisuals::debug_frustum_corners_w[i][j] = corner_w;
-            frustum_center += glm::vec3(corner_w);
+        if (!DebugVisuals::frustums_initialized) {
+            const float32 xn = cascade_ends[i] * tan_half_hfov;
+            const float32 xf = cascade_ends[i + 1] * tan_half_hfov;
+            const float32 yn = cascade_ends[i] * tan_half_vfov;
+            const float32 yf = cascade_ends[i + 1] * tan_half_vfov;
+            const glm::vec4 frustum_corners_v[8] = {// near face
+                                                    glm::vec4(xn, yn, -cascade_ends[i], 1.0), glm::vec4(-xn, yn, -cascade_ends[i], 1.0),
+                                                    glm::vec4(xn, -yn, -cascade_ends[i], 1.0), glm::vec4(-xn, -yn, -cascade_ends[i], 1.0),
+
+                                                    // far face
+                                                    glm::vec4(xf, yf, -cascade_ends[i + 1], 1.0), glm::vec4(-xf, yf, -cascade_ends[i + 1], 1.0),
+                                                    glm::vec4(xf, -yf, -cascade_ends[i + 1], 1.0), glm::vec4(-xf, -yf, -cascade_ends[i + 1], 1.0)};
+            for (uint32 j = 0; j < 8; j++) {
+                DebugVisuals::debug_frustum_corners_w[i][j] = view_inverse * frustum_corners_v[j];
+            }
         }
-        frustum_center /= 8;
 
-        frustum_center = state->player.pos.as_vec3();
-        sun_views[i] = glm::lookAt(frustum_center - state->sun.pos.as_vec3() * 100.f, frustum_center, glm::vec3(0, 1, 0));
-
-        for (glm::vec4 &j : frustum_corners_w) {
-            glm::vec4 corner_sv = sun_views[i] * j;  // Transform to light view space
-
-            min_x = MIN(min_x, corner_sv.x);
-            max_x = MAX(max_x, corner_sv.x);
-            min_y = MIN(min_y, corner_sv.y);
-            max_y = MAX(max_y, corner_sv.y);
-            min_z = MIN(min_z, corner_sv.z);
-            max_z = MAX(max_z, corner_sv.z);
-        }
+        const float32 radius = cascade_ends[i + 1] * corner_scale * (1.0f + Config::Graphics::SHADOW_CACHE_MARGIN);
+        const float32 texel_size = 2.0f * radius / shadow_settings.resolutions[i];
+        const float32 center_x = floorf(player_sv.x / texel_size) * texel_size;
+        const float32 center_y = floorf(player_sv.y / texel_size) * texel_size;
+        const float32 min_z = player_sv.z - radius;
+        const float32 max_z = player_sv.z + radius;
 
-        // Texel snapping
-        float32 texel_size = (max_x - min_x) / Config::Graphics::SHADOW_MAP_WIDTH;
-        min_x = floor(min_x / texel_size) * texel_size;
-        max_x = ceil(max_x / texel_size) * texel_size;
-        texel_size = (max_y - min_y) / Config::Graphics::SHADOW_MAP_WIDTH;
-        min_y = floor(min_y / texel_size) * texel_size;
-        max_y = ceil(max_y / texel_size) * texel_size;
-        texel_size = (max_z - min_z) / Config::Graphics::SHADOW_MAP_WIDTH;
-        min_z = floor(min_z / texel_size) * texel_size;
-        max_z = ceil(max_z / texel_size) * texel_size;
-
-        sun_projs[i] = glm::ortho(min_x, max_x, min_y, max_y, -min_z + 100, -max_z);
+        sun_views[i] = sun_view;
+        sun_projs[i] = glm::ortho(center_x - radius, center_x + radius, center_y - radius, center_y + radius, -min_z + 100, -max_z);
+        radii[i] = radius;
         if (!DebugVisuals::frustums_initialized) DebugVisuals::calculate_light_frustum_corners(i, sun_projs[i], sun_views[i]);
     }
     DebugVisuals::frustums_initialized = true;
 }
 
-void take_screenshot(GameState *state, int32 screen_width, int32 screen_height) {
-    const uint32 pixels_size = 3 * screen_height * screen_width;
-    auto *pixels = (uint8 *)push_size(state->scratch_arena, pixels_size);
-    glReadPixels(0, 0, screen_width, screen_height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+// Hash of the entities that cast shadows into a cascade, so moved, added and removed entities are noticed
+uint64 hash_shadow_casters(const RenderSnapshot &snapshot, const Frustum &frustum) {
+    uint64 hash = 14695981039346656037ull;
+    for (uint32 i = 0; i < snapshot.entity_count; i++) {
+        const RenderInstance &entity = snapshot.instances[i];
+        if (frustum.test_intersection(get_cube_box(entity.pos, 1.7321f)) == Frustum::TEST_OUTSIDE) {
+            continue;
+        }
+        const float32 values[7] = {entity.pos.x, entity.pos.y, entity.pos.z, entity.rotation.w, entity.rotation.x, entity.rotation.y, entity.rotation.z};
+        uint32 words[7];
+        memcpy(words, values, sizeof(words));
+        for (const uint32 word : words) {
+            hash = (hash ^ word) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+// Decides which cascades are re-rendered this frame. A cascade is out of date when the sun turned by more than its texels
+// tolerate, when the player drifted over half of its margin, or when its casters changed. The near cascade is re-rendered
+// as soon as it is out of date, and the far ones take turns with one per frame, unless their map does not cover the slice anymore.
+void select_shadow_cascades(GameState *state, const RenderSnapshot &snapshot, const float32 *radii, bool *render) {
+    const glm::vec3 sun_dir = glm::normalize(snapshot.sun.pos.as_vec3());
+    bool is_stale[Config::Graphics::SHADOW_MAP_CASCADE_COUNT];
 
-    const std::filesystem::path ss_filepath = state->save_path / "screenshot.bmp";
-    if (!stbi_write_bmp(ss_filepath.string().c_str(), screen_width, screen_height, 3, pixels)) {
-        LogError("Could not take screenshot");
+    for (uint32 i = 0; i < Config::Graphics::SHADOW_MAP_CASCADE_COUNT; i++) {
+        ShadowCascade &cascade = shadow_cascades[i];
+        render[i] = !cascade.valid;
+        is_stale[i] = false;
+        if (!cascade.valid) {
+            continue;
+        }
+
+        const Frustum cached_frustum(cascade.view, cascade.projection);
+        const ChunkMap &chunk_map = state->chunk_map;
+        for (uint32 m = 0; m < chunk_map.changed_mesh_count && !cascade.casters_changed; m++) {
+            const AABB box = {chunk_map.changed_mesh_mins[m], chunk_map.changed_mesh_maxs[m]};
+            cascade.casters_changed = cached_frustum.test_intersection(box) != Frustum::TEST_OUTSIDE;
+        }
+        if (hash_shadow_casters(snapshot, cached_frustum) != cascade.entity_hash) {
+            cascade.casters_changed = true;
+        }
+
+        const float32 drift = (snapshot.camera_pos - cascade.center).get_magnitude();
+        const float32 slice_radius = radii[i] / (1.0f + Config::Graphics::SHADOW_CACHE_MARGIN);
+        const float32 max_drift = (cascade.radius - slice_radius) * 0.5f;
+        const float32 max_sun_angle = 2.0f * cascade.radius / shadow_settings.resolutions[i] / Config::Graphics::SHADOW_CACHE_CASTER_HEIGHT;
+        const float32 sun_angle = acosf(MIN(1.0f, glm::dot(sun_dir, cascade.sun_dir)));
+
+        render[i] = drift + slice_radius > cascade.radius;
+        is_stale[i] = cascade.casters_changed || drift > max_drift || sun_angle > max_sun_angle;
     }
+    state->chunk_map.changed_mesh_count = 0;
+
+    render[0] = render[0] || is_stale[0];
+    for (uint32 n = 1; n < Config::Graphics::SHADOW_MAP_CASCADE_COUNT; n++) {
+        const uint32 i = (next_far_cascade + n - 2) % (Config::Graphics::SHADOW_MAP_CASCADE_COUNT - 1) + 1;
+        if (is_stale[i] && !render[i]) {
+            render[i] = true;
+            next_far_cascade = i % (Config::Graphics::SHADOW_MAP_CASCADE_COUNT - 1) + 1;
+            break;
+        }
+    }
+}
 
-    state->scratch_arena.used -= pixels_size;
+// Instances are kept if they are in any of the frustums in frustum_mask
+inline bool write_instance(const glm::mat4 &model, const Vector3f &color, const Frustum *frustums, const uint8 frustum_mask, InstanceData *instances,
+                           uint32 &instance_count) {
+    // Bounding box of the rotated unit cube is sqrt(3) times its scale
+    const float32 scale = glm::length(glm::vec3(model[0]));
+    const AABB box = get_cube_box(Vector3f(glm::vec3(model[3])), scale * 1.7321f);
+    bool is_visible = false;
+    for (int32 i = 0; i < 8 && !is_visible; i++) {
+        is_visible = (frustum_mask & (1 << i)) && frustums[i].test_intersection(box) != Frustum::TEST_OUTSIDE;
+    }
+    if (!is_visible) {
+        return false;
+    }
+    instances[instance_count].model = model;
+    instances[instance_count].color = color;
+    instance_count++;
+    return true;
 }
 
-void draw_entities(GameState *state, const bool is_shadow) {
-    if (state->entity_count > 0) {
-        glBindVertexArray(vao_cube);
-        for (uint32 i = 0; i < state->entity_count; i++) {
-            glm::mat4 model = glm::mat4(1.0f);
-            model = glm::translate(model, state->entities[i].pos.as_vec3());
-            model *= glm::mat4_cast(state->entities[i].rotation);
-            if (!is_shadow) {
-                glUniformMatrix4fv(main_shader.model_loc, 1, GL_FALSE, glm::value_ptr(model));
-                glUniform3fv(main_shader.object_color_loc, 1, (float32 *)&state->entities[i].color);
-            } else {
-                glUniformMatrix4fv(shadow_depth_shader.model_loc, 1, GL_FALSE, glm::value_ptr(model));
-            }
-            glDrawArrays(GL_TRIANGLES, 0, 36);
-        }
+// Streams the visible entities (and particles and the held block if not a shadow pass) into the instance buffer and draws them with one call
+void draw_instances(const RenderSnapshot &snapshot, const Frustum *frustums, const uint8 frustum_mask, const bool is_shadow) {
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_instances);
+    auto *instances = (InstanceData *)glMapBufferRange(GL_ARRAY_BUFFER, 0, Config::Game::INSTANCE_LIMIT * sizeof(InstanceData),
+                                                       GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!instances) {
+        LogError("Could not map the instance buffer");
+        return;
+    }
+
+    uint32 instance_count = 0;
+    const uint32 snapshot_count = is_shadow ? snapshot.entity_count : snapshot.instance_count;
+    for (uint32 i = 0; i < snapshot_count; i++) {
+        const RenderInstance &instance = snapshot.instances[i];
+        glm::mat4 model = glm::mat4(glm::mat3_cast(instance.rotation) * instance.scale);
+        model[3] = glm::vec4(instance.pos.as_vec3(), 1.0f);
+        write_instance(model, instance.color, frustums, frustum_mask, instances, instance_count);
+    }
+
+    if (!is_shadow && !snapshot.throw_mode) {
+        // Selected block that is held in front of the camera
+        Vector3f side_vector = cross({0, 1, 0}, snapshot.camera_direction);
+        side_vector.normalize();
+        Vector3f cube_pos;
+        cube_pos += snapshot.camera_pos + snapshot.camera_direction * 0.3f + side_vector * (-0.15f);
+        cube_pos.y -= 0.1f;
+        glm::mat4 model = glm::mat4(1.0f);
+        model = glm::translate(model, cube_pos.as_vec3());
+        model = glm::scale(model, {0.1, 0.1, 0.1});
+        model = glm::rotate(model, 60 - glm::radians(snapshot.yaw), glm::vec3(0, 1, 0));
+        write_instance(model, block_color_map[snapshot.selected_block + 1], frustums, frustum_mask, instances, instance_count);
+    }
+
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    if (instance_count > 0) {
+        glBindVertexArray(vao_instanced);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 36, instance_count);
     }
 }
 
-void draw_chunks(GameState *state, const Frustum &player_frustum) {
+void draw_chunks(const GameState *state, const Frustum &player_frustum, const FaceFilter &faces) {
+    PROFILE_SCOPE("draw_chunks");
     // Reset object color and ambient base strength
     glUniform3f(main_shader.object_color_loc, 0, 0, 0);
     glUniform1f(main_shader.ambient_base_loc, 0.25f);
 
-    state->chunk_map.draw_chunks(main_shader.model_loc, player_frustum, state->player.pos);
+    state->chunk_map.draw_visible_chunks(main_shader.model_loc, player_frustum, faces, false);
+}
+
+// Lays down the depth of the visible chunks, so the shading pass only runs the fragment shader for the fragments that are seen
+void draw_depth_prepass(const GameState *state, const glm::mat4 &view, const glm::mat4 &projection, const Frustum &player_frustum,
+                        const FaceFilter &faces) {
+    depth_prepass_shader.use();
+    glUniformMatrix4fv(depth_prepass_shader.view_loc, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(depth_prepass_shader.projection_loc, 1, GL_FALSE, glm::value_ptr(projection));
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    state->chunk_map.draw_visible_chunks(depth_prepass_shader.model_loc, player_frustum, faces, true);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 }
 
 void draw_gui() {
@@ -280,55 +801,40 @@ void draw_gui() {
     glDrawArrays(GL_TRIANGLES, 0, 12);
 }
 
-void draw_particles(const GameState *state) {
-    if (state->particle_count > 0) {
-        glBindVertexArray(vao_cube);
-        for (uint32 i = 0; i < state->particle_count; i++) {
-            glm::mat4 model = glm::mat4(1.0f);
-            model = glm::translate(model, state->particles[i].pos.as_vec3());
-            model = glm::scale(model, {state->particles[i].scale, state->particles[i].scale, state->particles[i].scale});
-            model *= glm::mat4_cast(state->particles[i].rotation);
-            glUniformMatrix4fv(main_shader.model_loc, 1, GL_FALSE, glm::value_ptr(model));
-            glUniform3fv(main_shader.object_color_loc, 1, (const float32 *)&state->particles[i].color);
-            glDrawArrays(GL_TRIANGLES, 0, 36);
-        }
-    }
-}
-
-void draw_stars(const GameState *state, const glm::mat4 &view, const glm::mat4 &projection) {
+void draw_stars(const RenderSnapshot &snapshot, const glm::mat4 &view, const glm::mat4 &projection) {
     star_shader.use();
 
     glm::mat4 model = glm::mat4(1.0f);
-    model = glm::translate(model, state->player.pos.as_vec3());
+    model = glm::translate(model, snapshot.camera_pos.as_vec3());
     glUniformMatrix4fv(star_shader.model_loc, 1, GL_FALSE, glm::value_ptr(model));
     glUniformMatrix4fv(star_shader.view_loc, 1, GL_FALSE, glm::value_ptr(view));
     glUniformMatrix4fv(star_shader.projection_loc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniform3fv(star_shader.sky_color_loc, 1, (const float32 *)&state->sun.sky_color);
-    glUniform1f(star_shader.star_visibility_loc, state->sun.star_visibility);
+    glUniform3fv(star_shader.sky_color_loc, 1, (const float32 *)&snapshot.sun.sky_color);
+    glUniform1f(star_shader.star_visibility_loc, snapshot.sun.star_visibility);
 
     glBindVertexArray(vao_stars);
     glUniform3f(star_shader.color_loc, 1.0f, 1.0f, 1.0f);
     glDrawArrays(GL_POINTS, 0, Config::Game::STAR_COUNT);
 }
 
-void draw_sun(const GameState *state, const glm::vec3 &camera_up) {
+void draw_sun(const RenderSnapshot &snapshot, const glm::vec3 &camera_up) {
     constexpr glm::vec3 ORIGIN = {};
-    glm::mat4 star_view = glm::lookAt(ORIGIN, state->player.direction.as_vec3(), camera_up);
+    glm::mat4 star_view = glm::lookAt(ORIGIN, snapshot.camera_direction.as_vec3(), camera_up);
     glUniformMatrix4fv(star_shader.view_loc, 1, GL_FALSE, glm::value_ptr(star_view));
     glUniform1f(star_shader.star_visibility_loc, 1.0f);
     glBindVertexArray(vao_sun);
 
     glm::mat4 model = glm::mat4(1.0f);
-    model = glm::translate(model, state->sun.pos.as_vec3());
-    model = model * glm::mat4_cast(state->sun.rot);
+    model = glm::translate(model, snapshot.sun.pos.as_vec3());
+    model = model * glm::mat4_cast(snapshot.sun.rot);
     model = glm::scale(model, {4, 4, 4});
     glUniformMatrix4fv(star_shader.model_loc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniform3fv(star_shader.color_loc, 1, (const float32 *)&state->sun.color);
+    glUniform3fv(star_shader.color_loc, 1, (const float32 *)&snapshot.sun.color);
     glDrawArrays(GL_TRIANGLES, 0, 6);
     glClear(GL_DEPTH_BUFFER_BIT);
 }
 
-void draw_block_selection_box(const GameState *state, const BlockPos &b_pos_pointing, const glm::mat4 &view) {
+void draw_block_selection_box(const BlockPos &b_pos_pointing, const glm::mat4 &view) {
     const Vector3f pos_pointing = block_pos_to_pos(b_pos_pointing);
     glm::mat4 model = glm::mat4(1.0f);
     model = glm::translate(model, pos_pointing.as_vec3());
@@ -340,117 +846,269 @@ void draw_block_selection_box(const GameState *state, const BlockPos &b_pos_poin
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 }
 
-void draw_selected_block(const GameState *state) {
-    glBindVertexArray(vao_cube);
-    Vector3f side_vector = cross({0, 1, 0}, state->player.direction);
-    side_vector.normalize();
-    Vector3f cube_pos;
-    cube_pos += state->player.pos + state->player.direction * 0.3f + side_vector * (-0.15f);
-    cube_pos.y -= 0.1f;
-    glm::mat4 model = glm::mat4(1.0f);
-    model = glm::translate(model, cube_pos.as_vec3());
-    model = glm::scale(model, {0.1, 0.1, 0.1});
-    model = glm::rotate(model, 60 - glm::radians(state->player.yaw), glm::vec3(0, 1, 0));
+void set_scene_uniforms(const MainShader &shader, const RenderSnapshot &snapshot, const glm::mat4 &view, const glm::mat4 &projection,
+                        const glm::mat4 *sun_space_matrices, const float32 *cascade_ends) {
+    shader.use();
+    glUniformMatrix4fv(shader.view_loc, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(shader.projection_loc, 1, GL_FALSE, glm::value_ptr(projection));
+    glUniform3fv(shader.sun_color_loc, 1, (const float32 *)&snapshot.sun.color);
+    glUniform3fv(shader.sun_pos_loc, 1, (const float32 *)&snapshot.sun.pos);
+    glUniform3fv(shader.view_pos_loc, 1, (const float32 *)&snapshot.camera_pos);
+    glUniform3fv(shader.sky_color_loc, 1, (const float32 *)&snapshot.sun.sky_color);
+    glUniform3f(shader.object_color_loc, 0, 0, 0);
+    glUniform1f(shader.ambient_base_loc, 0.2f);
+    glUniform1f(shader.specular_strength_loc, snapshot.sun.specular_strength);
+    glUniform1f(shader.diffuse_strength_loc, snapshot.sun.diffuse_strength);
+    glUniform1f(shader.culling_distance_loc, Config::Graphics::CULLING_DISTANCE);
+    glUniform1f(shader.shadow_map_enabled_loc, shadow_mode == ShadowMode::SHADOW_MAP);
 
-    glUniformMatrix4fv(main_shader.model_loc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniform3fv(main_shader.object_color_loc, 1, (float32 *)&block_color_map[state->player.selected_block + 1]);
-    glDrawArrays(GL_TRIANGLES, 0, 36);
+    if (shadow_mode == ShadowMode::SHADOW_MAP) {
+        glUniformMatrix4fv(shader.sun_space_matrix_loc, Config::Graphics::SHADOW_MAP_CASCADE_COUNT, GL_FALSE, glm::value_ptr(sun_space_matrices[0]));
+        glUniform1fv(shader.cascade_ends_loc, Config::Graphics::SHADOW_MAP_CASCADE_COUNT, cascade_ends + 1);
+        glUniform1i(shader.shadow_map_loc, 0);
+        glUniform1f(shader.shadow_bias_loc, shadow_bias);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, depth_map_array);
+    }
+}
+
+static const glm::vec3 camera_up = glm::vec3(0.0f, 1.0f, 0.0f);
+
+void calc_camera(const RenderSnapshot &snapshot, const int32 screen_width, const int32 screen_height, glm::mat4 &view, glm::mat4 &projection) {
+    const Vector3f look_at_pos = snapshot.camera_pos + snapshot.camera_direction;
+    view = glm::lookAt(snapshot.camera_pos.as_vec3(), look_at_pos.as_vec3(), camera_up);
+    projection = glm::perspective(glm::radians(snapshot.fov), (float32)screen_width / (float32)screen_height, 0.1f, Config::Graphics::CULLING_DISTANCE * 100);
 }
 
-void draw(GameState *state, const int32 screen_width, const int32 screen_height, SDL_Window *window, uint8 block_pointing, const BlockPos &b_pos_pointing,
-          float32 time_delta) {
-    static const glm::vec3 camera_up = glm::vec3(0.0f, 1.0f, 0.0f);
-    const Vector3f look_at_pos = state->player.pos + state->player.direction;
-    glm::mat4 view = glm::lookAt(state->player.pos.as_vec3(), look_at_pos.as_vec3(), camera_up);
-    glm::mat4 projection =
-        glm::perspective(glm::radians(state->player.fov), (float32)screen_width / (float32)screen_height, 0.1f, Config::Graphics::CULLING_DISTANCE * 100);
-    const Frustum player_frustum(view, projection);
+void prepare_frame(GameState *state, const RenderSnapshot &snapshot, const int32 screen_width, const int32 screen_height) {
+    PROFILE_SCOPE("prepare_frame");
+    glm::mat4 view;
+    glm::mat4 projection;
+    calc_camera(snapshot, screen_width, screen_height, view, projection);
+
+    write_timestamp(TIMESTAMP_FRAME_START);
+    state->chunk_map.update_chunks(snapshot.camera_pos);
+    state->chunk_map.cull_chunks(Frustum(view, projection), snapshot.camera_pos);
+}
+
+void draw(GameState *state, RenderSnapshot &snapshot, const int32 screen_width, const int32 screen_height, SDL_Window *window, float32 time_delta,
+          uint32 input_time) {
+    PROFILE_SCOPE("draw");
+    glm::mat4 view;
+    glm::mat4 projection;
+    calc_camera(snapshot, screen_width, screen_height, view, projection);
+    Frustum player_frustum(view, projection);
 
     constexpr float32 CASCADE_ENDS[] = {Config::Graphics::SHADOW_NEAR_PLANE, 100.0f, 400.0f, 1600.0f};
     glm::mat4 sun_space_matrices[Config::Graphics::SHADOW_MAP_CASCADE_COUNT];
 
     // Shadow depth maps rendering
+    write_timestamp(TIMESTAMP_SHADOWS_START);
+    state->render_stats.shadow_cascades_rendered = 0;
     if (shadow_mode == ShadowMode::SHADOW_MAP) {
+        PROFILE_SCOPE("Shadow cascades");
         glm::mat4 sun_projections[Config::Graphics::SHADOW_MAP_CASCADE_COUNT];
         glm::mat4 sun_views[Config::Graphics::SHADOW_MAP_CASCADE_COUNT];
-        shadow_depth_shader.use();
+        float32 radii[Config::Graphics::SHADOW_MAP_CASCADE_COUNT];
 
         const glm::mat4 view_inverse = glm::inverse(view);
-        calc_ortho_projs(view_inverse, sun_views, ((float32)screen_width) / ((float32)screen_height), state->player.fov, CASCADE_ENDS, sun_projections, state);
-
-        glCullFace(GL_FRONT);
-        glViewport(0, 0, Config::Graphics::SHADOW_MAP_WIDTH, Config::Graphics::SHADOW_MAP_HEIGHT);
+        calc_ortho_projs(view_inverse, sun_views, ((float32)screen_width) / ((float32)screen_height), snapshot.fov, CASCADE_ENDS, sun_projections, radii,
+                         snapshot);
+        bool render_cascade[Config::Graphics::SHADOW_MAP_CASCADE_COUNT];
+        select_shadow_cascades(state, snapshot, radii, render_cascade);
+
+        // The depth map keeps the surfaces nearest to the sun, and in closed block geometry those face the sun, so the rest are skipped
+        const FaceFilter sun_faces = FaceFilter::from_direction(snapshot.sun.pos);
+        Frustum sun_frustums[Config::Graphics::SHADOW_MAP_CASCADE_COUNT];
+        float32 cascade_extents[Config::Graphics::SHADOW_MAP_CASCADE_COUNT];
+        uint8 cascade_mask = 0;
+        glBindFramebuffer(GL_FRAMEBUFFER, depth_map_fbo);
         for (uint32 i = 0; i < Config::Graphics::SHADOW_MAP_CASCADE_COUNT; i++) {
-            sun_space_matrices[i] = sun_projections[i] * sun_views[i];
-            glUniformMatrix4fv(shadow_depth_shader.sun_space_matrix_loc, 1, GL_FALSE, glm::value_ptr(sun_space_matrices[i]));
-
-            glBindFramebuffer(GL_FRAMEBUFFER, depth_map_fbo);
-            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_maps[i], 0);
-            glClear(GL_DEPTH_BUFFER_BIT);
+            ShadowCascade &cascade = shadow_cascades[i];
+            if (render_cascade[i]) {
+                cascade.valid = true;
+                cascade.casters_changed = false;
+                cascade.view = sun_views[i];
+                cascade.projection = sun_projections[i];
+                cascade.sun_dir = glm::normalize(snapshot.sun.pos.as_vec3());
+                cascade.center = snapshot.camera_pos;
+                cascade.radius = radii[i];
+                sun_frustums[i] = Frustum(cascade.view, cascade.projection);
+                cascade.entity_hash = hash_shadow_casters(snapshot, sun_frustums[i]);
+                cascade_mask |= 1 << i;
+                state->render_stats.shadow_cascades_rendered++;
+
+                // Only the layers being re-rendered are cleared
+                glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth_map_array, 0, i);
+                glClear(GL_DEPTH_BUFFER_BIT);
+            }
+            // Squeezes the cascade into the corner of its layer that matches its resolution
+            const float32 scale = (float32)shadow_settings.resolutions[i] / (float32)shadow_map_size;
+            const glm::mat4 corner = glm::scale(glm::translate(glm::mat4(1.0f), glm::vec3(scale - 1.0f, scale - 1.0f, 0.0f)), glm::vec3(scale, scale, 1.0f));
+            sun_space_matrices[i] = corner * cascade.projection * cascade.view;
+            cascade_extents[i] = 2.0f * scale - 1.0f;
+        }
 
-            Frustum sun_frustum(sun_views[i], sun_projections[i]);
-            state->chunk_map.draw_chunks(shadow_depth_shader.model_loc, sun_frustum, state->player.pos);
-            draw_entities(state, true);
+        // All re-rendered cascades are drawn in one pass, with the geometry shader sending each triangle to its layers
+        if (cascade_mask != 0) {
+            glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth_map_array, 0);
+            glCullFace(GL_FRONT);
+            glViewport(0, 0, shadow_map_size, shadow_map_size);
+            // Clips the triangles at the edges of the smaller cascades
+            glEnable(GL_CLIP_DISTANCE0);
+            glEnable(GL_CLIP_DISTANCE1);
+            // The sampler compares against the four nearest texels, so the depth is pushed back by its slope over a texel
+            glEnable(GL_POLYGON_OFFSET_FILL);
+            glPolygonOffset(1.5f, 1.0f);
+
+            shadow_depth_shader.use();
+            glUniformMatrix4fv(shadow_depth_shader.sun_space_matrices_loc, Config::Graphics::SHADOW_MAP_CASCADE_COUNT, GL_FALSE,
+                               glm::value_ptr(sun_space_matrices[0]));
+            glUniform1fv(shadow_depth_shader.cascade_extents_loc, Config::Graphics::SHADOW_MAP_CASCADE_COUNT, cascade_extents);
+            state->chunk_map.draw_chunks_layered(shadow_depth_shader.model_loc, shadow_depth_shader.cascade_mask_loc, sun_frustums, cascade_mask, sun_faces);
+
+            instanced_depth_shader.use();
+            glUniformMatrix4fv(instanced_depth_shader.sun_space_matrices_loc, Config::Graphics::SHADOW_MAP_CASCADE_COUNT, GL_FALSE,
+                               glm::value_ptr(sun_space_matrices[0]));
+            glUniform1fv(instanced_depth_shader.cascade_extents_loc, Config::Graphics::SHADOW_MAP_CASCADE_COUNT, cascade_extents);
+            glUniform1i(instanced_depth_shader.cascade_mask_loc, cascade_mask);
+            draw_instances(snapshot, sun_frustums, cascade_mask, true);
+
+            glDisable(GL_CLIP_DISTANCE0);
+            glDisable(GL_CLIP_DISTANCE1);
+            glDisable(GL_POLYGON_OFFSET_FILL);
+        }
+    }
+    write_timestamp(TIMESTAMP_SHADOWS_END);
+#ifdef DEBUG
+    static uint32 cascades_rendered_sum = 0;
+    cascades_rendered_sum += state->render_stats.shadow_cascades_rendered;
+    if (state->frame_count % 600 == 0) {
+        LogDebug("Shadow cascades rendered: %.2f per frame", (float32)cascades_rendered_sum / 600.0f);
+        cascades_rendered_sum = 0;
+    }
+#endif
+
+    // The shadow maps do not depend on where the camera looks, so the view can still turn
+    if (low_latency) {
+        const uint32 late_input_time = sample_late_look(state, snapshot);
+        if (late_input_time != 0) {
+            calc_camera(snapshot, screen_width, screen_height, view, projection);
+            player_frustum = Frustum(view, projection);
+            state->chunk_map.recull_nearby_chunks(player_frustum);
+            input_time = input_time != 0 ? input_time : late_input_time;
         }
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
     }
 
     // Real rendering
+    if (scene_target.width != screen_width || scene_target.height != screen_height) {
+        allocate_scene_target(screen_width, screen_height);
+    }
+    scene_target.render_width = MAX(1, (int32)((float32)screen_width * resolution_scale + 0.5f));
+    scene_target.render_height = MAX(1, (int32)((float32)screen_height * resolution_scale + 0.5f));
+    state->render_stats.resolution_scale = resolution_scale;
+    glBindFramebuffer(GL_FRAMEBUFFER, scene_target.fbo);
     glCullFace(GL_BACK);
-    glViewport(0, 0, screen_width, screen_height);
-    glClearColor(state->sun.sky_color.x, state->sun.sky_color.y, state->sun.sky_color.z, 1);
+    glViewport(0, 0, scene_target.render_width, scene_target.render_height);
+    glClearColor(snapshot.sun.sky_color.x, snapshot.sun.sky_color.y, snapshot.sun.sky_color.z, 1);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     static float32 absolute_time = 0;
     absolute_time += time_delta;
     
-    draw_stars(state, view, projection);
-    draw_sun(state, camera_up);
-
-    if (block_pointing > 0) {
-        draw_block_selection_box(state, b_pos_pointing, view);
-    }
-
-    main_shader.use();
-    glUniformMatrix4fv(main_shader.view_loc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(main_shader.projection_loc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniform3fv(main_shader.sun_color_loc, 1, (float32 *)&state->sun.color);
-    glUniform3fv(main_shader.sun_pos_loc, 1, (float32 *)&state->sun.pos);
-    glUniform3fv(main_shader.view_pos_loc, 1, (float32 *)&state->player.pos);
-    glUniform3fv(main_shader.sky_color_loc, 1, (float32 *)&state->sun.sky_color);
-    glUniform1f(main_shader.ambient_base_loc, 0.2f);
-    glUniform1f(main_shader.specular_strength_loc, state->sun.specular_strength);
-    glUniform1f(main_shader.diffuse_strength_loc, state->sun.diffuse_strength);
-    glUniform1f(main_shader.culling_distance_loc, Config::Graphics::CULLING_DISTANCE);
-    glUniform1f(main_shader.shadow_map_enabled_loc, shadow_mode == ShadowMode::SHADOW_MAP);
+    draw_stars(snapshot, view, projection);
+    draw_sun(snapshot, camera_up);
 
-    if (shadow_mode == ShadowMode::SHADOW_MAP) {
-        glUniformMatrix4fv(main_shader.sun_space_matrix_loc, Config::Graphics::SHADOW_MAP_CASCADE_COUNT, GL_FALSE, glm::value_ptr(sun_space_matrices[0]));
-        glUniform1fv(main_shader.cascade_ends_loc, Config::Graphics::SHADOW_MAP_CASCADE_COUNT, CASCADE_ENDS + 1);
-        constexpr int32 DEPTH_TEXTURE_IDS[] = {0, 1, 2};
-        glUniform1iv(main_shader.shadow_map_loc, Config::Graphics::SHADOW_MAP_CASCADE_COUNT, DEPTH_TEXTURE_IDS);
+    if (snapshot.block_pointing > 0) {
+        draw_block_selection_box(snapshot.b_pos_pointing, view);
+    }
 
-        for (uint32 i = 0; i < Config::Graphics::SHADOW_MAP_CASCADE_COUNT; i++) {
-            glActiveTexture(GL_TEXTURE0 + i);
-            glBindTexture(GL_TEXTURE_2D, depth_maps[i]);
-        }
+    const FaceFilter player_faces = FaceFilter::from_eye(snapshot.camera_pos);
+    write_timestamp(TIMESTAMP_SCENE_START);
+    if (depth_prepass_enabled) {
+        draw_depth_prepass(state, view, projection, player_frustum, player_faces);
     }
+    write_timestamp(TIMESTAMP_DEPTH_PREPASS_END);
+
+    set_scene_uniforms(instanced_shader, snapshot, view, projection, sun_space_matrices, CASCADE_ENDS);
+    draw_instances(snapshot, &player_frustum, 1, false);
+    write_timestamp(TIMESTAMP_INSTANCES_END);
 
-    if (!state->player.throw_mode) {
-        draw_selected_block(state);
+    set_scene_uniforms(main_shader, snapshot, view, projection, sun_space_matrices, CASCADE_ENDS);
+    if (depth_prepass_enabled) {
+        // Only the fragments that won the pre-pass are shaded
+        glDepthFunc(GL_EQUAL);
+        glDepthMask(GL_FALSE);
     }
-    draw_particles(state);
-    draw_entities(state, false);
-    draw_chunks(state, player_frustum);
-    draw_gui();
+    draw_chunks(state, player_frustum, player_faces);
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+    write_timestamp(TIMESTAMP_CHUNKS_END);
 
     // Shadow map debug visuals
     if (state->debug_visuals_enabled && shadow_mode == ShadowMode::SHADOW_MAP) {
-        DebugVisuals::draw_debug_shadow_maps(screen_width, screen_height, depth_maps);
+        DebugVisuals::draw_debug_shadow_maps(scene_target.render_width, scene_target.render_height, depth_map_array);
         DebugVisuals::draw_frustum_wire_frames(view, projection);
         DebugVisuals::draw_light_frustum_wire_frames(view, projection);
     }
 
+    write_timestamp(TIMESTAMP_PRESENT_START);
+    present_scene(screen_width, screen_height);
+    draw_gui();
+    glEnable(GL_DEPTH_TEST);
+
+    write_timestamp(TIMESTAMP_FRAME_END);
+    if (read_gpu_timers(state->render_stats) && dynamic_resolution) {
+        update_resolution_scale(state->render_stats.gpu_passes_ms);
+    }
+#ifdef DEBUG
+    static RenderStats gpu_time_sums;
+    const RenderStats &stats = state->render_stats;
+    gpu_time_sums.gpu_shadows_ms += stats.gpu_shadows_ms;
+    gpu_time_sums.gpu_depth_prepass_ms += stats.gpu_depth_prepass_ms;
+    gpu_time_sums.gpu_instances_ms += stats.gpu_instances_ms;
+    gpu_time_sums.gpu_chunks_ms += stats.gpu_chunks_ms;
+    gpu_time_sums.gpu_present_ms += stats.gpu_present_ms;
+    gpu_time_sums.gpu_frame_ms += stats.gpu_frame_ms;
+    if (state->frame_count % 600 == 0) {
+        LogDebug("GPU ms per frame: shadows %.2f, depth pre-pass %.2f, instances %.2f, chunks %.2f, present %.2f, frame %.2f (pre-pass %s, "
+                 "resolution scale %.2f)",
+                 gpu_time_sums.gpu_shadows_ms / 600.0f, gpu_time_sums.gpu_depth_prepass_ms / 600.0f, gpu_time_sums.gpu_instances_ms / 600.0f,
+                 gpu_time_sums.gpu_chunks_ms / 600.0f, gpu_time_sums.gpu_present_ms / 600.0f, gpu_time_sums.gpu_frame_ms / 600.0f,
+                 depth_prepass_enabled ? "on" : "off", resolution_scale);
+        gpu_time_sums = {};
+    }
+#endif
+
+    // The HUD is included in screenshots
+    Capture::capture_frame(screen_width, screen_height);
     SDL_GL_SwapWindow(window);
+
+    // Replayed input has the times of its recording, which are skipped
+    const uint32 present_time = SDL_GetTicks();
+    const bool is_input_timed = input_time != 0 && input_time <= present_time && present_time - input_time < 1000;
+    state->render_stats.input_latency_ms = is_input_timed ? (float32)(present_time - input_time) : 0.0f;
+    limit_frames_in_flight(state->render_stats);
+#ifdef DEBUG
+    static float32 input_latency_sum = 0;
+    static float32 input_latency_max = 0;
+    static uint32 input_frames = 0;
+    static float32 gpu_wait_sum = 0;
+    if (is_input_timed) {
+        input_latency_sum += state->render_stats.input_latency_ms;
+        input_latency_max = MAX(input_latency_max, state->render_stats.input_latency_ms);
+        input_frames++;
+    }
+    gpu_wait_sum += state->render_stats.gpu_wait_ms;
+    if (state->frame_count % 600 == 0) {
+        LogDebug("Input to swap: %.1f ms average, %.0f ms max in %u frames with input. GPU wait %.2f ms per frame (%u frames in flight%s)",
+                 input_frames ? input_latency_sum / (float32)input_frames : 0.0f, input_latency_max, input_frames, gpu_wait_sum / 600.0f,
+                 frames_in_flight, low_latency ? ", late mouse look" : "");
+        input_latency_sum = 0;
+        input_latency_max = 0;
+        input_frames = 0;
+        gpu_wait_sum = 0;
+    }
+#endif
 }
 }  // namespace Graphics
@@ -1,16 +1,27 @@
 #pragma once
 #include <SDL_video.h>
 
-#include "Definitions.h"
+#include "Config.h"
 
 struct Frustum;
-struct BlockPos;
 struct GameState;
+struct GameSettings;
+struct RenderSnapshot;
 
 namespace Graphics {
-void initialize(const GameState *state);
-void draw(GameState *state, int32 screen_width, int32 screen_height, SDL_Window *window, uint8 block_pointing, const BlockPos &b_pos_pointing,
-          float32 time_delta);
-void take_screenshot(GameState *state, int32 screen_width, int32 screen_height);
+struct ShadowSettings {
+    int32 resolutions[Config::Graphics::SHADOW_MAP_CASCADE_COUNT];  // Each cascade uses the lower left corner of its layer
+    int32 depth_bits;
+};
+
+void initialize(const GameState *state, const GameSettings &settings);
+// Fills, meshes and culls the chunks for the frame, before the simulation starts
+void prepare_frame(GameState *state, const RenderSnapshot &snapshot, int32 screen_width, int32 screen_height);
+// Draws the frame while the simulation runs, so it reads the world only through the snapshot and the culled chunks.
+// In the low latency mode, the camera of the snapshot is turned by the mouse motion that arrived since input_time.
+void draw(GameState *state, RenderSnapshot &snapshot, int32 screen_width, int32 screen_height, SDL_Window *window, float32 time_delta, uint32 input_time);
 void switch_shadow_mode();
+void switch_depth_prepass();
+void set_shadow_settings(const ShadowSettings &settings);
+void cycle_shadow_quality();
 }  // namespace Graphics
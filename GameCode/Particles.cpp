@@ -0,0 +1,155 @@
+#include "Particles.h"
+
+#include <xmmintrin.h>
+
+#include "Chunk.h"
+#include "Utility.h"
+
+constexpr float32 PARTICLE_LIFETIME = 1.5f;
+constexpr float32 PARTICLE_GRAVITY = 25.f;
+constexpr float32 PARTICLE_FRICTION = 5.f;
+
+void ParticleSystem::emit(const ParticleEmitter *emitters, const uint32 emitter_count) {
+    for (uint32 e = 0; e < emitter_count && count < CAPACITY; e++) {
+        const ParticleEmitter &emitter = emitters[e];
+        const uint32 first = count;
+        const uint32 last = MIN(count + emitter.count, CAPACITY);
+        for (uint32 i = first; i < last; i++) {
+            pos_x[i] = emitter.pos.x + rand_float() - 0.5f;
+            pos_y[i] = emitter.pos.y + rand_float() - 0.5f;
+            pos_z[i] = emitter.pos.z + rand_float() - 0.5f;
+            speed_x[i] = (rand_float() - 0.5f) * 5;
+            speed_y[i] = rand_float() * 5;
+            speed_z[i] = (rand_float() - 0.5f) * 5;
+            rot_speed_x[i] = (rand_float() - 0.5f) * 10;
+            rot_speed_y[i] = (rand_float() - 0.5f) * 10;
+            age[i] = (rand_float() - 0.5f) * 0.5f;
+        }
+        for (uint32 i = first; i < last; i++) {
+            prev_pos_x[i] = pos_x[i];
+            prev_pos_y[i] = pos_y[i];
+            prev_pos_z[i] = pos_z[i];
+            rot_w[i] = prev_rot_w[i] = 1;
+            rot_x[i] = prev_rot_x[i] = 0;
+            rot_y[i] = prev_rot_y[i] = 0;
+            rot_z[i] = prev_rot_z[i] = 0;
+            scale[i] = emitter.scale;
+            color_r[i] = emitter.color.x;
+            color_g[i] = emitter.color.y;
+            color_b[i] = emitter.color.z;
+        }
+        count = last;
+    }
+}
+
+void ParticleSystem::remove(const uint32 i) {
+    const uint32 last = count - 1;
+    pos_x[i] = pos_x[last];
+    pos_y[i] = pos_y[last];
+    pos_z[i] = pos_z[last];
+    speed_x[i] = speed_x[last];
+    speed_y[i] = speed_y[last];
+    speed_z[i] = speed_z[last];
+    rot_w[i] = rot_w[last];
+    rot_x[i] = rot_x[last];
+    rot_y[i] = rot_y[last];
+    rot_z[i] = rot_z[last];
+    prev_pos_x[i] = prev_pos_x[last];
+    prev_pos_y[i] = prev_pos_y[last];
+    prev_pos_z[i] = prev_pos_z[last];
+    prev_rot_w[i] = prev_rot_w[last];
+    prev_rot_x[i] = prev_rot_x[last];
+    prev_rot_y[i] = prev_rot_y[last];
+    prev_rot_z[i] = prev_rot_z[last];
+    rot_speed_x[i] = rot_speed_x[last];
+    rot_speed_y[i] = rot_speed_y[last];
+    scale[i] = scale[last];
+    age[i] = age[last];
+    color_r[i] = color_r[last];
+    color_g[i] = color_g[last];
+    color_b[i] = color_b[last];
+    count--;
+}
+
+void ParticleSystem::update(ChunkMap &chunk_map, const float32 time_delta) {
+    // Integration of age, position, speed and rotation, 4 particles at a time
+    const __m128 dt = _mm_set1_ps(time_delta);
+    const __m128 half_dt = _mm_set1_ps(time_delta * 0.5f);
+    const __m128 gravity_dt = _mm_set1_ps(PARTICLE_GRAVITY * time_delta);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 three_halves = _mm_set1_ps(1.5f);
+    const uint32 padded_count = (count + 3) & ~3u;
+    for (uint32 i = 0; i < padded_count; i += 4) {
+        _mm_store_ps(age + i, _mm_add_ps(_mm_load_ps(age + i), dt));
+
+        const __m128 px = _mm_load_ps(pos_x + i);
+        const __m128 py = _mm_load_ps(pos_y + i);
+        const __m128 pz = _mm_load_ps(pos_z + i);
+        _mm_store_ps(prev_pos_x + i, px);
+        _mm_store_ps(prev_pos_y + i, py);
+        _mm_store_ps(prev_pos_z + i, pz);
+        const __m128 vy = _mm_load_ps(speed_y + i);
+        _mm_store_ps(pos_x + i, _mm_add_ps(px, _mm_mul_ps(_mm_load_ps(speed_x + i), dt)));
+        _mm_store_ps(pos_y + i, _mm_add_ps(py, _mm_mul_ps(vy, dt)));
+        _mm_store_ps(pos_z + i, _mm_add_ps(pz, _mm_mul_ps(_mm_load_ps(speed_z + i), dt)));
+        _mm_store_ps(speed_y + i, _mm_sub_ps(vy, gravity_dt));
+
+        // First order quaternion integration q += q * (0, w) * dt / 2 with the local angular speed w = (a, b, 0), then renormalization.
+        // This replaces the two glm::rotate calls (and their sin/cos) per particle.
+        const __m128 w = _mm_load_ps(rot_w + i);
+        const __m128 x = _mm_load_ps(rot_x + i);
+        const __m128 y = _mm_load_ps(rot_y + i);
+        const __m128 z = _mm_load_ps(rot_z + i);
+        _mm_store_ps(prev_rot_w + i, w);
+        _mm_store_ps(prev_rot_x + i, x);
+        _mm_store_ps(prev_rot_y + i, y);
+        _mm_store_ps(prev_rot_z + i, z);
+        const __m128 a = _mm_mul_ps(_mm_load_ps(rot_speed_x + i), half_dt);
+        const __m128 b = _mm_mul_ps(_mm_load_ps(rot_speed_y + i), half_dt);
+        const __m128 new_w = _mm_sub_ps(w, _mm_add_ps(_mm_mul_ps(x, a), _mm_mul_ps(y, b)));
+        const __m128 new_x = _mm_add_ps(x, _mm_sub_ps(_mm_mul_ps(w, a), _mm_mul_ps(z, b)));
+        const __m128 new_y = _mm_add_ps(y, _mm_add_ps(_mm_mul_ps(w, b), _mm_mul_ps(z, a)));
+        const __m128 new_z = _mm_add_ps(z, _mm_sub_ps(_mm_mul_ps(x, b), _mm_mul_ps(y, a)));
+
+        // Approximate reciprocal square root refined with one Newton-Raphson step
+        const __m128 length_sq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(new_w, new_w), _mm_mul_ps(new_x, new_x)),
+                                            _mm_add_ps(_mm_mul_ps(new_y, new_y), _mm_mul_ps(new_z, new_z)));
+        __m128 inv_length = _mm_rsqrt_ps(length_sq);
+        inv_length = _mm_mul_ps(inv_length, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, length_sq), _mm_mul_ps(inv_length, inv_length))));
+
+        _mm_store_ps(rot_w + i, _mm_mul_ps(new_w, inv_length));
+        _mm_store_ps(rot_x + i, _mm_mul_ps(new_x, inv_length));
+        _mm_store_ps(rot_y + i, _mm_mul_ps(new_y, inv_length));
+        _mm_store_ps(rot_z + i, _mm_mul_ps(new_z, inv_length));
+    }
+
+    // Ground contact: bottom of the particle is in a block while its top is not
+    BlockAccessor accessor(&chunk_map);
+    for (uint32 i = 0; i < count; i++) {
+        const float32 half_scale = scale[i] * 0.5f;
+        const int32 block_x = fast_floor(pos_x[i] + 0.5f);
+        const int32 block_z = fast_floor(pos_z[i] + 0.5f);
+        const int32 bottom_y = fast_floor(pos_y[i] - half_scale + 0.5f);
+        const int32 top_y = fast_floor(pos_y[i] + half_scale + 0.5f);
+        if (accessor.get(block_x, bottom_y, block_z) == 0 || accessor.get(block_x, top_y, block_z) != 0) {
+            continue;
+        }
+
+        pos_y[i] = (float32)bottom_y + 0.5f + half_scale;
+        speed_y[i] = 0;
+        const float32 speed = sqrtf(speed_x[i] * speed_x[i] + speed_z[i] * speed_z[i]);
+        const float32 friction = speed > 0 ? time_delta * PARTICLE_FRICTION / speed : 0;
+        speed_x[i] -= speed_x[i] * (time_delta + friction);
+        speed_z[i] -= speed_z[i] * (time_delta + friction);
+        rot_speed_x[i] -= rot_speed_x[i] * (time_delta * PARTICLE_FRICTION);
+        rot_speed_y[i] -= rot_speed_y[i] * (time_delta * PARTICLE_FRICTION);
+    }
+
+    for (uint32 i = 0; i < count;) {
+        if (age[i] >= PARTICLE_LIFETIME) {
+            remove(i);
+        } else {
+            i++;
+        }
+    }
+}
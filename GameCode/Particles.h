@@ -0,0 +1,52 @@
+#pragma once
+#include "Config.h"
+#include "Definitions.h"
+#include "Geometry.h"
+
+struct ChunkMap;
+
+// A burst of particles around a position, spawned together with other bursts in one batch
+struct ParticleEmitter {
+    Vector3f pos = {};
+    Vector3f color = {};
+    float32 scale = 1;
+    uint32 count = 0;
+};
+
+// Particles stored as structure of arrays so that the integration can run 4 particles at a time with SSE.
+// Capacity is a multiple of 4, so the SIMD loops run over the padded count without a scalar tail.
+struct ParticleSystem {
+    static constexpr uint32 CAPACITY = Config::Game::PARTICLE_LIMIT;
+    static_assert(CAPACITY % 4 == 0, "Particle capacity must be a multiple of the SIMD width");
+
+    void emit(const ParticleEmitter *emitters, uint32 emitter_count);
+    void emit(const ParticleEmitter &emitter) { emit(&emitter, 1); }
+    void update(ChunkMap &chunk_map, float32 time_delta);
+    void remove(uint32 i);
+
+    uint32 count = 0;
+    alignas(16) float32 pos_x[CAPACITY];
+    alignas(16) float32 pos_y[CAPACITY];
+    alignas(16) float32 pos_z[CAPACITY];
+    alignas(16) float32 speed_x[CAPACITY];
+    alignas(16) float32 speed_y[CAPACITY];
+    alignas(16) float32 speed_z[CAPACITY];
+    alignas(16) float32 rot_w[CAPACITY];
+    alignas(16) float32 rot_x[CAPACITY];
+    alignas(16) float32 rot_y[CAPACITY];
+    alignas(16) float32 rot_z[CAPACITY];
+    alignas(16) float32 prev_pos_x[CAPACITY];  // Transform before the latest simulation step, for interpolation
+    alignas(16) float32 prev_pos_y[CAPACITY];
+    alignas(16) float32 prev_pos_z[CAPACITY];
+    alignas(16) float32 prev_rot_w[CAPACITY];
+    alignas(16) float32 prev_rot_x[CAPACITY];
+    alignas(16) float32 prev_rot_y[CAPACITY];
+    alignas(16) float32 prev_rot_z[CAPACITY];
+    alignas(16) float32 rot_speed_x[CAPACITY];  // Angular speed around the local x axis
+    alignas(16) float32 rot_speed_y[CAPACITY];  // Angular speed around the local y axis
+    alignas(16) float32 scale[CAPACITY];
+    alignas(16) float32 age[CAPACITY];
+    alignas(16) float32 color_r[CAPACITY];
+    alignas(16) float32 color_g[CAPACITY];
+    alignas(16) float32 color_b[CAPACITY];
+};
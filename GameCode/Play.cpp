@@ -1,34 +1,36 @@
+#include <SDL_timer.h>
+
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "AABB.h"
+#include "Capture.h"
 #include "Chunk.h"
 #include "Collision.h"
 #include "GameBase.h"
 #include "Geometry.h"
 #include "Graphics.h"
+#include "Profiler.h"
 #include "ShadowDebugVisuals.h"
 #include "Sound.h"
 
 namespace Play {
-void spawn_particles(GameState *state, const Vector3f &pos, const Vector3f &color, const float32 scale, const int32 count) {
-    for (uint32 i = state->particle_count; i < MIN(state->particle_count + count, Config::Game::PARTICLE_LIMIT); i++) {
-        state->particles[i].initialize(pos, color, scale);
-    }
-    state->particle_count = MIN(state->particle_count + count, Config::Game::PARTICLE_LIMIT);
+void spawn_particles(GameState *state, const Vector3f &pos, const Vector3f &color, const float32 scale, const uint32 count) {
+    state->particles.emit({pos, color, scale, count});
 }
 
-BlockEntity *spawn_block_entity(GameState *state, const Vector3f &pos, const Vector3f &color) {
-    if (state->entity_count < Config::Game::ENTITY_LIMIT) {
-        state->entities[state->entity_count] = BlockEntity();
-        state->entities[state->entity_count].pos = pos;
-        state->entities[state->entity_count].color = color;
-        state->entities[state->entity_count].bound = true;
-        state->entities[state->entity_count].rot_speed = {rand_float() * 4.f - 2.0f, rand_float() * 4.f - 2.0f};
-        state->entity_count++;
-        return &state->entities[state->entity_count - 1];
-    }
-    return nullptr;
+EntityHandle spawn_block_entity(GameState *state, const Vector3f &pos, const Vector3f &color, const uint8 flags) {
+    EntityStore &entities = state->entities;
+    const EntityHandle handle = entities.create();
+    const int32 i = entities.get_index(handle);
+    if (i >= 0) {
+        entities.pos[i] = pos;
+        entities.prev_pos[i] = pos;
+        entities.color[i] = color;
+        entities.flags[i] = flags;
+        entities.rot_speed[i] = {rand_float() * 4.f - 2.0f, rand_float() * 4.f - 2.0f};
+    }
+    return handle;
 }
 
 void update_sun(GameState *state, float32 time_delta, const ControllerInput *controller, const ControllerInput *last_controller) {
@@ -58,85 +60,153 @@ void update_sun(GameState *state, float32 time_delta, const ControllerInput *con
     sun.star_visibility = MIN(1.0f, MAX(0.0f, -sun_sin + 0.25f));
 }
 
-void update_particles(GameState *state, float32 time_delta) {
-    for (uint32 i = 0; i < state->particle_count; i++) {
-        state->particles[i].age += time_delta;
-        if (state->particles[i].age >= 1.5f) {
-            state->particles[i] = state->particles[state->particle_count - 1];
-            state->particle_count--;
+// Breaks an entity into particles, with a break sound
+void shatter_entity(GameState *state, const uint32 i, const Vector3f &break_pos) {
+    EntityStore &entities = state->entities;
+    spawn_particles(state, break_pos, entities.color[i], 0.33f, 8);
+
+    // shitty volume scaling based on distance
+    float32 dist = (entities.pos[i] - state->player.pos).get_magnitude();
+    float32 ratio = powf(1.0f - MIN((dist) / 200.0f, 1.0f), 2);
+    int32 vol = Sound::get_volume();
+    Sound::set_volume(2, (int32)((float32)vol * ratio));
+    Sound::play(Sound::break_sound, 2);
+
+    entities.flags[i] |= ENTITY_DEAD;
+}
+
+// Whether a sleeping entity still rests on a block or on another entity
+bool is_entity_supported(GameState *state, BlockAccessor &accessor, const uint32 i) {
+    constexpr float32 PROBE_DEPTH = 0.05f;
+    constexpr float32 INSET = 0.01f;
+    const EntityStore &entities = state->entities;
+    const AABB box = entities.get_box(i);
+
+    // Blocks under the footprint
+    const int32 y = fast_floor(box.min.y - PROBE_DEPTH + 0.5f);
+    for (int32 x = fast_floor(box.min.x + INSET + 0.5f); x <= fast_floor(box.max.x - INSET + 0.5f); x++) {
+        for (int32 z = fast_floor(box.min.z + INSET + 0.5f); z <= fast_floor(box.max.z - INSET + 0.5f); z++) {
+            if (accessor.get(x, y, z) != 0) {
+                return true;
+            }
+        }
+    }
+
+    // Entities right under it
+    const AABB probe_box = {{box.min.x + INSET, box.min.y - PROBE_DEPTH, box.min.z + INSET}, {box.max.x - INSET, box.min.y, box.max.z - INSET}};
+    uint32 candidates[EntityGrid::QUERY_LIMIT];
+    uint32 candidate_count = state->entity_grid.query(probe_box, candidates, EntityGrid::QUERY_LIMIT);
+    // Crowded queries fall back to testing every entity
+    const bool all_entities = candidate_count > EntityGrid::QUERY_LIMIT;
+    candidate_count = all_entities ? entities.count : candidate_count;
+    for (uint32 c = 0; c < candidate_count; c++) {
+        const uint32 j = all_entities ? c : candidates[c];
+        if (j == i || entities.flags[j] & (ENTITY_DEAD | ENTITY_BOUND)) {
+            continue;
         }
-        state->particles[i].pos += state->particles[i].speed * time_delta;
-        state->particles[i].speed.y -= 25.f * time_delta;
-
-        state->particles[i].rotation = glm::rotate(state->particles[i].rotation, state->particles[i].rot_speed.x * time_delta, glm::vec3(1, 0, 0));
-        state->particles[i].rotation = glm::rotate(state->particles[i].rotation, state->particles[i].rot_speed.y * time_delta, glm::vec3(0, 1, 0));
-
-        Vector3f bottom_point = state->particles[i].pos;
-        Vector3f top_point = state->particles[i].pos;
-        bottom_point.y -= state->particles[i].scale * 0.5f;
-        top_point.y += state->particles[i].scale * 0.5f;
-        if (state->chunk_map.get_block_at_pos(bottom_point) > 0 && state->chunk_map.get_block_at_pos(top_point) == 0) {
-            BlockPos block_bottom;
-            pos_to_block_pos(bottom_point, block_bottom);
-            state->particles[i].pos.y = block_pos_to_pos(block_bottom).y + 0.5f + state->particles[i].scale * 0.5f;
-            state->particles[i].speed.y = 0;
-            const Vector3f direction = state->particles[i].speed.get_normalized();
-            state->particles[i].speed -= (state->particles[i].speed * time_delta + direction * (time_delta * 5));
-            state->particles[i].rot_speed -= (state->particles[i].rot_speed * (time_delta * 5));
+        const AABB other_box = entities.get_box(j);
+        if (other_box.max.y <= box.min.y + INSET && aabb_check(probe_box, other_box)) {
+            return true;
         }
     }
+    return false;
 }
 
 void update_entities(GameState *state, float32 time_delta) {
-    for (uint32 i = 0; i < state->entity_count; i++) {
-        state->entities[i].age += time_delta;
-        Vector3f old_pos = state->entities[i].pos;
+    constexpr float32 EPSILON = 1.0f / 1024.0f;
+    EntityStore &entities = state->entities;
+    state->entity_grid.build(entities, time_delta);
+    BlockAccessor accessor(&state->chunk_map);
+
+    for (uint32 i = 0; i < entities.count; i++) {
+        entities.prev_pos[i] = entities.pos[i];
+        entities.prev_rotation[i] = entities.rotation[i];
+    }
+
+    for (uint32 i = 0; i < entities.count; i++) {
+        if (entities.flags[i] & ENTITY_DEAD) {
+            continue;
+        }
+        entities.age[i] += time_delta;
+        const Vector3f old_pos = entities.pos[i];
 
-        if (state->entities[i].bound) {
-            float32 progress = lin2exp(MIN(state->entities[i].age / 2.f, 1.f), true);
+        if (entities.flags[i] & ENTITY_BOUND) {
+            float32 progress = lin2exp(MIN(entities.age[i] / 2.f, 1.f), true);
 
-            Vector3f start_pos = state->player.pos + state->player.direction * state->entities[i].bound_offset.get_magnitude();
+            Vector3f start_pos = state->player.pos + state->player.direction * entities.bound_offset[i].get_magnitude();
             Vector3f side_vector = cross({0, 1, 0}, state->player.direction).get_normalized();
             Vector3f end_pos = state->player.pos + state->player.direction * 2.0f + side_vector * (-1.0f);
             end_pos.y += 0.8f;
-            state->entities[i].pos = start_pos + (end_pos - start_pos) * progress;
+            entities.pos[i] = start_pos + (end_pos - start_pos) * progress;
             glm::quat start_rot = {1, 0, 0, 0};
             glm::quat end_rot = {1, 0, 0, 0};
             end_rot = glm::rotate(end_rot, -2.0f, side_vector.as_vec3());
             end_rot = glm::rotate(end_rot, -glm::radians(state->player.yaw), glm::vec3(0, 1, 0));
-            state->entities[i].rotation = glm::normalize(start_rot + (end_rot - start_rot) * progress);
-        } else {
-            if (state->entities[i].age >= 12.f) {
-                state->entities[i] = state->entities[state->entity_count - 1];
-                if (state->player.hand_entity == &state->entities[state->entity_count - 1]) {
-                    state->player.hand_entity = &state->entities[i];
-                }
-                state->entity_count--;
-            }
+            entities.rotation[i] = glm::normalize(start_rot + (end_rot - start_rot) * progress);
+            continue;
+        }
 
-            Vector3f movement = state->entities[i].speed * time_delta;
-            state->entities[i].pos += movement;
-            state->entities[i].speed.y = MAX(state->entities[i].speed.y - 25.f * time_delta, -150.0f);
+        if (entities.age[i] >= Config::Physics::ENTITY_LIFETIME) {
+            entities.flags[i] |= ENTITY_DEAD;
+            continue;
+        }
+        if (entities.flags[i] & ENTITY_SLEEPING) {
+            if (is_entity_supported(state, accessor, i)) {
+                continue;
+            }
+            entities.flags[i] &= ~ENTITY_SLEEPING;
+        }
 
-            state->entities[i].rotation = glm::rotate(state->entities[i].rotation, state->entities[i].rot_speed.x * time_delta, glm::vec3(1, 0, 0));
-            state->entities[i].rotation = glm::rotate(state->entities[i].rotation, state->entities[i].rot_speed.y * time_delta, glm::vec3(0, 1, 0));
+        Vector3f movement = entities.speed[i] * time_delta;
+        entities.speed[i].y = MAX(entities.speed[i].y - 25.f * time_delta, -150.0f);
+
+        entities.rotation[i] = glm::rotate(entities.rotation[i], entities.rot_speed[i].x * time_delta, glm::vec3(1, 0, 0));
+        entities.rotation[i] = glm::rotate(entities.rotation[i], entities.rot_speed[i].y * time_delta, glm::vec3(0, 1, 0));
+
+        BlockPos hit_block_pos;
+        const AABB entity_box = entities.get_box(i);
+        Vector3f cc_normal;
+        float32 cc_t = detect_collision(state->chunk_map, entity_box, movement, cc_normal, hit_block_pos);
+
+        // Other entities are treated as static during this entity's sweep
+        int32 hit_entity = -1;
+        const AABB broad_phase_box = get_swept_broadphase_aabb(entity_box, movement);
+        uint32 candidates[EntityGrid::QUERY_LIMIT];
+        uint32 candidate_count = state->entity_grid.query(broad_phase_box, candidates, EntityGrid::QUERY_LIMIT);
+        const bool all_entities = candidate_count > EntityGrid::QUERY_LIMIT;
+        candidate_count = all_entities ? entities.count : candidate_count;
+        for (uint32 c = 0; c < candidate_count; c++) {
+            const uint32 j = all_entities ? c : candidates[c];
+            const AABB other_box = entities.get_box(j);
+            if (j == i || entities.flags[j] & (ENTITY_DEAD | ENTITY_BOUND) || !aabb_check(broad_phase_box, other_box)) {
+                continue;
+            }
+            Vector3f normal;
+            const float32 t = swept_aabb_check(entity_box, other_box, movement, normal);
+            if (t < cc_t) {
+                cc_t = t;
+                cc_normal = normal;
+                hit_entity = (int32)j;
+            }
+        }
 
-            BlockPos org_block_pos;
-            pos_to_block_pos(state->entities[i].pos, org_block_pos);
+        if (cc_t >= 1.0f) {
+            entities.pos[i] += movement;
+            continue;
+        }
+        entities.pos[i] += movement * cc_t + cc_normal * EPSILON;
+        const Vector3f break_pos = old_pos + movement + (movement * -1.0f).get_normalized();
 
-            BlockPos hit_block_pos;
-            AABB entity_box = get_cube_box(state->entities[i].pos - movement, 1.0f);
-            Vector3f cc_normal;
-            float32 cc_t = detect_collision(state->chunk_map, entity_box, movement, cc_normal, hit_block_pos);
-            if (cc_t < 1.0f) {
+        if (hit_entity < 0) {
+            const float32 impact_speed = entities.speed[i].get_magnitude();
+            if (impact_speed > Config::Physics::ENTITY_SHATTER_SPEED) {
                 Vector3f hit_pos;
                 hit_pos = block_pos_to_pos(hit_block_pos);
 
-                Vector3f reverse_dir = (old_pos - state->entities[i].pos).get_normalized();
-                Vector3f break_pos = state->entities[i].pos + reverse_dir;
-                spawn_particles(state, break_pos, state->entities[i].color, 0.33f, 8);
-
-                if (state->entities[i].speed.get_magnitude() > 80.0f) {
+                if (impact_speed > 80.0f) {
+                    // Debris of all broken blocks is spawned in one batch
+                    ParticleEmitter emitters[27];
+                    uint32 emitter_count = 0;
                     for (int32 dx = -1; dx <= 1; dx++) {
                         for (int32 dy = -1; dy <= 1; dy++) {
                             for (int32 dz = -1; dz <= 1; dz++) {
@@ -147,37 +217,60 @@ void update_entities(GameState *state, float32 time_delta) {
                                 to_break_pos.z += (float32)dz;
                                 BlockPos to_break_b_pos;
                                 pos_to_block_pos(to_break_pos, to_break_b_pos);
-                                uint8 to_break_block = state->chunk_map.get_block_at_block_pos(to_break_b_pos);
+                                uint8 to_break_block = accessor.get(to_break_b_pos);
                                 if (to_break_block > 0) {
                                     state->chunk_map.change_block_at_block_pos(to_break_b_pos, 0);
-                                    spawn_particles(state, to_break_pos, block_color_map[to_break_block], 0.33f, 6);
+                                    emitters[emitter_count++] = {to_break_pos, block_color_map[to_break_block], 0.33f, 6};
                                 }
                             }
                         }
                     }
-                } else if (state->entities[i].speed.get_magnitude() > 50.0f) {
-                    uint8 to_break_block = state->chunk_map.get_block_at_block_pos(hit_block_pos);
+                    state->particles.emit(emitters, emitter_count);
+                } else if (impact_speed > 50.0f) {
+                    uint8 to_break_block = accessor.get(hit_block_pos);
                     if (to_break_block > 0) {
                         state->chunk_map.change_block_at_block_pos(hit_block_pos, 0);
                         spawn_particles(state, hit_pos, block_color_map[to_break_block], 0.33f, 8);
                     }
                 }
 
-                // shitty volume scaling based on distance
-                float32 dist = (state->entities[i].pos - state->player.pos).get_magnitude();
-                float32 ratio = powf(1.0f - MIN((dist) / 200.0f, 1.0f), 2);
-                int32 vol = Sound::get_volume();
-                Sound::set_volume(2, (int32)((float32)vol * ratio));
-                Sound::play(Sound::break_sound, 2);
+                shatter_entity(state, i, break_pos);
+                continue;
+            }
+        } else {
+            const uint32 j = hit_entity;
+            const Vector3f relative_speed = entities.speed[i] - entities.speed[j];
+            if (relative_speed.get_magnitude() > Config::Physics::ENTITY_SHATTER_SPEED) {
+                shatter_entity(state, i, break_pos);
+                shatter_entity(state, j, entities.pos[j]);
+                continue;
+            }
 
-                state->entities[i] = state->entities[state->entity_count - 1];
-                if (state->player.hand_entity == &state->entities[state->entity_count - 1]) {
-                    state->player.hand_entity = &state->entities[i];
-                }
-                state->entity_count--;
+            // Impulse between equal masses along the contact normal
+            const float32 approach_speed = dot(relative_speed, cc_normal);
+            if (approach_speed < 0) {
+                const Vector3f impulse = cc_normal * (approach_speed * (1.0f + Config::Physics::ENTITY_RESTITUTION) * 0.5f);
+                entities.speed[i] -= impulse;
+                entities.speed[j] += impulse;
             }
+            entities.flags[j] &= ~ENTITY_SLEEPING;
+            // Its step no longer follows the cells it was bucketed in
+            state->entity_grid.loosen(j);
+        }
+
+        if (cc_normal.y == 1.0f) {
+            // Landed softly, rests until its support is gone
+            entities.speed[i] = {};
+            entities.rot_speed[i] = {};
+            entities.rotation[i] = {1.0f, 0.0f, 0.0f, 0.0f};
+            entities.flags[i] |= ENTITY_SLEEPING;
+        } else {
+            // Slides along the surface
+            entities.speed[i] -= cc_normal * dot(entities.speed[i], cc_normal);
         }
     }
+
+    entities.remove_dead();
 }
 
 void update_fov(GameState *state, float32 time_delta, const ControllerInput *controller) {
@@ -197,15 +290,40 @@ void update_fov(GameState *state, float32 time_delta, const ControllerInput *con
     }
 }
 
-void update_player(GameState *state, float32 time_delta, ControllerInput *controller, const ControllerInput *last_controller, BlockPos &b_pos_pointing,
-                   uint8 &block_pointing) {
+// Camera angles follow the input every frame, not only on simulation steps
+void update_look(GameState *state, float32 time_delta, ControllerInput *controller) {
+    state->player.pitch += (controller->dir_down - controller->dir_up) * time_delta * 75.f;
+    state->player.yaw += (controller->dir_right - controller->dir_left) * time_delta * 75.f;
+
+    state->player.pitch -= ((float32)(controller->mouse_move_y)) * Config::Player::MOUSE_SENSITIVITY;
+    state->player.yaw += ((float32)(controller->mouse_move_x)) * Config::Player::MOUSE_SENSITIVITY;
+    controller->mouse_move_x = 0;
+    controller->mouse_move_y = 0;
+
+    // Clamping pitch
+    if (state->player.pitch > 89.0f) {
+        state->player.pitch = 89.0f;
+    } else if (state->player.pitch < -89.0f) {
+        state->player.pitch = -89.0f;
+    }
+
+    state->player.direction = get_look_direction(state->player.pitch, state->player.yaw);
+
+    // Player selected block
+    state->player.selected_block = mod((state->player.selected_block + controller->mouse_wheel), 8);
+    controller->mouse_wheel = 0;
+}
+
+void update_player(GameState *state, float32 time_delta, ControllerInput *controller, const ControllerInput *last_controller) {
     Vector3f acceleration = {};
     Vector3f walk_direction = {};
     Vector3f forward_direction = state->player.direction;
     forward_direction.y = 0;
+    state->simulation.player_prev_pos = state->player.pos;
 
+    BlockPos b_pos_pointing;
     BlockPos b_pos_pointing_front;
-    block_pointing = find_block_in_front(state->chunk_map, state->player.pos, state->player.direction, b_pos_pointing, b_pos_pointing_front);
+    const uint8 block_pointing = find_block_in_front(state->chunk_map, state->player.pos, state->player.direction, b_pos_pointing, b_pos_pointing_front);
 
     static float32 block_break_cooldown = 0.f;
     static float32 block_put_cooldown = 0.f;
@@ -284,27 +402,31 @@ void update_player(GameState *state, float32 time_delta, ControllerInput *contro
 
                 Sound::play(Sound::place_sound);
             } else {
-                if (state->player.hand_entity == nullptr) {
+                if (state->entities.get_index(state->player.hand_entity) < 0) {
                     block_put_cooldown = 0.3f;
                     state->chunk_map.change_block_at_block_pos(b_pos_pointing, 0);
                     const Vector3f break_pos = block_pos_to_pos(b_pos_pointing);
                     const Vector3f color = block_color_map[block_pointing];
-                    state->player.hand_entity = spawn_block_entity(state, break_pos, color);
-                    state->player.hand_entity->bound_offset = break_pos - state->player.pos;
+                    state->player.hand_entity = spawn_block_entity(state, break_pos, color, ENTITY_BOUND);
+                    const int32 hand = state->entities.get_index(state->player.hand_entity);
+                    if (hand >= 0) {
+                        state->entities.bound_offset[hand] = break_pos - state->player.pos;
+                    }
                 }
             }
         }
     } else {
         block_put_cooldown = 0;
         if (last_controller->button_mouse_r) {
-            if (state->player.hand_entity != nullptr) {
+            const int32 hand = state->entities.get_index(state->player.hand_entity);
+            if (hand >= 0) {
                 constexpr float32 MAX_SPEED = 100.0f;
                 constexpr float32 MAX_PULL = 2.0f;
 
-                state->player.hand_entity->speed = state->player.direction * (MAX_SPEED * lin2exp(MIN(state->player.hand_entity->age, MAX_PULL)));
-                state->player.hand_entity->bound = false;
-                state->player.hand_entity->age = 0.f;
-                state->player.hand_entity = nullptr;
+                state->entities.speed[hand] = state->player.direction * (MAX_SPEED * lin2exp(MIN(state->entities.age[hand], MAX_PULL)));
+                state->entities.flags[hand] &= ~ENTITY_BOUND;
+                state->entities.age[hand] = 0.f;
+                state->player.hand_entity = {};
             }
         }
     }
@@ -324,27 +446,6 @@ void update_player(GameState *state, float32 time_delta, ControllerInput *contro
     walk_direction.normalize();
     acceleration += walk_direction * Config::Player::ACCELERATION;
 
-    // Adjusting camera angles
-    state->player.pitch += (controller->dir_down - controller->dir_up) * time_delta * 75.f;
-    state->player.yaw += (controller->dir_right - controller->dir_left) * time_delta * 75.f;
-
-    state->player.pitch -= ((float32)(controller->mouse_move_y)) * 0.1f;
-    state->player.yaw += ((float32)(controller->mouse_move_x)) * 0.1f;
-    controller->mouse_move_x = 0;
-    controller->mouse_move_y = 0;
-
-    // Clamping pitch
-    if (state->player.pitch > 89.0f) {
-        state->player.pitch = 89.0f;
-    } else if (state->player.pitch < -89.0f) {
-        state->player.pitch = -89.0f;
-    }
-
-    state->player.direction.x = cos(glm::radians(state->player.pitch)) * cos(glm::radians(state->player.yaw));
-    state->player.direction.y = sin(glm::radians(state->player.pitch));
-    state->player.direction.z = cos(glm::radians(state->player.pitch)) * sin(glm::radians(state->player.yaw));
-    state->player.direction.normalize();
-
     state->player.speed += (acceleration * time_delta);
 
     constexpr float32 FC = Config::Physics::FRICTION_CONSTANT;
@@ -386,35 +487,40 @@ void update_player(GameState *state, float32 time_delta, ControllerInput *contro
                                     {-WIDTH * 0.5F, -HEIGHT - 0.5F, +WIDTH * 0.5F},
                                     {+WIDTH * 0.5F, -HEIGHT - 0.5F, -WIDTH * 0.5F},
                                     {-WIDTH * 0.5F, -HEIGHT - 0.5F, -WIDTH * 0.5F}};
+        BlockAccessor accessor(&state->chunk_map);
         bool solid_ground = false;
         for (const Vector3f &offset : offsets) {
-            if (state->chunk_map.get_block_at_pos(state->player.pos + offset) > 0) {
+            if (accessor.get_at_pos(state->player.pos + offset) > 0) {
                 solid_ground = true;
                 break;
             }
         }
         state->player.on_ground = solid_ground;
     }
-
-    // Player selected block
-    state->player.selected_block = mod((state->player.selected_block + controller->mouse_wheel), 8);
-    controller->mouse_wheel = 0;
 }
 
-void handle_f_functions(GameState *state, ControllerInput *controller, const ControllerInput *last_controller, int32 screen_width, int32 screen_height) {
+void handle_f_functions(GameState *state, ControllerInput *controller, const ControllerInput *last_controller) {
     // Switch shadow mode with F1
     if (controller->button_f1 && !last_controller->button_f1) {
         Graphics::switch_shadow_mode();
     }
-    // Screen shot with F2
+    // Screen shot with F2, start or stop an image sequence with shift + F2
     if (controller->button_f2 && !last_controller->button_f2) {
-        Graphics::take_screenshot(state, screen_width, screen_height);
+        if (controller->button_l2) {
+            Capture::switch_sequence();
+        } else {
+            Capture::request_screenshot();
+        }
     }
-    // Toggle debug visuals with F3
+    // Toggle debug visuals with F3, start or stop a profiler trace with shift + F3
     if (controller->button_f3 && !last_controller->button_f3) {
-        state->debug_visuals_enabled = !state->debug_visuals_enabled;
-        if (state->debug_visuals_enabled) {
-            DebugVisuals::frustums_initialized = false;
+        if (controller->button_l2) {
+            Profiler::switch_trace();
+        } else {
+            state->debug_visuals_enabled = !state->debug_visuals_enabled;
+            if (state->debug_visuals_enabled) {
+                DebugVisuals::frustums_initialized = false;
+            }
         }
     }
     // Toggle sun speed boost with F4
@@ -425,15 +531,167 @@ void handle_f_functions(GameState *state, ControllerInput *controller, const Con
     if (controller->button_f5 && !last_controller->button_f5) {
         state->chunk_map.update_all_chunks(state->player.pos);
     }
+    // Cycle the shadow map resolution and depth precision with F10
+    if (controller->button_f10 && !last_controller->button_f10) {
+        Graphics::cycle_shadow_quality();
+    }
+    // Toggle the depth pre-pass of the chunks with F11
+    if (controller->button_f11 && !last_controller->button_f11) {
+        Graphics::switch_depth_prepass();
+    }
+#ifdef DEBUG
+    // Particle stress test with F6: a large debris burst in front of the player
+    if (controller->button_f6 && !last_controller->button_f6) {
+        constexpr uint32 BURST_EMITTER_COUNT = 64;
+        ParticleEmitter emitters[BURST_EMITTER_COUNT];
+        for (uint32 i = 0; i < BURST_EMITTER_COUNT; i++) {
+            emitters[i].pos = state->player.pos + state->player.direction * 8.0f;
+            emitters[i].pos.x += (rand_float() - 0.5f) * 8.0f;
+            emitters[i].pos.y += rand_float() * 4.0f;
+            emitters[i].pos.z += (rand_float() - 0.5f) * 8.0f;
+            emitters[i].color = block_color_map[1 + i % 4];
+            emitters[i].scale = 0.2f;
+            emitters[i].count = Config::Game::PARTICLE_LIMIT / BURST_EMITTER_COUNT;
+        }
+        state->particles.emit(emitters, BURST_EMITTER_COUNT);
+    }
+    // Entity stress test with F7: a rain of blocks above the player that pile up and go to sleep
+    if (controller->button_f7 && !last_controller->button_f7) {
+        constexpr int32 RAIN_SIDE = 16;
+        constexpr int32 RAIN_LAYERS = 4;
+        for (int32 layer = 0; layer < RAIN_LAYERS; layer++) {
+            for (int32 x = 0; x < RAIN_SIDE; x++) {
+                for (int32 z = 0; z < RAIN_SIDE; z++) {
+                    Vector3f pos = state->player.pos;
+                    pos.x += ((float32)x - RAIN_SIDE / 2) * 1.5f + rand_float() * 0.4f;
+                    pos.y += 2.0f + (float32)layer * 1.5f;
+                    pos.z += ((float32)z - RAIN_SIDE / 2) * 1.5f + rand_float() * 0.4f;
+                    spawn_block_entity(state, pos, block_color_map[1 + (x + z) % 4], 0);
+                }
+            }
+        }
+    }
+    // Raycast check with F8: compares the grid traversal against the old ray march on a cone of rays and times both
+    if (controller->button_f8 && !last_controller->button_f8) {
+        constexpr uint32 RAY_COUNT = 4096;
+        constexpr float32 MAX_DIST = 5.0f * Config::Player::HEIGHT;
+        const size_t scratch_used = state->scratch_arena.used;
+        Vector3f *orgs = pushArray(state->scratch_arena, RAY_COUNT, Vector3f);
+        Vector3f *dirs = pushArray(state->scratch_arena, RAY_COUNT, Vector3f);
+        RayHit *hits = pushArray(state->scratch_arena, RAY_COUNT, RayHit);
+        for (uint32 i = 0; i < RAY_COUNT; i++) {
+            orgs[i] = state->player.pos;
+            dirs[i] = state->player.direction + Vector3f(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f);
+            dirs[i].normalize();
+        }
+
+        const uint64 march_start = SDL_GetPerformanceCounter();
+        uint32 march_hits = 0;
+        uint32 mismatches = 0;
+        for (uint32 i = 0; i < RAY_COUNT; i++) {
+            BlockPos b_pos, front_b_pos;
+            const uint8 block = find_block_in_front_marching(state->chunk_map, orgs[i], dirs[i], b_pos, front_b_pos);
+            march_hits += block > 0;
+            hits[i].block = block;
+            hits[i].b_pos = b_pos;
+        }
+        const uint64 march_end = SDL_GetPerformanceCounter();
+        for (uint32 i = 0; i < RAY_COUNT; i++) {
+            BlockPos b_pos, front_b_pos;
+            const uint8 block = find_block_in_front(state->chunk_map, orgs[i], dirs[i], b_pos, front_b_pos);
+            if (block != hits[i].block || (block > 0 && (b_pos.get_x() != hits[i].b_pos.get_x() || b_pos.get_y() != hits[i].b_pos.get_y() ||
+                                                          b_pos.get_z() != hits[i].b_pos.get_z()))) {
+                mismatches++;
+            }
+        }
+        const uint64 single_end = SDL_GetPerformanceCounter();
+        const uint32 batch_hits = raycast_blocks(state->chunk_map, orgs, dirs, RAY_COUNT, MAX_DIST, hits);
+        const uint64 batch_end = SDL_GetPerformanceCounter();
+
+        const float64 to_us = 1000000.0 / (float64)SDL_GetPerformanceFrequency() / RAY_COUNT;
+        LogDebug("Raycast check: %u rays, %u mismatches with the ray march (grazing corners)\n", RAY_COUNT, mismatches);
+        LogDebug("Ray march: %u hits, %.3f us/ray. Grid traversal: %.3f us/ray. Batched: %u hits, %.3f us/ray\n", march_hits,
+                 (float64)(march_end - march_start) * to_us, (float64)(single_end - march_end) * to_us, batch_hits, (float64)(batch_end - single_end) * to_us);
+        state->scratch_arena.used = scratch_used;
+    }
+    // Block access benchmark with F9: reads the blocks around the player and their neighbors through the chunk map and through an accessor
+    if (controller->button_f9 && !last_controller->button_f9) {
+        constexpr int32 RADIUS = 24;
+        BlockPos player_bpos;
+        pos_to_block_pos(state->player.pos, player_bpos);
+        const int32 player_x = player_bpos.get_x();
+        const int32 player_y = player_bpos.get_y();
+        const int32 player_z = player_bpos.get_z();
+
+        uint32 map_solid = 0;
+        const uint64 map_start = SDL_GetPerformanceCounter();
+        for (int32 x = player_x - RADIUS; x < player_x + RADIUS; x++) {
+            for (int32 y = player_y - RADIUS; y < player_y + RADIUS; y++) {
+                for (int32 z = player_z - RADIUS; z < player_z + RADIUS; z++) {
+                    for (int32 face = 0; face < 6; face++) {
+                        const Vector3f pos = {(float32)(x + FACE_OFFSETS[face][0]), (float32)(y + FACE_OFFSETS[face][1]), (float32)(z + FACE_OFFSETS[face][2])};
+                        map_solid += state->chunk_map.get_block_at_pos(pos) != 0;
+                    }
+                }
+            }
+        }
+        const uint64 map_end = SDL_GetPerformanceCounter();
+        BlockAccessor accessor(&state->chunk_map);
+        uint32 accessor_solid = 0;
+        for (int32 x = player_x - RADIUS; x < player_x + RADIUS; x++) {
+            for (int32 y = player_y - RADIUS; y < player_y + RADIUS; y++) {
+                for (int32 z = player_z - RADIUS; z < player_z + RADIUS; z++) {
+                    for (int32 face = 0; face < 6; face++) {
+                        accessor_solid += accessor.get_neighbor(x, y, z, face) != 0;
+                    }
+                }
+            }
+        }
+        const uint64 accessor_end = SDL_GetPerformanceCounter();
+
+        constexpr float64 QUERY_COUNT = 6.0 * (2 * RADIUS) * (2 * RADIUS) * (2 * RADIUS);
+        const float64 to_ns = 1000000000.0 / (float64)SDL_GetPerformanceFrequency() / QUERY_COUNT;
+        LogDebug("Block access: chunk map %.2f ns/query (%u solid), accessor %.2f ns/query (%u solid)\n", (float64)(map_end - map_start) * to_ns, map_solid,
+                 (float64)(accessor_end - map_end) * to_ns, accessor_solid);
+    }
+#endif
 }
 
-void update(GameState *state, float32 time_delta, ControllerInput *controller, const ControllerInput *last_controller, BlockPos &b_pos_pointing,
-            uint8 &block_pointing, int32 screen_width, int32 screen_height) {
-    handle_f_functions(state, controller, last_controller, screen_width, screen_height);
-    update_player(state, time_delta, controller, last_controller, b_pos_pointing, block_pointing);
+void handle_input(GameState *state, float32 time_delta, ControllerInput *controller, const ControllerInput *last_controller) {
+    handle_f_functions(state, controller, last_controller);
+    update_look(state, time_delta, controller);
+    update_fov(state, time_delta, controller);
+}
+
+void update(GameState *state, float32 time_delta, ControllerInput *controller, const ControllerInput *last_controller) {
+    update_player(state, time_delta, controller, last_controller);
     update_sun(state, time_delta, controller, last_controller);
-    update_particles(state, time_delta);
+#ifdef DEBUG
+    const uint64 particles_start = SDL_GetPerformanceCounter();
+    const uint32 particles_count = state->particles.count;
+#endif
+    state->particles.update(state->chunk_map, time_delta);
+#ifdef DEBUG
+    if (particles_count >= 4096 && state->frame_count % 60 == 0) {
+        const float64 elapsed_ms = (float64)(SDL_GetPerformanceCounter() - particles_start) * 1000.0 / (float64)SDL_GetPerformanceFrequency();
+        LogDebug("Updated %u particles in %.3f ms", particles_count, elapsed_ms);
+    }
+#endif
+#ifdef DEBUG
+    const uint64 entities_start = SDL_GetPerformanceCounter();
+    const uint32 entities_count = state->entities.count;
+#endif
     update_entities(state, time_delta);
-    update_fov(state, time_delta, controller);
+#ifdef DEBUG
+    if (entities_count >= 256 && state->frame_count % 60 == 0) {
+        const float64 elapsed_ms = (float64)(SDL_GetPerformanceCounter() - entities_start) * 1000.0 / (float64)SDL_GetPerformanceFrequency();
+        LogDebug("Updated %u entities in %.3f ms", entities_count, elapsed_ms);
+    }
+#endif
+}
+
+uint8 find_pointed_block(GameState *state, BlockPos &b_pos_pointing) {
+    BlockPos b_pos_front;
+    return find_block_in_front(state->chunk_map, state->player.pos, state->player.direction, b_pos_pointing, b_pos_front);
 }
 }  // namespace Play
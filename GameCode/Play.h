@@ -6,6 +6,9 @@ struct ControllerInput;
 struct BlockPos;
 
 namespace Play {
-void update(GameState *state, float32 time_delta, ControllerInput *controller, const ControllerInput *last_controller, BlockPos &b_pos_pointing,
-            uint8 &block_pointing, int32 screen_width, int32 screen_height);
+// Input that applies to the rendered frame (camera, F keys), run once per frame
+void handle_input(GameState *state, float32 time_delta, ControllerInput *controller, const ControllerInput *last_controller);
+// One fixed simulation step
+void update(GameState *state, float32 time_delta, ControllerInput *controller, const ControllerInput *last_controller);
+uint8 find_pointed_block(GameState *state, BlockPos &b_pos_pointing);
 }
\ No newline at end of file
@@ -0,0 +1,438 @@
+#include "Profiler.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "Config.h"
+#include "Utility.h"
+
+namespace Profiler {
+static constexpr uint32 RING_EVENTS = Config::System::PROFILER_RING_EVENTS;
+static_assert((RING_EVENTS & (RING_EVENTS - 1)) == 0, "The ring indices wrap around, so its size must be a power of two");
+static constexpr uint32 HISTORY_FRAMES = Config::System::HITCH_HISTORY_FRAMES;
+static constexpr uint32 HISTORY_EVENTS = Config::System::HITCH_HISTORY_EVENTS;
+static_assert((HISTORY_FRAMES & (HISTORY_FRAMES - 1)) == 0 && (HISTORY_EVENTS & (HISTORY_EVENTS - 1)) == 0,
+              "The history indices wrap around, so its sizes must be powers of two");
+static_assert(Config::System::HITCH_FRAMES_BEFORE + Config::System::HITCH_FRAMES_AFTER < HISTORY_FRAMES,
+              "The frames saved around a hitch must fit in the history");
+static_assert((Config::System::HITCH_FRAMES_BEFORE + Config::System::HITCH_FRAMES_AFTER + 1) * Config::System::HITCH_FRAME_EVENTS <= HISTORY_EVENTS,
+              "The events of the frames saved around a hitch must fit in the history");
+static constexpr uint32 NO_HITCH = UINT32_MAX;
+
+struct Event {
+    const char *name;
+    uint64 start;  // Performance counter
+    uint64 end;
+};
+
+// Written by one thread and emptied by collect_events. Only the writer moves head and only collect_events moves tail.
+struct Track {
+    char name[32];
+    Event events[RING_EVENTS];
+    std::atomic<uint32> head;
+    std::atomic<uint32> tail;
+    std::atomic<uint32> dropped;
+};
+
+struct HistoryEvent {
+    Event event;
+    uint32 track;
+};
+
+struct FrameTimes {
+    uint64 start;
+    uint64 end;
+    uint64 first_event;  // History events from the collect_events that ended the frame on
+};
+
+// Time spent in a scope itself, without the scopes inside it
+struct ScopeTime {
+    const char *name;
+    uint32 track;
+    uint64 self_ticks;
+    uint32 calls;
+};
+
+std::atomic<bool> is_enabled{false};
+
+static std::filesystem::path base_path;
+static Track tracks[Config::System::PROFILER_MAX_TRACKS];
+static std::atomic<uint32> track_count{0};
+static thread_local Track *thread_track = nullptr;
+static Track *gpu_track = nullptr;
+static float64 ticks_to_us;
+
+static FILE *trace_file = nullptr;
+static std::filesystem::path trace_path;
+static uint64 trace_start;
+static uint32 trace_event_count;
+
+static float32 hitch_budget_ms;
+static HistoryEvent *history_events;
+static uint64 history_event_count;  // Since the start, the ring keeps the last HISTORY_EVENTS
+static uint32 *scope_indices;
+static FrameTimes history_frames[HISTORY_FRAMES];
+static uint32 frame_count;
+static uint64 frame_start;
+static uint32 pending_hitch;  // Frame whose trace is saved once the frames after it are in
+static uint32 hitch_count;
+static uint32 hitch_trace_count;
+
+static uint32 frame_histogram[Config::System::FRAME_HISTOGRAM_BUCKETS];
+static uint32 histogram_frame_count;
+static float32 max_frame_ms;
+
+static Track *add_track(const char *name) {
+    uint32 index = track_count.load();
+    do {
+        if (index == Config::System::PROFILER_MAX_TRACKS) {
+            return nullptr;
+        }
+    } while (!track_count.compare_exchange_weak(index, index + 1));
+
+    Track &track = tracks[index];
+    if (name) {
+        snprintf(track.name, sizeof(track.name), "%s", name);
+    } else {
+        snprintf(track.name, sizeof(track.name), "Thread %u", index);
+    }
+    return &track;
+}
+
+static void push(Track &track, const char *name, const uint64 start, const uint64 end) {
+    const uint32 head = track.head.load(std::memory_order_relaxed);
+    if (head - track.tail.load(std::memory_order_acquire) == RING_EVENTS) {
+        track.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    track.events[head & (RING_EVENTS - 1)] = {name, start, end};
+    track.head.store(head + 1, std::memory_order_release);
+}
+
+static void write_event(FILE *file, const uint64 time_base, uint32 &event_count, const uint32 track_index, const Event &event) {
+    fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", event_count ? ",\n" : "\n", event.name, track_index,
+            (float64)(event.start - time_base) * ticks_to_us, (float64)(event.end - event.start) * ticks_to_us);
+    event_count++;
+}
+
+static void write_thread_names(FILE *file, const uint32 event_count) {
+    const uint32 count = track_count.load(std::memory_order_acquire);
+    for (uint32 i = 0; i < count; i++) {
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", event_count + i ? ",\n" : "\n", i,
+                tracks[i].name);
+    }
+}
+
+static uint64 get_oldest_history_event() { return history_event_count > HISTORY_EVENTS ? history_event_count - HISTORY_EVENTS : 0; }
+
+static void drain_events() {
+    const uint32 count = track_count.load(std::memory_order_acquire);
+    for (uint32 i = 0; i < count; i++) {
+        Track &track = tracks[i];
+        const uint32 head = track.head.load(std::memory_order_acquire);
+        uint32 tail = track.tail.load(std::memory_order_relaxed);
+        for (; tail != head; tail++) {
+            const Event &event = track.events[tail & (RING_EVENTS - 1)];
+            // Scopes that started before the trace are left out
+            if (trace_file && event.start >= trace_start) {
+                write_event(trace_file, trace_start, trace_event_count, i, event);
+            }
+            if (history_events) {
+                history_events[history_event_count++ & (HISTORY_EVENTS - 1)] = {event, i};
+            }
+        }
+        track.tail.store(tail, std::memory_order_release);
+    }
+}
+
+static float32 get_percentile(const uint32 percent) {
+    const uint32 rank = (histogram_frame_count * percent + 99) / 100;
+    uint32 sum = 0;
+    for (uint32 i = 0; i < Config::System::FRAME_HISTOGRAM_BUCKETS; i++) {
+        sum += frame_histogram[i];
+        if (sum >= rank) {
+            return (float32)(i + 1) * Config::System::FRAME_HISTOGRAM_BUCKET_MS;
+        }
+    }
+    return max_frame_ms;
+}
+
+// Splits the time of the frame between the scopes in it. The scopes of a track nest, so sorted by start they are walked as a tree
+// and the time of each scope inside another is taken off its parent.
+static uint32 get_scope_times(const FrameTimes &frame, ScopeTime *scope_times, const uint32 scope_limit) {
+    uint32 *indices = scope_indices;
+    uint32 index_count = 0;
+    // The events of a frame are taken at its end, or later for the GPU passes
+    for (uint64 i = MAX(frame.first_event, get_oldest_history_event()); i < history_event_count; i++) {
+        const HistoryEvent &history_event = history_events[i & (HISTORY_EVENTS - 1)];
+        if (history_event.event.end > frame.start && history_event.event.start < frame.end) {
+            indices[index_count++] = (uint32)(i & (HISTORY_EVENTS - 1));
+        }
+    }
+    std::sort(indices, indices + index_count, [](const uint32 a, const uint32 b) {
+        const HistoryEvent &event_a = history_events[a];
+        const HistoryEvent &event_b = history_events[b];
+        if (event_a.track != event_b.track) {
+            return event_a.track < event_b.track;
+        }
+        if (event_a.event.start != event_b.event.start) {
+            return event_a.event.start < event_b.event.start;
+        }
+        return event_a.event.end > event_b.event.end;
+    });
+
+    constexpr uint32 MAX_DEPTH = 32;
+    uint32 parents[MAX_DEPTH];  // Scope times of the enclosing scopes
+    uint64 parent_ends[MAX_DEPTH];
+    uint32 depth = 0;
+    uint32 scope_count = 0;
+    uint32 track = UINT32_MAX;
+    for (uint32 i = 0; i < index_count; i++) {
+        const HistoryEvent &history_event = history_events[indices[i]];
+        const Event &event = history_event.event;
+        if (history_event.track != track) {
+            track = history_event.track;
+            depth = 0;
+        }
+        while (depth > 0 && parent_ends[depth - 1] <= event.start) {
+            depth--;
+        }
+
+        uint32 scope = 0;
+        while (scope < scope_count && (scope_times[scope].track != track || strcmp(scope_times[scope].name, event.name) != 0)) {
+            scope++;
+        }
+        if (scope == scope_count) {
+            if (scope_count == scope_limit) {
+                continue;
+            }
+            scope_times[scope_count++] = {event.name, track, 0, 0};
+        }
+        const uint64 ticks = MIN(event.end, frame.end) - MAX(event.start, frame.start);
+        scope_times[scope].self_ticks += ticks;
+        scope_times[scope].calls++;
+        if (depth > 0) {
+            scope_times[parents[depth - 1]].self_ticks -= ticks;
+        }
+        if (depth < MAX_DEPTH) {
+            parents[depth] = scope;
+            parent_ends[depth] = event.end;
+            depth++;
+        }
+    }
+    std::sort(scope_times, scope_times + scope_count, [](const ScopeTime &a, const ScopeTime &b) { return a.self_ticks > b.self_ticks; });
+    return scope_count;
+}
+
+static void save_hitch_trace(const uint32 hitch) {
+    const uint32 first = hitch > Config::System::HITCH_FRAMES_BEFORE ? hitch - Config::System::HITCH_FRAMES_BEFORE : 0;
+    const FrameTimes &hitch_frame = history_frames[hitch & (HISTORY_FRAMES - 1)];
+    const FrameTimes &first_frame = history_frames[first & (HISTORY_FRAMES - 1)];
+    const uint64 window_start = first_frame.start;
+    const uint64 window_end = history_frames[(frame_count - 1) & (HISTORY_FRAMES - 1)].end;
+    const float32 hitch_ms = (float32)((float64)(hitch_frame.end - hitch_frame.start) * ticks_to_us / 1000.0);
+
+    char timestamp[32];
+    format_timestamp(timestamp, sizeof(timestamp));
+    const std::filesystem::path hitch_dir = base_path / "hitches";
+    std::error_code error;
+    std::filesystem::create_directories(hitch_dir, error);
+    const std::filesystem::path path = hitch_dir / (std::string("hitch_") + timestamp + ".json");
+    FILE *file = fopen(path.string().c_str(), "wb");
+    if (!file) {
+        LogError("Could not create the hitch trace %s", path.string().c_str());
+        return;
+    }
+
+    fputs("{\"traceEvents\":[", file);
+    uint32 event_count = 0;
+    const uint64 window_first_event = first_frame.first_event;
+    const uint64 oldest = get_oldest_history_event();
+    const bool is_truncated = window_first_event < oldest;
+    for (uint64 i = MAX(window_first_event, oldest); i < history_event_count; i++) {
+        const HistoryEvent &history_event = history_events[i & (HISTORY_EVENTS - 1)];
+        if (history_event.event.start >= window_start && history_event.event.start < window_end) {
+            write_event(file, window_start, event_count, history_event.track, history_event.event);
+        }
+    }
+    const Event hitch_event = {"Hitch", hitch_frame.start, hitch_frame.end};
+    write_event(file, window_start, event_count, Config::System::PROFILER_MAX_TRACKS, hitch_event);
+    write_thread_names(file, event_count);
+    fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"Hitch\"}}",
+            Config::System::PROFILER_MAX_TRACKS);
+
+    // The self times of the slow frame go into the metadata of the trace and the log
+    constexpr uint32 SCOPE_LIMIT = 64;
+    ScopeTime scope_times[SCOPE_LIMIT];
+    const uint32 scope_count = get_scope_times(hitch_frame, scope_times, SCOPE_LIMIT);
+    fprintf(file, "\n],\"otherData\":{\"frame_ms\":\"%.2f\",\"budget_ms\":\"%.2f\"", hitch_ms, hitch_budget_ms);
+    if (is_truncated) {
+        fprintf(file, ",\"truncated\":\"%llu events overwritten\"", (unsigned long long)(oldest - window_first_event));
+    }
+    for (uint32 i = 0; i < scope_count; i++) {
+        fprintf(file, ",\"%s/%s\":\"%.3f ms in %u\"", tracks[scope_times[i].track].name, scope_times[i].name,
+                (float64)scope_times[i].self_ticks * ticks_to_us / 1000.0, scope_times[i].calls);
+    }
+    fputs("}}\n", file);
+    fclose(file);
+
+    LogWarn("Hitch of %.1f ms over the %.1f ms budget, trace saved to %s", hitch_ms, hitch_budget_ms, path.string().c_str());
+    if (is_truncated) {
+        LogWarn("    The history ran out, the first %llu events of the trace are missing", (unsigned long long)(oldest - window_first_event));
+    }
+    for (uint32 i = 0; i < MIN(scope_count, 5u); i++) {
+        LogWarn("    %s/%s: %.2f ms in %u", tracks[scope_times[i].track].name, scope_times[i].name,
+                (float64)scope_times[i].self_ticks * ticks_to_us / 1000.0, scope_times[i].calls);
+    }
+}
+
+// Returns whether a hitch trace was saved, which takes a while itself
+static bool end_frame(const uint64 end, const uint64 first_event) {
+    const float32 frame_ms = (float32)((float64)(end - frame_start) * ticks_to_us / 1000.0);
+    const uint32 bucket = (uint32)(frame_ms / Config::System::FRAME_HISTOGRAM_BUCKET_MS);
+    if (bucket < Config::System::FRAME_HISTOGRAM_BUCKETS) {
+        frame_histogram[bucket]++;
+    }
+    histogram_frame_count++;
+    max_frame_ms = MAX(max_frame_ms, frame_ms);
+
+    if (!history_events) {
+        return false;
+    }
+    const uint32 frame = frame_count++;
+    history_frames[frame & (HISTORY_FRAMES - 1)] = {frame_start, end, first_event};
+    if (frame_ms > hitch_budget_ms) {
+        hitch_count++;
+        if (pending_hitch == NO_HITCH && hitch_trace_count < Config::System::HITCH_TRACE_LIMIT) {
+            pending_hitch = frame;
+        }
+    }
+    if (pending_hitch != NO_HITCH && frame == pending_hitch + Config::System::HITCH_FRAMES_AFTER) {
+        save_hitch_trace(pending_hitch);
+        hitch_trace_count++;
+        pending_hitch = NO_HITCH;
+        return true;
+    }
+    return false;
+}
+
+void initialize(const std::filesystem::path &save_path, const float32 budget_ms) {
+    base_path = save_path;
+    ticks_to_us = 1000000.0 / (float64)SDL_GetPerformanceFrequency();
+    set_thread_name("Main");
+    if (!gpu_track) {
+        gpu_track = add_track("GPU");
+    }
+
+    hitch_budget_ms = budget_ms;
+    if (hitch_budget_ms > 0.0f) {
+        history_events = (HistoryEvent *)SDL_malloc(HISTORY_EVENTS * sizeof(HistoryEvent));
+        scope_indices = (uint32 *)SDL_malloc(HISTORY_EVENTS * sizeof(uint32));
+        if (!history_events || !scope_indices) {
+            LogError("Could not allocate the hitch history, the hitch monitor is off");
+            SDL_free(history_events);
+            SDL_free(scope_indices);
+            history_events = nullptr;
+            scope_indices = nullptr;
+            hitch_budget_ms = 0.0f;
+        }
+    }
+    history_event_count = 0;
+    frame_start = 0;
+    pending_hitch = NO_HITCH;
+    is_enabled = hitch_budget_ms > 0.0f || trace_file;
+}
+
+void finalize() {
+    if (trace_file) {
+        switch_trace();
+    }
+    SDL_free(history_events);
+    SDL_free(scope_indices);
+    history_events = nullptr;
+    scope_indices = nullptr;
+    if (histogram_frame_count == 0) {
+        return;
+    }
+    LogInfo("Frame times of %u frames: p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms", histogram_frame_count, get_percentile(50),
+            get_percentile(95), get_percentile(99), max_frame_ms);
+    if (hitch_budget_ms > 0.0f) {
+        LogInfo("%u frames over the %.1f ms hitch budget, %u traces saved to %s", hitch_count, hitch_budget_ms, hitch_trace_count,
+                (base_path / "hitches").string().c_str());
+    }
+}
+
+void set_thread_name(const char *name) {
+    if (!thread_track) {
+        thread_track = add_track(name);
+    } else {
+        snprintf(thread_track->name, sizeof(thread_track->name), "%s", name);
+    }
+}
+
+void record(const char *name, const uint64 start, const uint64 end) {
+    if (!thread_track) {
+        thread_track = add_track(nullptr);
+        if (!thread_track) {
+            return;
+        }
+    }
+    push(*thread_track, name, start, end);
+}
+
+void record_gpu(const char *name, const uint64 start, const uint64 end) {
+    if (gpu_track) {
+        push(*gpu_track, name, start, end);
+    }
+}
+
+void collect_events() {
+    const uint64 now = SDL_GetPerformanceCounter();
+    const uint64 first_event = history_event_count;
+    drain_events();
+    // The first frame starts here
+    if (frame_start == 0) {
+        frame_start = now;
+        return;
+    }
+    // Saving a hitch trace is left out of the next frame, or it would count as a hitch of its own
+    frame_start = end_frame(now, first_event) ? SDL_GetPerformanceCounter() : now;
+}
+
+void switch_trace() {
+    if (trace_file) {
+        is_enabled = hitch_budget_ms > 0.0f;
+        drain_events();
+        write_thread_names(trace_file, trace_event_count);
+        uint32 dropped = 0;
+        const uint32 count = track_count.load(std::memory_order_acquire);
+        for (uint32 i = 0; i < count; i++) {
+            dropped += tracks[i].dropped.exchange(0);
+        }
+        fputs("\n]}\n", trace_file);
+        fclose(trace_file);
+        trace_file = nullptr;
+        LogInfo("Trace of %u events saved to %s, %u dropped", trace_event_count, trace_path.string().c_str(), dropped);
+        return;
+    }
+
+    char timestamp[32];
+    format_timestamp(timestamp, sizeof(timestamp));
+    const std::filesystem::path trace_dir = base_path / "traces";
+    std::error_code error;
+    std::filesystem::create_directories(trace_dir, error);
+    trace_path = trace_dir / (std::string("trace_") + timestamp + ".json");
+    trace_file = fopen(trace_path.string().c_str(), "wb");
+    if (!trace_file) {
+        LogError("Could not create the trace %s", trace_path.string().c_str());
+        return;
+    }
+    fputs("{\"traceEvents\":[", trace_file);
+    trace_start = SDL_GetPerformanceCounter();
+    trace_event_count = 0;
+    is_enabled = true;
+    LogInfo("Tracing to %s", trace_path.string().c_str());
+}
+}  // namespace Profiler
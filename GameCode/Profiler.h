@@ -0,0 +1,45 @@
+#pragma once
+#include <SDL_timer.h>
+
+#include <atomic>
+#include <filesystem>
+
+#include "Definitions.h"
+
+// Timing scopes of the hot paths. Each thread records into a ring of its own without locks, and the rings are emptied once per frame
+// into a Chrome trace (chrome://tracing or ui.perfetto.dev) while one is running. While nothing records, a scope costs one branch.
+//
+// The hitch monitor keeps the events of the last frames, and saves the frames around one slower than the budget as a trace of its own.
+namespace Profiler {
+extern std::atomic<bool> is_enabled;
+
+// A hitch budget of 0 turns the hitch monitor off
+void initialize(const std::filesystem::path &save_path, float32 hitch_budget_ms);
+// Logs the frame time percentiles and hitches
+void finalize();
+// Names the track of the calling thread in the trace
+void set_thread_name(const char *name);
+// name must outlive the trace, a string literal
+void record(const char *name, uint64 start, uint64 end);
+// GPU passes, with their times converted to the performance counter
+void record_gpu(const char *name, uint64 start, uint64 end);
+// Takes the events recorded since the last call and ends the frame, on the main thread once per frame
+void collect_events();
+void switch_trace();
+
+struct Scope {
+    const char *name;
+    uint64 start;
+
+    explicit Scope(const char *name) : name(name), start(is_enabled.load(std::memory_order_relaxed) ? SDL_GetPerformanceCounter() : 0) {}
+    ~Scope() {
+        if (start != 0) {
+            record(name, start, SDL_GetPerformanceCounter());
+        }
+    }
+};
+}  // namespace Profiler
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) const Profiler::Scope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
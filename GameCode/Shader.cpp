@@ -126,6 +126,18 @@ void MainShader::init_uniform_locations() {
     cascade_ends_loc = get_uniform_loc("cascadeEnds");
     shadow_map_loc = get_uniform_loc("shadowMap");
     shadow_map_enabled_loc = get_uniform_loc("shadowMapEnabled");
+    shadow_bias_loc = get_uniform_loc("shadowBias");
+}
+
+void DepthShader::initialize(const char *vertex_source, const char *fragment_source) {
+    Shader::initialize(vertex_source, fragment_source);
+    init_uniform_locations();
+}
+
+void DepthShader::init_uniform_locations() {
+    model_loc = get_uniform_loc("model");
+    view_loc = get_uniform_loc("view");
+    projection_loc = get_uniform_loc("projection");
 }
 
 void StarShader::initialize(const char *vertex_source, const char *fragment_source) {
@@ -142,14 +154,27 @@ void StarShader::init_uniform_locations() {
     star_visibility_loc = get_uniform_loc("starVisibility");
 }
 
-void ShadowMapShader::initialize(const char *vertex_source, const char *fragment_source) {
-    Shader::initialize(vertex_source, fragment_source);
+void ShadowMapShader::initialize(const char *vertex_source, const char *geometry_source, const char *fragment_source) {
+    Shader::initialize(vertex_source, geometry_source, fragment_source);
     init_uniform_locations();
 }
 
 void ShadowMapShader::init_uniform_locations() {
     model_loc = get_uniform_loc("model");
-    sun_space_matrix_loc = get_uniform_loc("sunSpaceMatrix");
+    sun_space_matrices_loc = get_uniform_loc("sunSpaceMatrices");
+    cascade_mask_loc = get_uniform_loc("cascadeMask");
+    cascade_extents_loc = get_uniform_loc("cascadeExtents");
+}
+
+void PostProcessShader::initialize(const char *vertex_source, const char *fragment_source) {
+    Shader::initialize(vertex_source, fragment_source);
+    init_uniform_locations();
+}
+
+void PostProcessShader::init_uniform_locations() {
+    scene_color_loc = get_uniform_loc("sceneColor");
+    texel_size_loc = get_uniform_loc("texelSize");
+    uv_scale_loc = get_uniform_loc("uvScale");
 }
 
 void DebugDepthMapShader::initialize(const char *vertex_source, const char *fragment_source) {
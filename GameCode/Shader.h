@@ -32,6 +32,16 @@ struct MainShader : Shader {
     int32 cascade_ends_loc;
     int32 shadow_map_loc;
     int32 shadow_map_enabled_loc;
+    int32 shadow_bias_loc;
+};
+
+struct DepthShader : Shader {
+    void initialize(const char *vertex_source, const char *fragment_source);
+    void init_uniform_locations();
+
+    int32 model_loc;
+    int32 view_loc;
+    int32 projection_loc;
 };
 
 struct StarShader : Shader {
@@ -46,12 +56,25 @@ struct StarShader : Shader {
     int32 star_visibility_loc;
 };
 
+// Renders into all shadow cascade layers at once, through a geometry shader
 struct ShadowMapShader : Shader {
-    void initialize(const char *vertex_source, const char *fragment_source);
+    void initialize(const char *vertex_source, const char *geometry_source, const char *fragment_source);
     void init_uniform_locations();
 
     int32 model_loc;
-    int32 sun_space_matrix_loc;
+    int32 sun_space_matrices_loc;
+    int32 cascade_mask_loc;
+    int32 cascade_extents_loc;
+};
+
+// Full-screen pass over the offscreen scene color
+struct PostProcessShader : Shader {
+    void initialize(const char *vertex_source, const char *fragment_source);
+    void init_uniform_locations();
+
+    int32 scene_color_loc;
+    int32 texel_size_loc;
+    int32 uv_scale_loc;
 };
 
 struct DebugDepthMapShader : Shader {
@@ -71,7 +71,7 @@ void initialize() {
     initialize_frustum(vao_light_frustum, vbo_light_frustum, ebo_light_frustum);
 }
 
-void draw_debug_shadow_maps(int32 window_width, int32 window_height, const uint32 *depth_maps) {
+void draw_debug_shadow_maps(int32 window_width, int32 window_height, const uint32 depth_map_array) {
     // Save current viewport
     GLint viewport[4];
     glGetIntegerv(GL_VIEWPORT, viewport);
@@ -82,18 +82,24 @@ void draw_debug_shadow_maps(int32 window_width, int32 window_height, const uint3
     const int debug_width = window_width / 4;
     const int debug_height = window_height / 4;
 
+    // The depth values are read directly, instead of being compared like in the scene shader
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, depth_map_array);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+
     // Render each cascade level
     for (int i = 0; i < 3; i++) {
         constexpr int PADDING = 10;
         glViewport(PADDING + i * (debug_width + PADDING), window_height - debug_height - PADDING, debug_width, debug_height);
 
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, depth_maps[i]);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, depth_map_array);
         glUniform1i(debug_depth_shader.depth_map_loc, 0);
         glUniform1i(debug_depth_shader.cascade_level_loc, i);
 
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
     }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
 
     // Restore original viewport
     glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
@@ -0,0 +1,189 @@
+#include "Simulation.h"
+
+#include <SDL_mutex.h>
+#include <SDL_stdinc.h>
+#include <SDL_thread.h>
+
+#include "Play.h"
+#include "Profiler.h"
+
+namespace Simulation {
+static constexpr uint32 INSTANCE_CAPACITY = Config::Game::ENTITY_LIMIT + Config::Game::PARTICLE_LIMIT;
+
+static bool is_initialized = false;
+static GameState *game_state;
+
+static RenderSnapshot snapshots[2];
+static uint32 front = 0;  // Snapshot being drawn, the simulation builds the other one
+
+// The main thread sets is_running with the input of a frame and the thread clears it when the snapshot is built, both under the mutex
+static ControllerInput frame_controller;
+static ControllerInput last_step_controller;
+static float32 frame_time;
+static bool is_running;
+static bool is_quitting;
+static SDL_mutex *mutex;
+static SDL_cond *cond;
+static SDL_Thread *thread;
+
+// Transforms are interpolated between the last two simulation steps
+static void build_snapshot(RenderSnapshot &snapshot) {
+    const GameState *state = game_state;
+    const float32 alpha = state->simulation.alpha;
+    const Player &player = state->player;
+    snapshot.camera_pos = state->simulation.player_prev_pos + (player.pos - state->simulation.player_prev_pos) * alpha;
+    snapshot.camera_direction = player.direction;
+    snapshot.fov = player.fov;
+    snapshot.yaw = player.yaw;
+    snapshot.throw_mode = player.throw_mode;
+    snapshot.selected_block = player.selected_block;
+    snapshot.sun = state->sun;
+    snapshot.block_pointing = Play::find_pointed_block(game_state, snapshot.b_pos_pointing);
+
+    uint32 count = 0;
+    const EntityStore &entities = state->entities;
+    for (uint32 i = 0; i < entities.count; i++) {
+        RenderInstance &instance = snapshot.instances[count++];
+        instance.pos = entities.prev_pos[i] + (entities.pos[i] - entities.prev_pos[i]) * alpha;
+        instance.rotation = glm::slerp(entities.prev_rotation[i], entities.rotation[i], alpha);
+        instance.scale = 1.0f;
+        instance.color = entities.color[i];
+    }
+    snapshot.entity_count = count;
+
+    const ParticleSystem &particles = state->particles;
+    for (uint32 i = 0; i < particles.count; i++) {
+        // A step turns the particles only a little, so a normalized linear blend is close enough to a slerp
+        const glm::quat prev_rotation(particles.prev_rot_w[i], particles.prev_rot_x[i], particles.prev_rot_y[i], particles.prev_rot_z[i]);
+        const glm::quat rotation(particles.rot_w[i], particles.rot_x[i], particles.rot_y[i], particles.rot_z[i]);
+        RenderInstance &instance = snapshot.instances[count++];
+        instance.pos = {particles.prev_pos_x[i] + (particles.pos_x[i] - particles.prev_pos_x[i]) * alpha,
+                        particles.prev_pos_y[i] + (particles.pos_y[i] - particles.prev_pos_y[i]) * alpha,
+                        particles.prev_pos_z[i] + (particles.pos_z[i] - particles.prev_pos_z[i]) * alpha};
+        instance.rotation = glm::normalize(prev_rotation + (rotation - prev_rotation) * alpha);
+        instance.scale = particles.scale[i];
+        instance.color = {particles.color_r[i], particles.color_g[i], particles.color_b[i]};
+    }
+    snapshot.instance_count = count;
+}
+
+// Fixed simulation steps for the elapsed time. After a hitch, the time beyond the step limit is dropped instead of being simulated
+// in a burst that would make the next frame slow too.
+static void simulate_frame() {
+    PROFILE_SCOPE("Simulation");
+    constexpr float32 STEP = Config::Game::SIMULATION_STEP;
+    SimulationClock &simulation = game_state->simulation;
+    simulation.accumulator += frame_time;
+    uint32 step_count = 0;
+    while (simulation.accumulator >= STEP) {
+        if (step_count == Config::Game::MAX_SIMULATION_STEPS) {
+            LogDebug("Simulation is behind, dropped %.1f ms", (simulation.accumulator - fmodf(simulation.accumulator, STEP)) * 1000.0f);
+            simulation.accumulator = fmodf(simulation.accumulator, STEP);
+            break;
+        }
+        Play::update(game_state, STEP, &frame_controller, &last_step_controller);
+        // Button presses start on the first step after them
+        last_step_controller = frame_controller;
+        simulation.accumulator -= STEP;
+        step_count++;
+    }
+    simulation.alpha = simulation.accumulator / STEP;
+    build_snapshot(snapshots[1 - front]);
+}
+
+static void wait_for_frame() {
+    if (!thread) {
+        return;
+    }
+    SDL_LockMutex(mutex);
+    while (is_running) {
+        SDL_CondWait(cond, mutex);
+    }
+    SDL_UnlockMutex(mutex);
+}
+
+static int worker(void *) {
+    Profiler::set_thread_name("Simulation");
+    SDL_LockMutex(mutex);
+    while (true) {
+        while (!is_running && !is_quitting) {
+            SDL_CondWait(cond, mutex);
+        }
+        if (is_quitting) {
+            break;
+        }
+
+        SDL_UnlockMutex(mutex);
+        simulate_frame();
+        SDL_LockMutex(mutex);
+
+        is_running = false;
+        SDL_CondBroadcast(cond);
+    }
+    SDL_UnlockMutex(mutex);
+    return 0;
+}
+
+void initialize(GameState *state) {
+    game_state = state;
+    for (RenderSnapshot &snapshot : snapshots) {
+        snapshot.instances = (RenderInstance *)SDL_malloc(INSTANCE_CAPACITY * sizeof(RenderInstance));
+    }
+    front = 0;
+    build_snapshot(snapshots[front]);
+
+    is_running = false;
+    is_quitting = false;
+    mutex = SDL_CreateMutex();
+    cond = SDL_CreateCond();
+    // Without the thread, frames are simulated on the main thread in start_frame
+    thread = SDL_CreateThread(worker, "Simulation", nullptr);
+    if (!thread) {
+        LogError("Could not create the simulation thread: %s", SDL_GetError());
+    }
+    is_initialized = true;
+}
+
+void finalize() {
+    if (!is_initialized) {
+        return;
+    }
+    wait_for_frame();
+    if (thread) {
+        SDL_LockMutex(mutex);
+        is_quitting = true;
+        SDL_CondBroadcast(cond);
+        SDL_UnlockMutex(mutex);
+        SDL_WaitThread(thread, nullptr);
+        thread = nullptr;
+    }
+
+    SDL_DestroyCond(cond);
+    SDL_DestroyMutex(mutex);
+    for (RenderSnapshot &snapshot : snapshots) {
+        SDL_free(snapshot.instances);
+        snapshot.instances = nullptr;
+    }
+    is_initialized = false;
+}
+
+void start_frame(const ControllerInput &controller, const float32 time_delta) {
+    frame_controller = controller;
+    frame_time = time_delta;
+    if (!thread) {
+        simulate_frame();
+        return;
+    }
+    SDL_LockMutex(mutex);
+    is_running = true;
+    SDL_CondBroadcast(cond);
+    SDL_UnlockMutex(mutex);
+}
+
+void finish_frame() {
+    wait_for_frame();
+    front = 1 - front;
+}
+
+const RenderSnapshot &get_render_snapshot() { return snapshots[front]; }
+}  // namespace Simulation
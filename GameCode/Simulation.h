@@ -0,0 +1,43 @@
+#pragma once
+#include <glm/gtc/quaternion.hpp>
+
+#include "GameBase.h"
+
+// A cube drawn by the instanced passes, with its transform interpolated for the frame
+struct RenderInstance {
+    Vector3f pos;
+    glm::quat rotation;
+    float32 scale;
+    Vector3f color;
+};
+
+// What the renderer needs of the simulated world for one frame. It is built by the simulation thread after its steps and
+// not changed while it is drawn.
+struct RenderSnapshot {
+    Vector3f camera_pos;  // Interpolated player position
+    Vector3f camera_direction;
+    float32 fov;
+    float32 yaw;
+    bool throw_mode;
+    int32 selected_block;
+    Sun sun;
+    uint8 block_pointing;
+    BlockPos b_pos_pointing;
+    uint32 entity_count;    // Entities come first in instances, then particles
+    uint32 instance_count;
+    RenderInstance *instances;
+};
+
+// Runs the fixed simulation steps of a frame on a thread of their own, while the main thread draws the snapshot of the previous frame.
+//
+// While the simulation runs, the main thread owns the GL objects, the chunk meshes and the visible and nearby chunk lists, and the
+// simulation owns everything else in GameState. The chunk map is only filled, meshed and culled between finish_frame and start_frame.
+namespace Simulation {
+void initialize(GameState *state);
+void finalize();
+// Starts simulating the time of a frame with the input handled so far
+void start_frame(const ControllerInput &controller, float32 time_delta);
+// Waits for the simulation and makes the snapshot it built the one to draw
+void finish_frame();
+const RenderSnapshot &get_render_snapshot();
+}  // namespace Simulation
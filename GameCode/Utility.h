@@ -2,7 +2,14 @@
 
 #include "Definitions.h"
 
+#include <chrono>
+#include <ctime>
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 inline float32 rand_float() { return ((float32)(rand() % 1024) / 1024.f); }
 
@@ -14,8 +21,40 @@ inline float32 lin2exp(float32 x, const bool inv = false) {
     return 1 - pow(E32, (1 - 1 / (x * x + 0.000001f)));
 }
 
+// floorf without the library call
+inline int32 fast_floor(const float32 value) {
+    const int32 truncated = (int32)value;
+    return truncated - (value < (float32)truncated);
+}
+
+// Index of the lowest set bit, value must not be 0
+inline int32 count_trailing_zeros(const uint32 value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (int32)index;
+#else
+    return __builtin_ctz(value);
+#endif
+}
+
 inline int32 mod(const int32 a, const int32 b) {
     int32 ret = a % b;
     if (ret < 0) ret += b;
     return ret;
 }
+
+// Local time with milliseconds for file names, e.g. 2024-05-01_18-30-05_123
+inline void format_timestamp(char *buffer, const size_t size) {
+    const auto now = std::chrono::system_clock::now();
+    const std::time_t seconds = std::chrono::system_clock::to_time_t(now);
+    const int32 milliseconds = (int32)(std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000);
+    std::tm local_time;
+#ifdef _WIN32
+    localtime_s(&local_time, &seconds);
+#else
+    localtime_r(&seconds, &local_time);
+#endif
+    const size_t length = strftime(buffer, size, "%Y-%m-%d_%H-%M-%S", &local_time);
+    snprintf(buffer + length, size - length, "_%03d", milliseconds);
+}
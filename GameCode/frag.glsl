@@ -12,7 +12,7 @@ in float mist;
 in vec4 fragPosSunSpace[NUM_CASCADES];
 in float clipSpacePosZ;
 
-uniform sampler2D shadowMap[NUM_CASCADES];
+uniform sampler2DArrayShadow shadowMap;
 
 uniform float ambientBase;
 uniform vec3 sunColor;
@@ -24,15 +24,16 @@ uniform float diffuseStrength;
 uniform float specularStrength;
 uniform float cascadeEnds[NUM_CASCADES];
 uniform bool shadowMapEnabled;
+uniform float shadowBias;
 
 float ShadowCalculation(int CascadeIndex, vec4 fragPosSunSpace) {
   vec3 projCoords = fragPosSunSpace.xyz;
   projCoords = projCoords * 0.5 + 0.5; // converting -1,1 -> 0,1
 
-  float bias = max(0.00001 * (1.0 - dot(normal, normalize(sunPos))), 0.000001);
-  float closestDepth = texture(shadowMap[CascadeIndex], projCoords.xy).r;
+  float bias = max(shadowBias * (1.0 - dot(normal, normalize(sunPos))), shadowBias * 0.1);
   float currentDepth = projCoords.z;
-  float shadow = currentDepth - bias > closestDepth ? 1.0 : 0.0;
+  // Hardware comparison, returns how lit the fragment is
+  float shadow = 1.0 - texture(shadowMap, vec4(projCoords.xy, CascadeIndex, currentDepth - bias));
 
   // Handle edge cases
   if (projCoords.z > 1.0) {
@@ -3,11 +3,11 @@ out vec4 FragColor;
 
 in vec2 TexCoords;
 
-uniform sampler2D depthMap;
+uniform sampler2DArray depthMap;
 uniform int cascadeLevel;
 
 void main() {
-  float depthValue = texture(depthMap, TexCoords).r;
+  float depthValue = texture(depthMap, vec3(TexCoords, cascadeLevel)).r;
 
   // Visualize different cascades with different colors
   vec3 cascadeColors[3] =
@@ -0,0 +1,122 @@
+// FXAA post-process, after FXAA 3.11 by Timothy Lottes. Edges are found by luma contrast, searched along to both ends,
+// and each pixel on them is blended across the edge by how close it is to the nearer end.
+#version 330 core
+in vec2 texCoords;
+out vec4 FragColor;
+
+uniform sampler2D sceneColor;
+uniform vec2 texelSize;
+
+const float EDGE_THRESHOLD_MIN = 0.0312;
+const float EDGE_THRESHOLD_MAX = 0.125;
+const float SUBPIXEL_QUALITY = 0.75;
+const int SEARCH_STEPS = 10;
+const float STEP_SIZES[SEARCH_STEPS] = float[](1.0, 1.0, 1.0, 1.0, 1.5, 2.0, 2.0, 2.0, 4.0, 8.0);
+
+float luma(vec3 color) { return sqrt(dot(color, vec3(0.299, 0.587, 0.114))); }
+
+float sampleLuma(vec2 uv) { return luma(textureLod(sceneColor, uv, 0.0).rgb); }
+
+void main() {
+  vec3 colorCenter = textureLod(sceneColor, texCoords, 0.0).rgb;
+  float lumaCenter = luma(colorCenter);
+  float lumaDown = luma(textureLodOffset(sceneColor, texCoords, 0.0, ivec2(0, -1)).rgb);
+  float lumaUp = luma(textureLodOffset(sceneColor, texCoords, 0.0, ivec2(0, 1)).rgb);
+  float lumaLeft = luma(textureLodOffset(sceneColor, texCoords, 0.0, ivec2(-1, 0)).rgb);
+  float lumaRight = luma(textureLodOffset(sceneColor, texCoords, 0.0, ivec2(1, 0)).rgb);
+
+  float lumaMin = min(lumaCenter, min(min(lumaDown, lumaUp), min(lumaLeft, lumaRight)));
+  float lumaMax = max(lumaCenter, max(max(lumaDown, lumaUp), max(lumaLeft, lumaRight)));
+  float lumaRange = lumaMax - lumaMin;
+  if (lumaRange < max(EDGE_THRESHOLD_MIN, lumaMax * EDGE_THRESHOLD_MAX)) {
+    FragColor = vec4(colorCenter, 1.0);
+    return;
+  }
+
+  float lumaDownLeft = luma(textureLodOffset(sceneColor, texCoords, 0.0, ivec2(-1, -1)).rgb);
+  float lumaUpRight = luma(textureLodOffset(sceneColor, texCoords, 0.0, ivec2(1, 1)).rgb);
+  float lumaUpLeft = luma(textureLodOffset(sceneColor, texCoords, 0.0, ivec2(-1, 1)).rgb);
+  float lumaDownRight = luma(textureLodOffset(sceneColor, texCoords, 0.0, ivec2(1, -1)).rgb);
+
+  float lumaDownUp = lumaDown + lumaUp;
+  float lumaLeftRight = lumaLeft + lumaRight;
+  float lumaLeftCorners = lumaDownLeft + lumaUpLeft;
+  float lumaDownCorners = lumaDownLeft + lumaDownRight;
+  float lumaRightCorners = lumaDownRight + lumaUpRight;
+  float lumaUpCorners = lumaUpRight + lumaUpLeft;
+
+  // Whether the edge runs horizontally or vertically
+  float edgeHorizontal = abs(-2.0 * lumaLeft + lumaLeftCorners) + abs(-2.0 * lumaCenter + lumaDownUp) * 2.0 + abs(-2.0 * lumaRight + lumaRightCorners);
+  float edgeVertical = abs(-2.0 * lumaUp + lumaUpCorners) + abs(-2.0 * lumaCenter + lumaLeftRight) * 2.0 + abs(-2.0 * lumaDown + lumaDownCorners);
+  bool isHorizontal = edgeHorizontal >= edgeVertical;
+
+  // Which side of the pixel the edge is on
+  float luma1 = isHorizontal ? lumaDown : lumaLeft;
+  float luma2 = isHorizontal ? lumaUp : lumaRight;
+  float gradient1 = luma1 - lumaCenter;
+  float gradient2 = luma2 - lumaCenter;
+  bool is1Steepest = abs(gradient1) >= abs(gradient2);
+  float gradientScaled = 0.25 * max(abs(gradient1), abs(gradient2));
+
+  float stepLength = isHorizontal ? texelSize.y : texelSize.x;
+  float lumaLocalAverage;
+  if (is1Steepest) {
+    stepLength = -stepLength;
+    lumaLocalAverage = 0.5 * (luma1 + lumaCenter);
+  } else {
+    lumaLocalAverage = 0.5 * (luma2 + lumaCenter);
+  }
+
+  // Searching along the edge for both of its ends, where the luma differs from the edge's average
+  vec2 edgeUv = texCoords;
+  vec2 offset;
+  if (isHorizontal) {
+    edgeUv.y += stepLength * 0.5;
+    offset = vec2(texelSize.x, 0.0);
+  } else {
+    edgeUv.x += stepLength * 0.5;
+    offset = vec2(0.0, texelSize.y);
+  }
+  vec2 uv1 = edgeUv - offset;
+  vec2 uv2 = edgeUv + offset;
+  float lumaEnd1 = sampleLuma(uv1) - lumaLocalAverage;
+  float lumaEnd2 = sampleLuma(uv2) - lumaLocalAverage;
+  bool reached1 = abs(lumaEnd1) >= gradientScaled;
+  bool reached2 = abs(lumaEnd2) >= gradientScaled;
+  for (int i = 1; i < SEARCH_STEPS && !(reached1 && reached2); i++) {
+    if (!reached1) {
+      uv1 -= offset * STEP_SIZES[i];
+      lumaEnd1 = sampleLuma(uv1) - lumaLocalAverage;
+      reached1 = abs(lumaEnd1) >= gradientScaled;
+    }
+    if (!reached2) {
+      uv2 += offset * STEP_SIZES[i];
+      lumaEnd2 = sampleLuma(uv2) - lumaLocalAverage;
+      reached2 = abs(lumaEnd2) >= gradientScaled;
+    }
+  }
+
+  float distance1 = isHorizontal ? texCoords.x - uv1.x : texCoords.y - uv1.y;
+  float distance2 = isHorizontal ? uv2.x - texCoords.x : uv2.y - texCoords.y;
+  bool isDirection1 = distance1 < distance2;
+  float pixelOffset = 0.5 - min(distance1, distance2) / (distance1 + distance2);
+
+  // Only blended if the nearer end varies the same way as the pixel
+  bool isLumaCenterSmaller = lumaCenter < lumaLocalAverage;
+  bool correctVariation = ((isDirection1 ? lumaEnd1 : lumaEnd2) < 0.0) != isLumaCenterSmaller;
+  float finalOffset = correctVariation ? pixelOffset : 0.0;
+
+  // Sub-pixel aliasing, for details thinner than a pixel
+  float lumaAverage = (2.0 * (lumaDownUp + lumaLeftRight) + lumaLeftCorners + lumaRightCorners) / 12.0;
+  float subPixelOffset = clamp(abs(lumaAverage - lumaCenter) / lumaRange, 0.0, 1.0);
+  subPixelOffset = (-2.0 * subPixelOffset + 3.0) * subPixelOffset * subPixelOffset;
+  finalOffset = max(finalOffset, subPixelOffset * subPixelOffset * SUBPIXEL_QUALITY);
+
+  vec2 finalUv = texCoords;
+  if (isHorizontal) {
+    finalUv.y += finalOffset * stepLength;
+  } else {
+    finalUv.x += finalOffset * stepLength;
+  }
+  FragColor = vec4(textureLod(sceneColor, finalUv, 0.0).rgb, 1.0);
+}
@@ -0,0 +1,25 @@
+#version 400 core
+// Sends each triangle to the shadow cascade layers selected by cascadeMask, one invocation per cascade.
+// Cascades with a lower resolution than the layers are clipped to the lower left corner, up to cascadeExtents in clip space.
+layout(triangles, invocations = 3) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+const int NUM_CASCADES = 3;
+
+uniform mat4 sunSpaceMatrices[NUM_CASCADES];
+uniform int cascadeMask;
+uniform float cascadeExtents[NUM_CASCADES];
+
+void main() {
+  if ((cascadeMask & (1 << gl_InvocationID)) == 0) {
+    return;
+  }
+  for (int i = 0; i < 3; i++) {
+    gl_Layer = gl_InvocationID;
+    gl_Position = sunSpaceMatrices[gl_InvocationID] * gl_in[i].gl_Position;
+    gl_ClipDistance[0] = cascadeExtents[gl_InvocationID] * gl_Position.w - gl_Position.x;
+    gl_ClipDistance[1] = cascadeExtents[gl_InvocationID] * gl_Position.w - gl_Position.y;
+    EmitVertex();
+  }
+  EndPrimitive();
+}
@@ -21,6 +21,9 @@ uniform mat4 view;
 uniform mat4 projection;
 uniform mat4 sunSpaceMatrix[NUM_CASCADES];
 
+// Matches the depth pre-pass exactly, see vertex_depth_prepass.glsl
+invariant gl_Position;
+
 const float e = 2.71828;
 
 void main() {
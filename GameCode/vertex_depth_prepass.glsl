@@ -0,0 +1,17 @@
+// Vertex shader for the depth pre-pass of the chunks
+#version 330 core
+layout(location = 0) in vec3 aPos;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+// Computed exactly like in the scene shader, so the shading pass can test its depth for equality
+invariant gl_Position;
+
+void main() {
+  vec4 modelPos = model * vec4(aPos, 1.0f);
+  vec4 viewPos = view * modelPos;
+
+  gl_Position = projection * viewPos;
+}
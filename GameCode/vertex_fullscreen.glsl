@@ -0,0 +1,11 @@
+// Vertex shader of the post-processing passes, a triangle covering the screen that needs no vertex buffer
+#version 330 core
+out vec2 texCoords;
+
+uniform vec2 uvScale;  // Part of the source texture that is stretched over the screen
+
+void main() {
+  vec2 pos = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+  texCoords = pos * uvScale;
+  gl_Position = vec4(pos * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,6 @@
+#version 330 core
+layout(location = 0) in vec3 aPos;
+layout(location = 4) in mat4 aModel;
+
+// World space position, projected to each cascade in the geometry shader
+void main() { gl_Position = aModel * vec4(aPos, 1.0); }
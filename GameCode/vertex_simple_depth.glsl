@@ -1,7 +1,7 @@
 #version 330 core
 layout(location = 0) in vec3 aPos;
 
-uniform mat4 sunSpaceMatrix;
 uniform mat4 model;
 
-void main() { gl_Position = sunSpaceMatrix * model * vec4(aPos, 1.0); }
\ No newline at end of file
+// World space position, projected to each cascade in the geometry shader
+void main() { gl_Position = model * vec4(aPos, 1.0); }